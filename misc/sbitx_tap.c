@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "sbitx_tap.h"
+
+/* Reads the shared memory tap of the radio (src/shm_tap.c)
+
+	The tap is mapped read-only, a reader never writes to it, so the
+	radio and the other readers don't know it is there. Link with -lrt:
+
+	gcc -o tap_reader tap_reader.c sbitx_tap.c -lrt
+*/
+
+// returns 0 once attached, -1 if the radio isn't running (or is another version)
+int sbitx_tap_attach(struct sbitx_tap *t){
+	int fd = shm_open(SHM_TAP_NAME, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	t->shm = mmap(NULL, sizeof(struct shm_tap), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t->shm == MAP_FAILED){
+		t->shm = NULL;
+		return -1;
+	}
+	if (__atomic_load_n(&t->shm->magic, __ATOMIC_ACQUIRE) != SHM_TAP_MAGIC
+		|| t->shm->version != SHM_TAP_VERSION){
+		sbitx_tap_detach(t);
+		return -1;
+	}
+	// start with what comes next
+	t->cursor = __atomic_load_n(&t->shm->head, __ATOMIC_ACQUIRE);
+	t->lost = 0;
+	return 0;
+}
+
+void sbitx_tap_detach(struct sbitx_tap *t){
+	if (t->shm)
+		munmap((void *)t->shm, sizeof(struct shm_tap));
+	t->shm = NULL;
+}
+
+/* copies the next block of the kinds asked for (SHM_TAP_RF | SHM_TAP_AUDIO).
+	Returns 1 with a block, 0 if there is nothing new yet, -1 if the radio
+	has started over (attach again) */
+int sbitx_tap_read(struct sbitx_tap *t, struct shm_tap_block *block, int kinds){
+	const struct shm_tap *shm = t->shm;
+
+	for (;;){
+		if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_TAP_MAGIC)
+			return -1;
+		uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+		if (head < t->cursor)
+			return -1;
+		if (head == t->cursor)
+			return 0;
+		// a whole ring behind, skip to the oldest that is still there
+		if (head - t->cursor > SHM_TAP_SLOTS - 1){
+			t->lost += head - t->cursor - (SHM_TAP_SLOTS - 1);
+			t->cursor = head - (SHM_TAP_SLOTS - 1);
+		}
+
+		const struct shm_tap_block *b = shm->blocks + t->cursor % SHM_TAP_SLOTS;
+		uint64_t expected = 2 * t->cursor + 2;
+		uint64_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == expected){
+			memcpy(block, b, sizeof(struct shm_tap_block));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+		}
+		t->cursor++;
+		if (seq != expected){
+			// the radio wrote over it before (or while) we read it
+			t->lost++;
+			continue;
+		}
+		if (block->kind & kinds)
+			return 1;
+	}
+}
@@ -0,0 +1,13 @@
+#include "../src/shm_tap.h"
+
+/* the reader side of the shared memory tap of the radio */
+
+struct sbitx_tap {
+	const struct shm_tap *shm;
+	uint64_t cursor;		// the next block to read
+	uint64_t lost;			// blocks that were overwritten before they were read
+};
+
+int sbitx_tap_attach(struct sbitx_tap *t);
+int sbitx_tap_read(struct sbitx_tap *t, struct shm_tap_block *block, int kinds);
+void sbitx_tap_detach(struct sbitx_tap *t);
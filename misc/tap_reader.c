@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "sbitx_tap.h"
+
+/* A test reader of the shared memory tap: once a second it prints the
+	blocks read and lost, the level of the rf and the audio and what the
+	radio is tuned to. Given a file name, it writes the audio into it as
+	16-bit samples at 96000 per second.
+
+	gcc -o tap_reader tap_reader.c sbitx_tap.c -lrt -lm
+	./tap_reader [audio.raw]
+*/
+
+int main(int argc, char **argv){
+	struct sbitx_tap tap;
+	struct shm_tap_block block;
+	FILE *pf = NULL;
+	double rf_power = 0, audio_power = 0;
+	long rf_count = 0, audio_count = 0, blocks = 0;
+	uint64_t next_report = 0;
+
+	if (argc > 1 && !(pf = fopen(argv[1], "w"))){
+		perror(argv[1]);
+		return 1;
+	}
+
+	while (sbitx_tap_attach(&tap) < 0){
+		printf("waiting for the radio\n");
+		sleep(1);
+	}
+
+	for (;;){
+		int e = sbitx_tap_read(&tap, &block, SHM_TAP_RF | SHM_TAP_AUDIO);
+		if (e < 0){
+			printf("the radio started over\n");
+			sbitx_tap_detach(&tap);
+			while (sbitx_tap_attach(&tap) < 0)
+				sleep(1);
+			continue;
+		}
+		if (e == 0){
+			usleep(5000);
+			continue;
+		}
+
+		blocks++;
+		for (uint32_t i = 0; i < block.count; i++){
+			double v = block.samples[i] / 2147483648.0;
+			if (block.kind == SHM_TAP_RF)
+				rf_power += v * v;
+			else
+				audio_power += v * v;
+		}
+		if (block.kind == SHM_TAP_RF)
+			rf_count += block.count;
+		else {
+			audio_count += block.count;
+			if (pf){
+				int16_t samples[SHM_TAP_BLOCK];
+				for (uint32_t i = 0; i < block.count; i++)
+					samples[i] = block.samples[i] >> 16;
+				fwrite(samples, sizeof(int16_t), block.count, pf);
+			}
+		}
+
+		if (block.timestamp >= next_report){
+			printf("%.1f s: %ld blocks, %llu lost, %d Hz (if %d) mode %d %s,"
+				" rf %.1f dBFS, audio %.1f dBFS\n",
+				(double)block.timestamp / SHM_TAP_RATE, blocks,
+				(unsigned long long)tap.lost, block.frequency, block.if_hz,
+				block.mode, block.tx ? "TX" : "RX",
+				10 * log10(rf_power / (rf_count ? rf_count : 1) + 1e-20),
+				10 * log10(audio_power / (audio_count ? audio_count : 1) + 1e-20));
+			next_report = block.timestamp + SHM_TAP_RATE;
+			rf_power = audio_power = 0;
+			rf_count = audio_count = blocks = 0;
+		}
+	}
+}
@@ -232,6 +232,44 @@ void filter_print(struct filter *f){
   }
 }
 
+/* decimating low pass filter of the modems, from 96000 to 12000 samples/sec.
+It is a windowed sinc (blackman), the aliases are down by 70 db.
+The taps are only evaluated for the output samples. */
+void decimator_init(struct decimator *d, double cutoff_hz){
+	float sum = 0;
+	double fc = cutoff_hz / 96000.0;
+
+	for (int i = 0; i < DECIMATOR_TAPS; i++){
+		double m = i - (DECIMATOR_TAPS - 1) / 2.0;
+		double sinc = m == 0 ? 2 * fc : sin(2 * M_PI * fc * m) / (M_PI * m);
+		double window = 0.42 - 0.5 * cos((2 * M_PI * i) / (DECIMATOR_TAPS - 1))
+			+ 0.08 * cos((4 * M_PI * i) / (DECIMATOR_TAPS - 1));
+		d->fir[i] = sinc * window;
+		sum += d->fir[i];
+	}
+	for (int i = 0; i < DECIMATOR_TAPS; i++)
+		d->fir[i] /= sum;
+	memset(d->history, 0, sizeof(d->history));
+}
+
+// the samples are scaled down by 256, the same as the cw decoder always had
+void decimator_run(struct decimator *d, int32_t *samples, int count, float *out, int factor){
+	float *x = d->history + DECIMATOR_TAPS - 1;
+
+	for (int i = 0; i < count; i++)
+		x[i] = samples[i] / 256.0;
+
+	for (int i = 0; i < count / factor; i++){
+		float sum = 0;
+		float *in = d->history + ((i + 1) * factor) - 1;
+		for (int t = 0; t < DECIMATOR_TAPS; t++)
+			sum += d->fir[t] * in[t];
+		out[i] = sum;
+	}
+
+	memmove(d->history, d->history + count, (DECIMATOR_TAPS - 1) * sizeof(float));
+}
+
 /*
 int main(int argc, char **argv){
 	float window[30];
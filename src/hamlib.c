@@ -1,39 +1,57 @@
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <stdarg.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <complex.h>
 #include <math.h>
-#include <fcntl.h>
-#include <complex.h>
 #include <fftw3.h>
 #include <pthread.h>
 #include "sdr.h"
 #include "sdr_ui.h"
+#include "hamlib.h"
+#include "net_client.h"
+
+/* The rigctl server (the hamlib NET protocol, on port 4532)
+
+	It runs on its own thread, one epoll loop for the listening socket
+	and all the clients, as many as connect. The loggers, panadapters
+	and rotator scripts poll it ten times a second and more, so it never
+	touches the fields of the gui:
+
+	- the reads (f, m, t, s, v, l RFPOWER) are answered from a snapshot
+	of the radio that the ui thread publishes under a seqlock, the
+	reader copies it and tries again if the ui was writing it meanwhile
+
+	- the writes (F, M, V, T, S, L) are queued to the ui thread, which
+	runs them from hamlib_poll() in its tick, publishes the snapshot and
+	wakes this loop through an eventfd. The client gets its RPRT then,
+	and its next command is read only after that, so a read that follows
+	a write sees what was written
+
+	A command prefixed by '+', ';', '|' or ',' gets the extended
+	response: the name of the command and its arguments, the values
+	labelled, all separated by newlines (or by the prefix) and an RPRT
+	at the end. Several commands can come on one line, each takes
+	the arguments that it needs.
+*/
 
 #define DEBUG 0
-#define MAX_CLIENTS 10
-static int client_sockets[MAX_CLIENTS] = {0};
-static int welcome_socket = -1;
-volatile int running = 1; // Control flag for the listener thread
-
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void handle_client_disconnection(int i, int sd) {
-    pthread_mutex_lock(&client_mutex);
-    if (client_sockets[i] == sd) {
-        printf("Closing client socket %d at index %d\n", sd, i);
-        close(sd);
-        client_sockets[i] = 0; // Mark as available
-    }
-    pthread_mutex_unlock(&client_mutex);
-}
+#define HAMLIB_PORT 4532
+#define HAMLIB_MAX_EVENTS 32
+#define HAMLIB_MAX_LINE 1000
+#define HAMLIB_MAX_OUT 8192		// a client that doesn't read its responses is dropped
+#define HAMLIB_WRITES 64
 
 //copied from gqrx on github
 static char dump_state_response[] =
@@ -126,425 +144,622 @@ RIG_EEND        // MUST BE LAST ITEM IN LAST
 };
 */
 
-int check_cmd(char *cmd, char *token){
-  if (strstr(cmd, token) == cmd)
-    return 1;
-  else
-    return 0;
+/* the radio as the rigctl clients see it */
+struct hamlib_state {
+    long freq;
+    char mode[10];
+    int passband;
+    int tx;
+    char vfo;
+    int split;
+    int drive;
+};
+
+static struct hamlib_state state;
+static unsigned int state_seq = 0;
+
+// the ui thread is the only writer
+static void hamlib_publish(){
+    struct hamlib_state s;
+    char value[10];
+
+    s.freq = get_freq();
+    get_field_value_by_label("MODE", s.mode);
+    if (!strcmp(s.mode, "DIGI"))
+        strcpy(s.mode, "PKTUSB");
+    s.passband = get_passband_bw();
+    s.tx = is_in_tx();
+    get_field_value_by_label("VFO", value);
+    s.vfo = value[0] == 'B' ? 'B' : 'A';
+    get_field_value_by_label("SPLIT", value);
+    s.split = strcmp(value, "OFF") != 0;
+    s.drive = field_int("DRIVE");
+
+    __atomic_store_n(&state_seq, state_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    state = s;
+    __atomic_store_n(&state_seq, state_seq + 1, __ATOMIC_RELEASE);
 }
 
-#define MAX_DATA 1000
-char incoming_data[MAX_CLIENTS][MAX_DATA];
-int incoming_ptr[MAX_CLIENTS] = {0};
+static void hamlib_snapshot(struct hamlib_state *s){
+    unsigned int seq;
+    do {
+        while ((seq = __atomic_load_n(&state_seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        *s = state;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&state_seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* the writes go to the ui thread and their results come back */
+struct hamlib_write {
+    uint64_t client;
+    char command;
+    char args[2][32];
+    int result;
+};
+
+static struct hamlib_write writes[HAMLIB_WRITES], done[HAMLIB_WRITES];
+static int writes_count = 0, done_count = 0;
+static pthread_mutex_t writes_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fd = -1;
+
+struct hamlib_client {
+    struct net_client net;      // first, net_client_reap() frees it
+    uint64_t id;
+    char in[HAMLIB_MAX_LINE];
+    int in_len;
+    char out[HAMLIB_MAX_OUT];
+    int out_len;
+    int waiting;                // for the ui to run a write
+    char pending[100];          // the extended header of that write
+    struct hamlib_client *next;
+};
 
-void send_response(int client_socket, char *response) {
-    int e = send(client_socket, response, strlen(response), 0);
+static struct hamlib_client *clients = NULL;
+static struct net_client *dead = NULL;     // closed, freed after the events
+static uint64_t next_client_id = 1;
+static int epoll_fd = -1;
+
+static void hamlib_send(struct hamlib_client *c, const char *fmt, ...){
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(c->out + c->out_len, HAMLIB_MAX_OUT - c->out_len, fmt, args);
+    va_end(args);
+    if (n >= HAMLIB_MAX_OUT - c->out_len)
+        c->out_len = HAMLIB_MAX_OUT;    // overflowed, hamlib_flush closes it
+    else
+        c->out_len += n;
 #if DEBUG > 0
-    printf("hamlib>>> response: [%s]\n", response);
+    printf("hamlib>>> response: [%s]\n", c->out);
 #endif
-    if (e < 0) {
-        printf("Hamlib client disconnected (send). Closing socket %d.\n", client_socket);
-        close(client_socket);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_sockets[i] == client_socket) {
-                client_sockets[i] = 0;
-                break;
-            }
-        }
-    }
 }
 
-void send_freq(int client_socket){
-  //Returns the active VFO's current frequency
-  char response[20];
-  sprintf(response, "%d\n", get_freq());
-  send_response(client_socket, response);
-}
-void send_mode(int client_socket){
-char mode[10];
-    char response[20];
-    get_field_value_by_label("MODE",mode);
-    if (!strcmp(mode,"DIGI"))
-      strcpy(mode,"PKTUSB");
-    sprintf(response,"%s\n%i\n", mode,  get_passband_bw());
-    send_response(client_socket, response);
-    //printf("[%s]",response);
-}
-void set_mode(int client_socket, char* f) {
-    char mode[10];
-    char cmd[50];
-    char passband[3];
-    char* tok = strtok(f," ");
-    if (tok != 0) {
-        strcpy(mode,tok);
-        tok = strtok(0," ");
-        //printf("Received mode: [%s] \n", mode);
-        if (tok != 0) {
-            strcpy(passband,tok);
-            //printf("Received bw: [%s] \n", passband);
-        }
-    } else {
-        //We didn't receive what was expected
-        send_response(client_socket, "RPRT -9\n");
+static void hamlib_close(struct hamlib_client *c){
+    struct hamlib_client **p;
+
+    if (c->net.closed)
         return;
-    } 
-    if (!strcmp(mode, "PKTUSB"))
-        strcpy(mode, "DIGI");
-    //printf("Mode? = '%s'\n", mode);
-    const char* supported_hamlib_modes[6] = {
-    "USB", "LSB", "CW", "CWR","DIGI","AM"
-    };
-    for (int i = 0; i < 6; i++) {
-        if (!strcmp(mode, supported_hamlib_modes[i])) {
-            char bw_str[10];
-            sprintf(cmd, "mode %s", mode);
-            cmd_exec(cmd);
-            if (!strcmp(passband,"0")) {
-                //passband=0 == use default BW for mode
-                sprintf(bw_str, "%d", get_default_passband_bw());
-	            field_set("BW", bw_str);
-            }
-            send_response(client_socket, "RPRT 0\n");
-            return;
+    printf("Hamlib client on socket %d closed\n", c->net.fd);
+    for (p = &clients; *p; p = &(*p)->next)
+        if (*p == c){
+            *p = c->next;
+            break;
         }
-    }
-    //Unknown mode
-    printf("Unknown mode passed: [%s]\n", mode);
-    send_response(client_socket, "RPRT -9\n");
-}
-void send_rfpower(int client_socket) {
-    char resp[3];
-    float drive = (float)field_int("DRIVE") / (float)100;
-    sprintf(resp, "%f\n", drive);
-    send_response(client_socket, resp);
-}
-void get_vfo(int client_socket) {
-    char currVFO[2];
-    get_field_value_by_label("VFO", currVFO);
-    //printf("Current VFO: %s\n", currVFO);
-    if (currVFO[0] == 'A') {
-        //active_vfo = 0;
-        send_response(client_socket, "VFOA\n");
-    } else {
-        //active_vfo = 1;
-        send_response(client_socket, "VFOB\n");
-    }
+    net_client_close(epoll_fd, &dead, &c->net);
 }
 
-void set_vfo(int client_socket, char* f) {
-    field_set("VFO", f);
-    //~ printf("[VFO%s\n]", f);
-    char response[6];
-    snprintf(response, sizeof(response), "VFO%s\n", f);
-    send_response(client_socket, "RPRT 0\n");
-}
+// returns -1 if the client was closed
+static int hamlib_flush(struct hamlib_client *c){
+    struct epoll_event ev;
 
-void get_split(int client_socket) {
-    char curr_split[4];
-    get_field_value_by_label("SPLIT", curr_split);
-    
-    if (!strcmp(curr_split,"OFF")) {
-        send_response(client_socket, "0\n");
-        get_vfo(client_socket);
+    if (c->out_len >= HAMLIB_MAX_OUT){
+        hamlib_close(c);
+        return -1;
     }
-    else {
-        send_response(client_socket, "1\n");
-        //In split mode, tx vfo is always B
-        send_response(client_socket, "VFOB\n");
+    while (c->out_len > 0){
+        int n = send(c->net.fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0){
+            hamlib_close(c);
+            return -1;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
     }
-    
+    /* wait for the socket to drain only while there is something left,
+        stop reading while the input is full (it waits on a write) */
+    ev.events = (c->in_len < HAMLIB_MAX_LINE ? EPOLLIN : 0)
+        | (c->out_len ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->net.fd, &ev);
+    return 0;
 }
-void hamlib_set_freq(int client_socket, char *f){
-#if DEBUG > 0
-    printf("hamlib_set_freq func arg: [%s]\n",f);
-#endif
-  long freq;
-  char cmd[50];
-  if (!strncmp(f, "VFO", 3))
-    freq = atoi(f+5);
-  else
-    freq = atoi(f);
-	sprintf(cmd, "freq %d", freq);
-#if DEBUG > 0
-    printf("Send string to cmd_exec: [%s]\n",cmd);
-#endif
-	cmd_exec(cmd);
-    send_response(client_socket, "RPRT 0\n");
+
+/* the commands */
+
+struct hamlib_command {
+    char letter;
+    const char *name;
+    int n_args;
+    int is_write;
+};
+
+static const struct hamlib_command commands[] = {
+    {'F', "set_freq", 1, 1},
+    {'f', "get_freq", 0, 0},
+    {'M', "set_mode", 2, 1},
+    {'m', "get_mode", 0, 0},
+    {'V', "set_vfo", 1, 1},
+    {'v', "get_vfo", 0, 0},
+    {'T', "set_ptt", 1, 1},
+    {'t', "get_ptt", 0, 0},
+    {'S', "set_split_vfo", 2, 1},
+    {'s', "get_split_vfo", 0, 0},
+    {'L', "set_level", 2, 1},
+    {'l', "get_level", 1, 0},
+    {'u', "get_func", 1, 0},
+    {0, "chk_vfo", 0, 0},
+    {0, "dump_state", 0, 0},
+    {0, "get_powerstat", 0, 0},
+    {0, "get_lock_mode", 0, 0},
+    {'q', "quit", 0, 0},
+    {'Q', "quit", 0, 0},
+    {0, NULL, 0, 0}
+};
+
+static const struct hamlib_command *hamlib_lookup(const char *token){
+    for (int i = 0; commands[i].name; i++){
+        if (token[0] == '\\' && !strcmp(token + 1, commands[i].name))
+            return commands + i;
+        if (token[0] && !token[1] && token[0] == commands[i].letter)
+            return commands + i;
+    }
+    return NULL;
 }
-	
-
-void tx_control(int client_socket, int s){
-	//printf("tx_control(%d)\n", s);
-  if (s == 1){
-    hamlib_tx(1);
-  }
-  if (s == 0){
-    hamlib_tx(0);
-  }
-  if (s == -1) {
-      char tx_status[100];
-      sdr_request("stat:tx=1", tx_status);
-      if (!strcmp(tx_status, "ok on"))
-          send_response(client_socket, "1\n");
-      else
-          send_response(client_socket, "0\n");
-      return;
-  }
-  send_response(client_socket, "RPRT 0\n");
 
+static char *hamlib_token(char **p){
+    char *start;
+
+    while (**p == ' ' || **p == '\t' || **p == '\r')
+        (*p)++;
+    if (!**p)
+        return NULL;
+    start = *p;
+    while (**p && **p != ' ' && **p != '\t' && **p != '\r')
+        (*p)++;
+    if (**p)
+        *(*p)++ = 0;
+    return start;
 }
 
-void interpret_command(int client_socket, char* cmd) {
-    if (cmd[0] == 'T' || check_cmd(cmd, "\\set_ptt")) {
-        if (strchr(cmd, '0'))
-            tx_control(client_socket, 0); //if there is a zero in it, we are to rx
-        else
-            tx_control(client_socket, 1); //this is a shaky way to do it, who has the time to parse?
-    } 
-    else if (check_cmd(cmd, "F") || check_cmd(cmd, "\\set_freq"))
-        if (cmd[0] == 'F')
-            hamlib_set_freq(client_socket, cmd + 2);
-        else
-            hamlib_set_freq(client_socket, cmd + 10);
-    else if (check_cmd(cmd, "\\chk_vfo"))
-        //Lets not default to VFO mode
-        send_response(client_socket, "0\n");
-    else if (check_cmd(cmd, "\\dump_state"))
-        send_response(client_socket, dump_state_response);
-    else if (check_cmd(cmd, "V VFOA") || check_cmd(cmd, "\\set_vfo VFOA")) {
-        set_vfo(client_socket, "A");
-    }
-    else if (check_cmd(cmd, "V VFOB") || check_cmd(cmd, "\\set_vfo VFOB")) {
-        set_vfo(client_socket, "B");
-    } else if (check_cmd(cmd, "v")|| check_cmd(cmd, "\\get_vfo")) {
-        get_vfo(client_socket);
-    } else if (cmd[0] == 'm' || check_cmd(cmd, "\\get_mode"))
-        send_mode(client_socket);
-    else if (cmd[0] == 'M' || check_cmd(cmd, "\\set_mode")) {
-        if (cmd[0] == 'M')
-            set_mode(client_socket, cmd + 2);
+/* the values of a read, labelled in the extended response */
+static void hamlib_values(struct hamlib_client *c, char ext, const char *header,
+    int n, const char **labels, char values[][32]){
+    char sep = ext == '+' ? '\n' : ext;
+
+    if (ext)
+        hamlib_send(c, "%s%c", header, sep);
+    for (int i = 0; i < n; i++){
+        if (ext)
+            hamlib_send(c, "%s: %s%c", labels[i], values[i], sep);
         else
-            set_mode(client_socket, cmd + 10);
-    } else if (cmd[0] == 'f' || check_cmd(cmd, "\\get_freq"))
-        send_freq(client_socket);
-    else  if (cmd[0] == 's' || check_cmd(cmd, "\\get_split_vfo")) {
-        get_split(client_socket);
-        
-    } else if (check_cmd(cmd, "t") || check_cmd(cmd, "\\get_ptt"))
-        tx_control(client_socket, -1);
-    else if (check_cmd(cmd, "\\get_powerstat"))
-        send_response(client_socket, "1\n");
-    else if (check_cmd(cmd, "\\get_lock_mode"))
-        send_response(client_socket, "0\n");
-    else if (check_cmd(cmd, "q") || check_cmd(cmd, "Q")) {
-        send_response(client_socket, "RPRT 0\n");
-        close(client_socket);
-        client_socket = -1;
+            hamlib_send(c, "%s\n", values[i]);
     }
-    else if (check_cmd(cmd, "u TUNER"))
-        send_response(client_socket, "0\n");
-  else if (check_cmd(cmd, "l RFPOWER")) {
-        send_rfpower(client_socket);
-  }  else { 
-    printf("Hamlib: Unrecognized command [%s] '%c'\n", cmd, cmd[0]);
-    //Send an unimplemented response error code
-    send_response(client_socket, "RPRT -11\n");
-  }
+    if (ext)
+        hamlib_send(c, "RPRT 0\n");
 }
 
-void hamlib_handler(int client_socket, char *data, int len) {
-    int client_index = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_sockets[i] == client_socket) {
-            client_index = i;
+static void hamlib_result(struct hamlib_client *c, char ext, const char *header,
+    int result){
+    if (ext)
+        hamlib_send(c, "%s%c", header, ext == '+' ? '\n' : ext);
+    hamlib_send(c, "RPRT %d\n", result);
+}
+
+static void hamlib_read(struct hamlib_client *c, const struct hamlib_command *cmd,
+    char ext, const char *header, char args[][32]){
+    struct hamlib_state s;
+    char values[2][32];
+    const char *labels[2];
+
+    hamlib_snapshot(&s);
+    switch(cmd->letter){
+    case 'f':
+        labels[0] = "Frequency";
+        sprintf(values[0], "%ld", s.freq);
+        hamlib_values(c, ext, header, 1, labels, values);
+        break;
+    case 'm':
+        labels[0] = "Mode";
+        labels[1] = "Passband";
+        strcpy(values[0], s.mode);
+        sprintf(values[1], "%d", s.passband);
+        hamlib_values(c, ext, header, 2, labels, values);
+        break;
+    case 'v':
+        labels[0] = "VFO";
+        sprintf(values[0], "VFO%c", s.vfo);
+        hamlib_values(c, ext, header, 1, labels, values);
+        break;
+    case 't':
+        labels[0] = "PTT";
+        sprintf(values[0], "%d", s.tx ? 1 : 0);
+        hamlib_values(c, ext, header, 1, labels, values);
+        break;
+    case 's':
+        //in split, the tx is always on vfo b
+        labels[0] = "Split";
+        labels[1] = "TX VFO";
+        sprintf(values[0], "%d", s.split);
+        sprintf(values[1], "VFO%c", s.split ? 'B' : s.vfo);
+        hamlib_values(c, ext, header, 2, labels, values);
+        break;
+    case 'l':
+        if (strcmp(args[0], "RFPOWER")){
+            hamlib_result(c, ext, header, -11);
             break;
         }
-    }
-    if (client_index == -1) return;
-
-    for (int i = 0; i < len; i++) {
-        if (data[i] == '\n') {
-            incoming_data[client_index][incoming_ptr[client_index]] = 0;
-            incoming_ptr[client_index] = 0;
-            interpret_command(client_socket, incoming_data[client_index]);
-        } else if (incoming_ptr[client_index] < MAX_DATA) {
-            incoming_data[client_index][incoming_ptr[client_index]++] = data[i];
+        labels[0] = args[0];
+        sprintf(values[0], "%f", s.drive / 100.0);
+        hamlib_values(c, ext, header, 1, labels, values);
+        break;
+    case 'u':
+        labels[0] = args[0];
+        strcpy(values[0], "0");
+        hamlib_values(c, ext, header, 1, labels, values);
+        break;
+    default:
+        if (!strcmp(cmd->name, "dump_state"))
+            hamlib_send(c, "%s", dump_state_response);
+        else {
+            //lets not default to the vfo mode
+            labels[0] = !strcmp(cmd->name, "chk_vfo") ? "ChkVFO"
+                : !strcmp(cmd->name, "get_powerstat") ? "Power Status" : "Locked";
+            strcpy(values[0], strcmp(cmd->name, "get_powerstat") ? "0" : "1");
+            hamlib_values(c, ext, header, 1, labels, values);
         }
+        break;
     }
 }
 
-void hamlib_start() {
-    struct sockaddr_in serverAddr;
-    welcome_socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+/* runs the commands on a line, returns where it stopped: at the end, or
+    after a write that the client has to wait on */
+static char *hamlib_line(struct hamlib_client *c, char *p){
+    char *token;
+
+    while (!c->waiting && (token = hamlib_token(&p)) != NULL){
+        char ext = 0;
+        char args[2][32] = {"", ""};
+        char header[100];
+        const struct hamlib_command *cmd;
+
+        if (strchr("+;|,", token[0])){
+            ext = token[0];
+            token++;
+            if (!*token && !(token = hamlib_token(&p)))
+                break;
+        }
+        cmd = hamlib_lookup(token);
+        if (!cmd){
+            printf("Hamlib: Unrecognized command [%s]\n", token);
+            //Send an unimplemented response error code
+            hamlib_result(c, ext, token, -11);
+            continue;
+        }
 
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(4532);
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);
+        snprintf(header, sizeof(header), "%s:", cmd->name);
+        for (int i = 0; i < cmd->n_args; i++){
+            char *arg = hamlib_token(&p);
+            // the vfo, if the client insists on passing one
+            if (arg && cmd->letter != 'V' && !strncmp(arg, "VFO", 3) && i == 0)
+                arg = hamlib_token(&p);
+            if (!arg)
+                break;
+            strncpy(args[i], arg, sizeof(args[i]) - 1);
+            snprintf(header + strlen(header), sizeof(header) - strlen(header),
+                " %s", args[i]);
+        }
 
-    bind(welcome_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-    listen(welcome_socket, 5);
-    printf("Server listening on port 4532\n");
-    
-}
+        if (cmd->letter == 'q' || cmd->letter == 'Q'){
+            hamlib_send(c, "RPRT 0\n");
+            c->waiting = -1;    // close it once the response is out
+            break;
+        }
+        if (!cmd->is_write){
+            hamlib_read(c, cmd, ext, header, args);
+            continue;
+        }
 
-int get_max_sd() {
-    int max_sd = welcome_socket;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_sockets[i] > max_sd) {
-            max_sd = client_sockets[i];
+        pthread_mutex_lock(&writes_lock);
+        // the results have to fit in done[] as well
+        if (writes_count + done_count < HAMLIB_WRITES){
+            struct hamlib_write *w = writes + writes_count++;
+            w->client = c->id;
+            w->command = cmd->letter;
+            memcpy(w->args, args, sizeof(args));
+            c->waiting = 1;
+            if (ext)
+                snprintf(c->pending, sizeof(c->pending), "%s%c", header,
+                    ext == '+' ? '\n' : ext);
+            else
+                c->pending[0] = 0;
         }
+        pthread_mutex_unlock(&writes_lock);
+        if (!c->waiting)
+            hamlib_result(c, ext, header, -14);    // RIG_BUSBUSY
     }
-    return max_sd;
+    return p;
 }
 
-void *hamlib_slice(void *arg) {
-    hamlib_start(); // Initialize the server socket here in the thread
-    fd_set read_fds;
-    int sd, activity, new_socket;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-
-    while (running) {
-        // Clear and set up file descriptor set for select
-        FD_ZERO(&read_fds);
-        FD_SET(welcome_socket, &read_fds);
-        
-        // Recalculate max_sd before each select call
-        int max_sd = get_max_sd();
-
-        // Add all active client sockets to the set
-        pthread_mutex_lock(&client_mutex);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            sd = client_sockets[i];
-            if (sd > 0) {
-                FD_SET(sd, &read_fds);
+// runs the complete lines that came in, as far as it can without waiting
+static void hamlib_process(struct hamlib_client *c){
+    char *end;
+
+    while (!c->waiting && (end = memchr(c->in, '\n', c->in_len)) != NULL){
+        char line[HAMLIB_MAX_LINE + 1];
+        int len = end - c->in;
+        char *rest;
+
+        memcpy(line, c->in, len);
+        line[len] = 0;
+        memmove(c->in, end + 1, c->in_len - len - 1);
+        c->in_len -= len + 1;
+
+        rest = hamlib_line(c, line);
+        // what is left of the line waits for the write, put it back in front
+        while (*rest == ' ')
+            rest++;
+        if (*rest && c->waiting > 0){
+            int n = strlen(rest);
+            if (n + 1 + c->in_len <= HAMLIB_MAX_LINE){
+                memmove(c->in + n + 1, c->in, c->in_len);
+                memcpy(c->in, rest, n);
+                c->in[n] = '\n';
+                c->in_len += n + 1;
             }
         }
-        pthread_mutex_unlock(&client_mutex);
-
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000; // 100 ms timeout
-
-        // Wait for activity on one of the sockets
-        //printf("Waiting on select with max_sd: %d\n", max_sd);
-        activity = select(max_sd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (activity < 0 && errno != EINTR) {
-            perror("select error");
-            break; // Exit loop if select fails
-        }
+    }
+}
 
-        // Check for new connection on welcome socket
-        if (FD_ISSET(welcome_socket, &read_fds)) {
-            new_socket = accept(welcome_socket, (struct sockaddr *)&address, &addrlen);
-            if (new_socket >= 0) {
-                printf("New client connected on socket %d\n", new_socket);
-                fcntl(new_socket, F_SETFL, O_NONBLOCK);
-
-                // Add new client socket
-                pthread_mutex_lock(&client_mutex);
-                int added = 0;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (client_sockets[i] == 0) {
-                        client_sockets[i] = new_socket;
-                        added = 1;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&client_mutex);
-
-                if (!added) {
-                    printf("Too many clients connected. Rejecting new client.\n");
-                    close(new_socket);
-                }
-            }
+static void hamlib_receive(struct hamlib_client *c){
+    for (;;){
+        int n = recv(c->net.fd, c->in + c->in_len, HAMLIB_MAX_LINE - c->in_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0){
+            // the responses to what it sent before it hung up
+            if (n == 0 && hamlib_flush(c) < 0)
+                return;
+            hamlib_close(c);
+            return;
         }
+        c->in_len += n;
+        // a line too long to be a command
+        if (c->in_len == HAMLIB_MAX_LINE && !memchr(c->in, '\n', c->in_len))
+            c->in_len = 0;
+        hamlib_process(c);
+        if (c->in_len == HAMLIB_MAX_LINE)
+            break;    // waiting on a write, the rest stays in the socket
+    }
+    if (hamlib_flush(c) == 0 && c->waiting < 0 && !c->out_len)
+        hamlib_close(c);
+}
 
-        // Process each client socket
-        pthread_mutex_lock(&client_mutex);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            sd = client_sockets[i];
-            if (sd > 0 && FD_ISSET(sd, &read_fds)) {
-                char buffer[1024];
-                int len = recv(sd, buffer, sizeof(buffer), 0);
-
-                if (len > 0) {
-                    buffer[len] = '\0';
-                    //printf("Data received from client %d: %s\n", sd, buffer);
-                    hamlib_handler(sd, buffer, len);
-                } else if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-                    printf("Client on socket %d disconnected or error occurred.\n", sd);
-                    close(sd);
-                    client_sockets[i] = 0; // Mark as available
-                    FD_CLR(sd, &read_fds); // Remove the socket from read_fds
-                }
-            }
+static void hamlib_accept(int listen_fd){
+    for (;;){
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        struct epoll_event ev;
+        int fd = accept4(listen_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
 
-            // Additional check with getsockopt to detect disconnected sockets
-            if (sd > 0) {
-                int error = 0;
-                socklen_t len = sizeof(error);
-                int retval = getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &len);
-                if (retval != 0 || error != 0) {
-                    printf("Detected closed connection or error on socket %d\n", sd);
-                    close(sd);
-                    client_sockets[i] = 0; // Mark as available
-                    FD_CLR(sd, &read_fds); // Remove the socket from read_fds
-                }
-            }
+        struct hamlib_client *c = calloc(1, sizeof(struct hamlib_client));
+        if (!c){
+            close(fd);
+            continue;
         }
-        pthread_mutex_unlock(&client_mutex);
+        c->net.fd = fd;
+        c->id = next_client_id++;
+        c->next = clients;
+        clients = c;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        printf("New hamlib client connected on socket %d\n", fd);
     }
+}
 
-    // Clean up on exit
-    close(welcome_socket);
-    pthread_mutex_lock(&client_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_sockets[i] > 0) {
-            close(client_sockets[i]);
-            client_sockets[i] = 0;
-        }
+// the ui ran the writes, their clients get the results and go on
+static void hamlib_completions(){
+    struct hamlib_write results[HAMLIB_WRITES];
+    uint64_t count;
+    int n;
+
+    read(wake_fd, &count, sizeof(count));
+    pthread_mutex_lock(&writes_lock);
+    n = done_count;
+    memcpy(results, done, n * sizeof(struct hamlib_write));
+    done_count = 0;
+    pthread_mutex_unlock(&writes_lock);
+
+    for (int i = 0; i < n; i++){
+        struct hamlib_client *c;
+        for (c = clients; c && c->id != results[i].client; c = c->next)
+            ;
+        if (!c)
+            continue;    // it has gone meanwhile
+        hamlib_send(c, "%sRPRT %d\n", c->pending, results[i].result);
+        c->waiting = 0;
+        hamlib_process(c);
+        if (hamlib_flush(c) == 0 && c->waiting < 0 && !c->out_len)
+            hamlib_close(c);
+    }
+}
+
+static void *hamlib_thread(void *arg){
+    struct sockaddr_in server_addr;
+    struct epoll_event ev, events[HAMLIB_MAX_EVENTS];
+    int listen_fd, yes = 1;
+    static int wake_marker;
+
+    listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(HAMLIB_PORT);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    memset(server_addr.sin_zero, '\0', sizeof server_addr.sin_zero);
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0
+        || listen(listen_fd, 16) < 0){
+        perror("hamlib server");
+        close(listen_fd);
+        return NULL;
     }
-    pthread_mutex_unlock(&client_mutex);
 
+    epoll_fd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &wake_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    printf("Server listening on port %d\n", HAMLIB_PORT);
+
+    for (;;){
+        int n = epoll_wait(epoll_fd, events, HAMLIB_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR){
+            perror("hamlib epoll");
+            break;
+        }
+        for (int i = 0; i < n; i++){
+            struct hamlib_client *c = events[i].data.ptr;
+            if (c == NULL)
+                hamlib_accept(listen_fd);
+            else if (events[i].data.ptr == &wake_marker)
+                hamlib_completions();
+            else if (c->net.closed)
+                continue;    // by an earlier event of this batch
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                hamlib_close(c);
+            else if (events[i].events & EPOLLIN)
+                hamlib_receive(c);
+            else if (events[i].events & EPOLLOUT){
+                if (hamlib_flush(c) == 0 && c->waiting < 0 && !c->out_len)
+                    hamlib_close(c);
+            }
+        }
+        net_client_reap(&dead);
+    }
+    close(listen_fd);
     return NULL;
 }
 
+static int hamlib_mode(char *mode, char *passband){
+    const char* supported_hamlib_modes[6] = {
+    "USB", "LSB", "CW", "CWR","DIGI","AM"
+    };
+    char cmd[50];
 
-
-// Function to start the listener thread
-void start_hamlib_listener() {
-    pthread_t listener_thread;
-    if (pthread_create(&listener_thread, NULL, hamlib_slice, NULL) != 0) {
-        perror("Failed to create listener thread");
-        exit(1);
+    if (!strcmp(mode, "PKTUSB"))
+        strcpy(mode, "DIGI");
+    for (int i = 0; i < 6; i++) {
+        if (!strcmp(mode, supported_hamlib_modes[i])) {
+            char bw_str[10];
+            sprintf(cmd, "mode %s", mode);
+            cmd_exec(cmd);
+            if (!strcmp(passband,"0")) {
+                //passband=0 == use default BW for mode
+                sprintf(bw_str, "%d", get_default_passband_bw());
+                field_set("BW", bw_str);
+            }
+            return 0;
+        }
     }
-    pthread_detach(listener_thread); // Detach the thread to run independently
+    //Unknown mode
+    printf("Unknown mode passed: [%s]\n", mode);
+    return -9;
 }
 
-// Function to stop the listener thread
-void stop_hamlib_listener() {
-    running = 0; // Stop the loop in hamlib_slice
-    close(welcome_socket); // Close the server socket to exit select
+static int hamlib_run(struct hamlib_write *w){
+    char cmd[50];
+
+    switch(w->command){
+    case 'F':
+        sprintf(cmd, "freq %ld", atol(w->args[0]));
+        cmd_exec(cmd);
+        return 0;
+    case 'M':
+        return hamlib_mode(w->args[0], w->args[1]);
+    case 'V':
+        if (strcmp(w->args[0], "VFOA") && strcmp(w->args[0], "VFOB"))
+            return -1;
+        field_set("VFO", w->args[0] + 3);
+        return 0;
+    case 'T':
+        hamlib_tx(atoi(w->args[0]) != 0);
+        return 0;
+    case 'S':
+        field_set("SPLIT", atoi(w->args[0]) ? "ON" : "OFF");
+        return 0;
+    case 'L':
+        if (strcmp(w->args[0], "RFPOWER"))
+            return -11;
+        sprintf(cmd, "%d", (int)(atof(w->args[1]) * 100 + 0.5));
+        field_set("DRIVE", cmd);
+        return 0;
+    }
+    return -11;
 }
 
-void *start_listener_thread(void *arg) {
-    start_hamlib_listener(); // This starts the listener and runs it in the new thread
-    return NULL;
+/* called from the ui tick: runs the writes that the clients queued and
+    keeps the snapshot up to date */
+void hamlib_poll(){
+    static unsigned int published_version = 0;
+    static int published_tx = -1;
+    struct hamlib_write pending[HAMLIB_WRITES];
+    uint64_t one = 1;
+    int n;
+
+    pthread_mutex_lock(&writes_lock);
+    n = writes_count;
+    memcpy(pending, writes, n * sizeof(struct hamlib_write));
+    writes_count = 0;
+    pthread_mutex_unlock(&writes_lock);
+
+    for (int i = 0; i < n; i++)
+        pending[i].result = hamlib_run(pending + i);
+
+    // publish only when a field has changed (or the tx has)
+    if (n || remote_journal_version() != published_version
+        || is_in_tx() != published_tx){
+        published_version = remote_journal_version();
+        published_tx = is_in_tx();
+        hamlib_publish();
+    }
+
+    if (n){
+        pthread_mutex_lock(&writes_lock);
+        for (int i = 0; i < n && done_count < HAMLIB_WRITES; i++)
+            done[done_count++] = pending[i];
+        pthread_mutex_unlock(&writes_lock);
+        write(wake_fd, &one, sizeof(one));
+    }
 }
 
 // Call this function in your GTK initialization code
 void initialize_hamlib() {
     pthread_t listener_thread;
-    
-    // Start the listener thread
-    if (pthread_create(&listener_thread, NULL, start_listener_thread, NULL) != 0) {
+
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    hamlib_publish();
+
+    if (pthread_create(&listener_thread, NULL, hamlib_thread, NULL) != 0) {
         perror("Failed to create listener thread");
         exit(1);
     }
-    
     pthread_detach(listener_thread); // Detach to ensure it doesn't block or need to be joined
 }
-
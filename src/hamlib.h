@@ -1,3 +1,2 @@
-void hamlib_start();
-void hamlib_slice();
-void initialize_hamlib(void);
\ No newline at end of file
+void initialize_hamlib(void);
+void hamlib_poll();
@@ -358,7 +358,7 @@ create table messages (
 );
 */
 
-void message_add(char *mode, unsigned int frequency, int outgoing, char *message){
+void message_add(const char *mode, unsigned int frequency, int outgoing, const char *message){
 	char date_str[10], time_str[10], freq_str[12], statement[1000], *err_msg;
 	static int err_output = 1;
 
@@ -13,5 +13,5 @@ void logbook_open();
 bool logbook_grid_exists(char *id);
 bool logbook_caller_exists(char * id);
 void logbook_delete(int id);
-void message_add(char *mode, unsigned int frequency, int outgoing, char *message);
+void message_add(const char *mode, unsigned int frequency, int outgoing, const char *message);
 
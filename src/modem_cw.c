@@ -7,10 +7,13 @@
 	TXing:
 	The keyer is adapted from KC4IFB's description in QEX of Sept/Oct 2009
 
-	The routine cw_get_sample() is called for each audio sample being being
-	transmitted. It has to be quick, without loops and with no device I/O.
-	The cw_get_sample() is also called from the thread that does DSP, so stalling
-	it is dangerous.
+	The routine cw_tx_block() is called for each block of audio samples being
+	transmitted. It has to be quick, with no device I/O. It is called from
+	the thread that does DSP, so stalling it is dangerous.
+	The keyer runs in runs of samples within the block, the key is
+	read and the state changes at the start of each run, until the keyer
+	has a count to run down. The rise and fall
+	of the envelope are read from a raised cosine table.
 
 	The modem_poll is called about 10 to 20 times a second from
 	the 'user interface' thread.
@@ -19,6 +22,11 @@
 	the key_poll stores the values read from the ISR of the PTT(DOT) and DASH
 	gpio lines
 
+	Each change of the key is also handed to cw_key_edge() by the ISR,
+	timestamped on the sample clock of the sound card. cw_tx_block() plays
+	these events out a block later, each at its own sample, so the keying
+	doesn't jitter with when the DSP thread gets to run.
+
 	the cw_read_key() routine returns the next dash/dot/space/, etc to be sent
 	the word 'symbol' is used to denote a dot, dash, a gaps that are dot, dash or
 	word long. These are defined in sdr.h (they shouldn't be)
@@ -28,17 +36,20 @@
 	read of a few Arduino decoders.
 
 	All the state variables are stored in the struct cw_decoder.
-	You could run multiple instances of the cw_decoder to simultaneously
-	decoder a band of signals. In the current implementation, we only use
-	one cw_decoder.
+	The main decoder listens at the pitch. The skimmer runs a bank of
+	more cw_decoders, one on each CW signal found in the passband
+	(see the skimmer section below).
 
 	cw_rx() is called to process the audio samples
 
-	1. Each cw_decoder has a struct bin that is initialized to a particular
-	central frequency.
+	1. The audio at 96000 samples/sec is low pass filtered and decimated
+	to 12000 samples/sec by decimator_run().
 
-	2. the n_bins field of cw_decoder takes that many samples at a time
-	and tried to calculate the magnitude of the signal at that freq.
+	2. The main cw_decoder has a struct bin with a bank of Goertzel filters,
+	spaced half a bin apart, around the pitch. The n_bins field of cw_decoder
+	takes that many samples at a time and calculates the magnitude of the
+	signal on each of them. The decoder follows the strongest of them, so
+	a station that is off by upto 150 Hz is still copied.
 
 	3. We maintained a running average of the highs and the lows (corresponding
 	to the signal peak and the noise floor). These are updated in a moving
@@ -76,6 +87,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -219,12 +231,12 @@ struct morse_rx morse_rx_table[] = {
 	{"ur", "..-.-."},
 };
 
+#define CW_RX_BANK 7		// goertzel filters around the pitch
+
 struct bin {
-	float coeff;
-	float sine;
-	float cosine;
-	float omega;
-	int k;
+	float coeff[CW_RX_BANK];
+	float avg[CW_RX_BANK];	// averaged magnitude of each filter
+	int lock;								// the filter that is followed
 	double scalingFactor;
 	int	freq;
 	int n;
@@ -254,6 +266,14 @@ struct cw_decoder{
 
 	struct bin signal;
 
+	// skimmer channels collect their text into lines tagged with the frequency
+	int is_skimmer;
+	int bin;		// the fft bin the skimmer channel is locked to
+	int freq;		// audio frequency of the bin
+	int idle_ticks;
+	char text[64];
+	int text_len;
+
 	// this is a shift register of the states encountered
 	int32_t history_sig;
 	struct symbol symbol_str[MAX_SYMBOLS];
@@ -261,16 +281,29 @@ struct cw_decoder{
 };
 
 struct cw_decoder decoder;
-#define FLOAT_SCALE (1073741824.0)
 
 /* cw tx state variables */
 static unsigned long millis_now = 0;
 
 static int cw_period;
-static struct vfo cw_tone, cw_env;
+static struct nco cw_tone;
 static int keydown_count=0;			//counts down pause afer a keydown is finished
 static int keyup_count = 0;			//counts down how long a key is held down
-static float cw_envelope = 1;		//used to shape the envelope
+
+#define CW_EDGE 384					// 4 msec rise and fall time at 96000 samples/sec
+static float cw_edge[CW_EDGE + 1];	//raised cosine rise, read backwards to fall
+static int cw_edge_index = 0;
+
+/* key events, in the order of the samples they happened at */
+#define CW_KEY_EVENTS 64
+struct cw_key_event {
+	int64_t sample;
+	int key;
+};
+static struct cw_key_event cw_key_events[CW_KEY_EVENTS];
+static int cw_key_head = 0, cw_key_tail = 0;
+static pthread_mutex_t cw_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cw_key_state = CW_IDLE;	//the key at the sample being generated
 static int cw_tx_until = 0;			//delay switching to rx, expect more txing
 static int data_tx_until = 0;
 
@@ -311,7 +344,7 @@ static uint8_t cw_get_next_symbol(){  //symbol to translate into CW_DOT, CW_DASH
 }
 
 
-//cw_read_key() is called 96000 times a second
+//cw_read_key() is called at the start of each run of the keyer
 //it should not poll gpio lines or text input, those are done in modem_poll()
 //and we only read the status from the variable updated by modem_poll()
 
@@ -319,8 +352,6 @@ static int cw_read_key(){
 	char c;
 
 	//process cw key before other cw inputs (macros, keyboard)
-	int cw_key_state = key_poll();
-
 	//preference to the keyer activity
 	if (cw_key_state != CW_IDLE) {
 		return cw_key_state;
@@ -356,18 +387,45 @@ static int cw_read_key(){
 		return CW_IDLE;
 }
 
-// Trying to improve CW straight-key performance (and performance with external electronic keyers)
-// without changing electronic keyer function, performance or timing
-float cw_tx_get_sample() {
-  float sample = 0;        // the shaped CW level (0 to 1)
-  uint8_t symbol_now = cw_read_key();
+/* called from the key's ISR with the new state of the key (from key_poll()),
+it may be called from any thread */
+void cw_key_edge(int key){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	int64_t sample = sound_time_sample(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+
+	pthread_mutex_lock(&cw_key_lock);
+	int next = (cw_key_head + 1) % CW_KEY_EVENTS;
+	if (next == cw_key_tail) //full, drop the oldest
+		cw_key_tail = (cw_key_tail + 1) % CW_KEY_EVENTS;
+	cw_key_events[cw_key_head].sample = sample;
+	cw_key_events[cw_key_head].key = key;
+	cw_key_head = next;
+	pthread_mutex_unlock(&cw_key_lock);
+}
 
-  if (!keydown_count && !keyup_count) {
-    millis_now = millis();  //REVERT FARHAN JUL 2024 CW FIX
-    if (cw_tone.freq_hz != get_pitch()) // set CW pitch if needed
-      vfo_start( &cw_tone, get_pitch(), 0);
-  }
+/* applies the key events upto the sample, returns the sample of the
+next event still pending */
+static int64_t cw_key_update(int64_t sample){
+	int64_t next = INT64_MAX;
+
+	pthread_mutex_lock(&cw_key_lock);
+	while (cw_key_tail != cw_key_head){
+		if (cw_key_events[cw_key_tail].sample > sample){
+			next = cw_key_events[cw_key_tail].sample;
+			break;
+		}
+		cw_key_state = cw_key_events[cw_key_tail].key;
+		cw_key_tail = (cw_key_tail + 1) % CW_KEY_EVENTS;
+	}
+	pthread_mutex_unlock(&cw_key_lock);
+	return next;
+}
 
+// Trying to improve CW straight-key performance (and performance with external electronic keyers)
+// without changing electronic keyer function, performance or timing
+static void cw_tx_keyer(uint8_t symbol_now) {
   switch (cw_current_symbol) {
   case CW_IDLE:                   // this is the start case
     if (symbol_now & CW_DOWN) {   // the straight key has just gone down
@@ -462,62 +520,180 @@ float cw_tx_get_sample() {
     }
     break;
   }
+}
 
-  // Key the transmitter with some shaping on the leading and trailing edge
-  if (keydown_count > 0){
-	if(cw_envelope < 0.999)  // ramping up the leading edge
-		cw_envelope = ((vfo_read(&cw_env)/FLOAT_SCALE) + 1)/2;
-	keydown_count--;
+// the keyer settles within a few steps, each one takes a symbol or a character
+#define CW_KEYER_STEPS 16
+
+void cw_tx_block(float *samples, int count) {
+  int i = 0;
+  // the block plays out the key events of the block just captured
+  int64_t block_start = (int64_t)sound_sample_count() - count;
+
+  if (!keydown_count && !keyup_count) {
+    millis_now = millis();  //REVERT FARHAN JUL 2024 CW FIX
+    if (cw_tone.freq_hz != get_pitch()) // set CW pitch if needed
+      nco_set_freq(&cw_tone, get_pitch());
+  }
+
+  float tone[count];
+  nco_block(&cw_tone, tone, NULL, count);
+
+  while (i < count) {
+    int64_t next_event = cw_key_update(block_start + i);
+    uint8_t symbol_now;
+    // a bare transition (a delay ending in idle, a symbol with no timing)
+    // leaves nothing to count down, the keyer steps again at the same sample
+    for (int step = 0; step < CW_KEYER_STEPS; step++) {
+      symbol_now = cw_read_key();
+      cw_tx_keyer(symbol_now);
+      if (keydown_count || keyup_count || cw_current_symbol == CW_DOWN
+        || (cw_current_symbol == CW_IDLE && !symbol_next && !cw_bytes_available))
+        break;
+    }
+
+    // the length of this run, until the next state change or key event
+    int n = count - i;
+    if (next_event - (block_start + i) < n)
+      n = next_event - (block_start + i);
+    int key_down = keydown_count > 0;
+    if (cw_current_symbol == CW_DOWN) // held down, only the key decides
+      keydown_count--;
+    else if (key_down) {
+      if (keydown_count < n)
+        n = keydown_count;
+      keydown_count -= n;
+    }
+    else if (keyup_count > 0) {
+      if (keyup_count < n)
+        n = keyup_count;
+      keyup_count -= n;
+    }
+
+    // keep extending 'cw_tx_until' while we're sending
+    if (symbol_now & CW_DOWN || key_down)
+      cw_tx_until = millis_now + get_cw_delay();
+
+    // Key the transmitter with some shaping on the leading and trailing edge
+    for (int j = 0; j < n; j++, i++) {
+      if (key_down) {
+        if (cw_edge_index < CW_EDGE)
+          cw_edge_index++;
+      }
+      else if (cw_edge_index > 0)
+        cw_edge_index--;
+      if (cw_edge_index)
+        samples[i] = (tone[i] * cw_edge[cw_edge_index]) / 8;
+      else
+        samples[i] = 0;
+    }
   }
-  else { //keydown_count is zero
-		if(cw_envelope > 0.001)  // ramping down on the trailing edge
-		  cw_envelope = ((vfo_read(&cw_env)/FLOAT_SCALE) + 1)/2;
-		if (keyup_count > 0)
-		  keyup_count--;
-	}
-  sample = (vfo_read(&cw_tone) / FLOAT_SCALE) * cw_envelope;
 
-  // keep extending 'cw_tx_until' while we're sending
-  if (symbol_now & CW_DOWN || keydown_count > 0)
-	  cw_tx_until = millis_now + get_cw_delay();
   //if macro or keyboard characters remain in the buffer
   //prevent switching from xmit to rcv and cutting off macro
   if (cw_bytes_available != 0)
     cw_tx_until = millis_now + 1000;
-  return sample / 8;
 }
 
 
 static FILE *pfout = NULL; //this is debugging out, not used normally
 
+/* the filters are spaced half a bin apart, with the middle
+one at the pitch */
 static void cw_rx_bin_init(struct bin *p, float freq, int n,
 	float sampling_freq){
 
-  p->k = (int) (0.5 + ((n * freq) / sampling_freq));
-  p->omega = (2.0 * M_PI * p->k) / n;
-  p->sine = sin(p->omega);
-  p->cosine = cos(p->omega);
-  p->coeff = 2.0 * p->cosine;
+	for (int i = 0; i < CW_RX_BANK; i++){
+		float f = freq + ((i - CW_RX_BANK/2) * sampling_freq) / (2 * n);
+		p->coeff[i] = 2.0 * cos((2.0 * M_PI * f) / sampling_freq);
+		p->avg[i] = 0;
+	}
+	p->lock = CW_RX_BANK/2;
 	p->n = n;
 	p->freq = freq;
 	p->scalingFactor = n / 2.0;
 }
 
-static int cw_rx_bin_detect(struct bin *p, int32_t *data){
-	float Q2 = 0;
-	float Q1 = 0;
-	for (int index = 0; index < p->n; index++){
-	  float Q0;
-  	Q0 = p->coeff * Q1 - Q2 + (float) (*data);
-  	Q2 = Q1;
-  	Q1 = Q0;
-		data++;
- 	}
-	double real = (Q1 * p->cosine - Q2) / p->scalingFactor;
-  double imag = (Q1 * p->sine) / p->scalingFactor;
-
- 	int  magnitude = sqrt(real*real + imag*imag);
-	return magnitude;
+/* runs all the filters of the bank over the block together, the
+inner loop runs across the bank so that it vectorizes. The magnitude
+is from the last two states as the filters need not be on integer bins */
+static int cw_rx_bin_detect(struct bin *p, float *data){
+	float q0, q1[CW_RX_BANK], q2[CW_RX_BANK];
+	float mag[CW_RX_BANK];
+
+	for (int j = 0; j < CW_RX_BANK; j++)
+		q1[j] = q2[j] = 0;
+
+	for (int i = 0; i < p->n; i++){
+		float x = data[i];
+		for (int j = 0; j < CW_RX_BANK; j++){
+			q0 = p->coeff[j] * q1[j] - q2[j] + x;
+			q2[j] = q1[j];
+			q1[j] = q0;
+		}
+	}
+
+	int best = p->lock;
+	for (int j = 0; j < CW_RX_BANK; j++){
+		float power = (q1[j] * q1[j]) + (q2[j] * q2[j]) - (p->coeff[j] * q1[j] * q2[j]);
+		mag[j] = sqrt(power > 0 ? power : 0) / p->scalingFactor;
+		p->avg[j] = (0.9 * p->avg[j]) + (0.1 * mag[j]);
+		if (p->avg[j] > p->avg[best])
+			best = j;
+	}
+
+	// move to another filter only if it is clearly stronger
+	if (p->avg[best] > 1.5 * p->avg[p->lock])
+		p->lock = best;
+
+	return mag[p->lock];
+}
+
+// decimating low pass filter from 96000 to 12000 samples/sec, cutoff at 3 KHz
+static struct decimator cw_rx_decimator;
+
+/* skimmer state, the dial, pitch and sideband are cached by cw_poll()
+as the skimmer runs on the dsp thread */
+static int skimmer_on = 0;
+static long skimmer_dial = 0;
+static int skimmer_pitch = 0;
+static int skimmer_reverse = 0;
+// the main decoder has left a line unfinished on the console
+static int cw_rx_mid_line = 0;
+
+static void cw_rx_flush(struct cw_decoder *p){
+	char buff[100];
+
+	if (p->text_len == 0)
+		return;
+	// the dial is at the carrier that is heard at the pitch
+	int offset = p->freq - skimmer_pitch;
+	long freq = skimmer_dial + (skimmer_reverse ? -offset : offset);
+	// start on a line of its own, the main decoder goes on on the next one
+	sprintf(buff, "%s%8.1f %s\n", cw_rx_mid_line ? "\n" : "", freq / 1000.0, p->text);
+	cw_rx_mid_line = 0;
+	write_console(STYLE_CW_RX, buff);
+	p->text_len = 0;
+	p->text[0] = 0;
+}
+
+// the main decoder writes straight out, the skimmer channels write by line
+static void cw_rx_write(struct cw_decoder *p, const char *text){
+	if (!p->is_skimmer){
+		write_console(STYLE_CW_RX, text);
+		if (*text)
+			cw_rx_mid_line = text[strlen(text) - 1] != '\n';
+		return;
+	}
+	if (*text == ' ' && p->text_len == 0)
+		return;
+	int l = strlen(text);
+	if (p->text_len + l >= sizeof(p->text) - 1)
+		cw_rx_flush(p);
+	strcpy(p->text + p->text_len, text);
+	p->text_len += l;
+	if (*text == ' ' && p->text_len > 30)
+		cw_rx_flush(p);
 }
 
 static void cw_rx_match_letter(struct cw_decoder *p){
@@ -564,11 +740,11 @@ static void cw_rx_match_letter(struct cw_decoder *p){
 	p->next_symbol = 0;
 	for (int i = 0; i < sizeof(morse_rx_table)/sizeof(struct morse_rx); i++)
 		if (!strcmp(code, morse_rx_table[i].code)){
-			write_console(STYLE_CW_RX, morse_rx_table[i].c);
+			cw_rx_write(p, morse_rx_table[i].c);
 			return;
 		}
 	//un-decoded phrases
-	write_console(STYLE_CW_RX, code);
+	cw_rx_write(p, code);
 
 }
 
@@ -646,7 +822,7 @@ static void cw_rx_detect_symbol(struct cw_decoder *p){
 	else if (p->mark == 0 && p->prev_mark == 0){ //continuing space
 		if (p->next_symbol == 0){
 	 		if(p->ticker > (p->dash_len * 3)/2){
-				write_console(STYLE_CW_RX, " ");
+				cw_rx_write(p, " ");
 				p->ticker = 0;
 			}
 		}
@@ -654,7 +830,7 @@ static void cw_rx_detect_symbol(struct cw_decoder *p){
 			cw_rx_add_symbol(p, ' ');
 			cw_rx_match_letter(p);
 			if (p->ticker > (p->dash_len * 3)/2){
-				write_console(STYLE_CW_RX, " ");
+				cw_rx_write(p, " ");
 			}
 			p->ticker = 0;
 		}
@@ -665,9 +841,8 @@ static void cw_rx_detect_symbol(struct cw_decoder *p){
 	}
 }
 
-static void cw_rx_bin(struct cw_decoder *p, int32_t *samples){
-
-	int sig_now = cw_rx_bin_detect(&p->signal, samples);
+// process the magnitude of the signal for one tick of the decoder
+static void cw_rx_process(struct cw_decoder *p, int sig_now){
 
 	p->magnitude = sig_now;
 
@@ -703,21 +878,22 @@ static void cw_rx_bin(struct cw_decoder *p, int32_t *samples){
 	}
 }
 
+static void cw_rx_bin(struct cw_decoder *p, float *samples){
+	cw_rx_process(p, cw_rx_bin_detect(&p->signal, samples));
+}
+
 void cw_rx(int32_t *samples, int count){
 	//the samples better be an integral multiple of n_bins
 	int decimation_factor = 96000/SAMPLING_FREQ;
-	if (count % (decimation_factor * decoder.n_bins)){
+	if (count != decimation_factor * decoder.n_bins){
 		printf("cw_decoder bins don't align up with sample block %d vs %d\n",
 			count, decoder.n_bins);
 		assert(0);
 	}
 
 	//we decimate the samples from 96000 to 12000
-	//this hard coded here
-	int32_t s[128];
-	for (int i = 0; i < decoder.n_bins; i++){
-		s[i] = samples[i * 8] >> 8;
-	}
+	float s[N_BINS];
+	decimator_run(&cw_rx_decimator, samples, count, s, decimation_factor);
 	cw_rx_bin(&decoder, s);
 }
 
@@ -731,36 +907,168 @@ void cw_rx(int32_t *samples, int count){
 	 For those transmitting at higher than 40 wpm, .. some other day
 */
 
-void cw_init(){
-	//cw rx initializeation
-	decoder.ticker = 0;
-	decoder.n_bins = N_BINS;
-	decoder.next_symbol = 0;
-	decoder.sig_state = 0;
-	decoder.magnitude= 0;
-	decoder.prev_mark = 0;
-	decoder.history_sig = 0;
-	decoder.symbol_magnitude = 0;
-	decoder.wpm = 12;
+static void cw_rx_decoder_init(struct cw_decoder *p, int wpm){
+	p->ticker = 0;
+	p->n_bins = N_BINS;
+	p->next_symbol = 0;
+	p->sig_state = 0;
+	p->magnitude= 0;
+	p->prev_mark = 0;
+	p->history_sig = 0;
+	p->symbol_magnitude = 0;
+	p->wpm = wpm;
 
 	// dot len (in msec)) = 1200/wpm; dash len = 3600/wpm
 	// each block of nbins = n_bins/sampling seconds;
 	// dash len is (3600 / wpm)/ ((nbins * 1000)/samping_freq)
-	decoder.dash_len = (18 * SAMPLING_FREQ) / (5 * N_BINS* INIT_WPM);
+	p->dash_len = (18 * SAMPLING_FREQ) / (5 * N_BINS* wpm);
+}
+
+/* skimmer
+
+	The fft of each block (in rx_linear()) gives us the magnitude of
+	every 46.875 Hz wide bin in the passband, once every 1024 samples.
+	That is the same tick as the main decoder's 128 samples at 12000
+	samples/sec. So, instead of running a Goertzel for each signal,
+	the bins are handed to cw_skimmer_bins() and each bin that
+	carries a CW signal gets a cw_decoder of its own.
+
+	1. Each bin has a noise floor that follows the lows quickly and
+	rises slowly, and an average that tracks the activity over half a second.
+
+	2. Every few ticks, the bins whose activity peaks 12 dB above
+	their noise floor are given a free channel, unless a channel
+	is already on or next to that bin. The bins on and next to the
+	pitch are left to the main decoder.
+
+	3. Each channel tracks its own speed, starting from SKIMMER_WPM.
+	The text is written to the console a line at a time, tagged with the
+	frequency of the signal, on a line of its own.
+
+	4. A channel whose bin has been quiet for a few seconds is released.
+*/
+
+#define SKIMMER_CHANNELS 8
+#define SKIMMER_LOW 300		// Hz
+#define SKIMMER_HIGH 3000	// Hz
+#define SKIMMER_WPM 25
+#define SKIMMER_SCAN 16		// ticks between looking for new signals
+#define SKIMMER_IDLE 470	// ticks (about 5 seconds) before a channel is released
+#define SKIMMER_SCALE 1000.0
+
+static struct cw_decoder skimmer[SKIMMER_CHANNELS];
+static float skimmer_floor[MAX_BINS/2];
+static float skimmer_avg[MAX_BINS/2];
+static int skimmer_ticks = 0;
+
+static void cw_skimmer_reset(){
+	for (int i = 0; i < SKIMMER_CHANNELS; i++)
+		skimmer[i].bin = 0;
+	memset(skimmer_floor, 0, sizeof(skimmer_floor));
+	memset(skimmer_avg, 0, sizeof(skimmer_avg));
+	skimmer_ticks = 0;
+}
 
+static void cw_skimmer_scan(int lo, int hi, int pitch_bin){
+	for (int k = lo + 1; k < hi - 1; k++){
+		if (abs(k - pitch_bin) <= 1)
+			continue;
+		if (skimmer_avg[k] < 4 * skimmer_floor[k]
+			|| skimmer_avg[k] < skimmer_avg[k-1] || skimmer_avg[k] < skimmer_avg[k+1])
+			continue;
+
+		int i, free_channel = -1;
+		for (i = 0; i < SKIMMER_CHANNELS; i++){
+			if (skimmer[i].bin && abs(skimmer[i].bin - k) <= 1)
+				break;
+			if (!skimmer[i].bin && free_channel == -1)
+				free_channel = i;
+		}
+		if (i < SKIMMER_CHANNELS || free_channel == -1)
+			continue;
+
+		struct cw_decoder *p = skimmer + free_channel;
+		memset(p, 0, sizeof(struct cw_decoder));
+		cw_rx_decoder_init(p, SKIMMER_WPM);
+		p->is_skimmer = 1;
+		p->bin = k;
+		p->freq = (k * 96000) / MAX_BINS;
+	}
+}
+
+/*
+	\a bins are the receiver's frequency bins, rotated so that bin 0
+	is at zero audio frequency. For the reversed sideband, the audio
+	frequencies run down from the top bin.
+*/
+void cw_skimmer_bins(fftw_complex *bins, int n_bins, int reverse){
+	float mag[MAX_BINS/2];
+	int lo = (SKIMMER_LOW * n_bins) / 96000;
+	int hi = (SKIMMER_HIGH * n_bins) / 96000;
+	int pitch_bin = (skimmer_pitch * n_bins + 48000) / 96000;
+
+	if (!skimmer_on)
+		return;
+
+	for (int k = lo; k < hi; k++){
+		mag[k] = cabs(bins[reverse ? n_bins - k : k]);
+		if (skimmer_floor[k] == 0 || mag[k] < skimmer_floor[k])
+			skimmer_floor[k] = (0.9 * skimmer_floor[k]) + (0.1 * mag[k]);
+		else
+			skimmer_floor[k] *= 1.0005;
+		skimmer_avg[k] = (0.98 * skimmer_avg[k]) + (0.02 * mag[k]);
+	}
+
+	if (++skimmer_ticks % SKIMMER_SCAN == 0)
+		cw_skimmer_scan(lo, hi, pitch_bin);
+
+	for (int i = 0; i < SKIMMER_CHANNELS; i++){
+		struct cw_decoder *p = skimmer + i;
+		if (!p->bin)
+			continue;
+
+		// the pitch was moved onto this signal, the main decoder has it now
+		if (abs(p->bin - pitch_bin) <= 1){
+			cw_rx_flush(p);
+			p->bin = 0;
+			continue;
+		}
+
+		cw_rx_process(p, mag[p->bin] * SKIMMER_SCALE);
+
+		if (skimmer_avg[p->bin] > 2 * skimmer_floor[p->bin])
+			p->idle_ticks = 0;
+		else if (++p->idle_ticks > SKIMMER_IDLE){
+			cw_rx_flush(p);
+			p->bin = 0;
+		}
+	}
+}
+
+void cw_skimmer(int on){
+	if (on && !skimmer_on)
+		cw_skimmer_reset();
+	skimmer_on = on;
+}
+
+void cw_init(){
+	//cw rx initializeation
+	cw_rx_decoder_init(&decoder, 12);
 	cw_rx_bin_init(&decoder.signal, INIT_TONE, N_BINS, SAMPLING_FREQ);
+	decimator_init(&cw_rx_decimator, 3000);
+	cw_skimmer_reset();
 
 	//init cw tx with some reasonable values
-  //cw_env shapes the envelope of the cw waveform
-  //frequency was at 50 (20 ms rise time), changed it to 200 (4 ms rise time)
-  //to improve cw performance at higher speeds
-	vfo_start(&cw_env, 200, 49044); //start in the third quardrant, 270 degree
-	vfo_start(&cw_tone, 700, 0);
+	//the edges are shaped as raised cosine (4 ms rise time)
+	//the same at all speeds
+	for (int i = 0; i <= CW_EDGE; i++)
+		cw_edge[i] = (1 - cos((M_PI * i) / CW_EDGE)) / 2;
+	nco_start(&cw_tone, 700, 0);
 	cw_period = 9600; 		// At 96ksps, 0.1sec = 1 dot at 12wpm
 	cw_key_letter[0] = 0;
 	keydown_count = 0;
 	keyup_count = 0;
-	cw_envelope = 0;
+	cw_edge_index = 0;
 }
 
 void cw_poll(int bytes_available, int tx_is_on){
@@ -770,6 +1078,9 @@ void cw_poll(int bytes_available, int tx_is_on){
 
 	//retune the rx pitch if needed
 	int cw_rx_pitch = field_int("PITCH");
+	skimmer_pitch = cw_rx_pitch;
+	skimmer_dial = get_freq();
+	skimmer_reverse = !strcmp(field_str("MODE"), "CWR");
 	if (cw_rx_pitch != decoder.signal.freq)
 		cw_rx_bin_init(&decoder.signal, cw_rx_pitch, N_BINS, SAMPLING_FREQ);
 
@@ -1,10 +1,13 @@
 void cw_rx(int *samples, int count);
-float cw_tx_get_sample();
+void cw_tx_block(float *samples, int count);
+void cw_key_edge(int key);
 void cw_init();
 void cw_abort();
 void cw_tx(char *message, int freq);
 void cw_poll(int bytes_available, int tx_is_on);
 float cw_next_sample();
+void cw_skimmer_bins(fftw_complex *bins, int n_bins, int reverse);
+void cw_skimmer(int on);
 
 #define N_BINS 128
 #define INIT_TONE 600
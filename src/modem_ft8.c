@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include "sdr.h"
 #include "sdr_ui.h"
+#include "sound.h"
 #include "modem_ft8.h"
 #include "logbook.h"
 
@@ -29,11 +30,21 @@
 #include "ft8_lib/ft8/text.h"
 #include "ft8_lib/fft/kiss_fftr.h"
 
-static int32_t ft8_rx_buff[FT8_MAX_BUFF];
-static float ft8_rx_buffer[FT8_MAX_BUFF];
-static float ft8_tx_buff[FT8_MAX_BUFF];
+// alternate slots are captured in alternate buffers, so that a slot
+// can be decoded while the next one is being captured
+static float ft8_rx_buffers[2][FT8_MAX_BUFF];
+static float *ft8_rx_buffer = ft8_rx_buffers[0];
+static long ft8_rx_slot = 0;		// the current slot, counted from the epoch
+static uint64_t ft8_rx_next = 0;	// the next capture sample to keep
+static int ft8_rx_skip = 0;			// don't decode the slot being captured
+static float *ft8_decode_buffer = NULL;
+static int ft8_decode_count = 0;
+static time_t ft8_decode_slot_time = 0;
+static int ft8_decode_is_ft4 = 0;
+static float ft8_tx_buff[FT8_TX_MAX_BUFF];
 static char ft8_tx_text[128];
 ftx_message_t ftx_tx_msg;
+static int ft8_tx_msg_serial = 0;	// bumped each time ftx_tx_msg is encoded
 static int ft8_rx_buff_index = 0;
 static int ft8_tx_buff_index = 0;
 static int	ft8_tx_nsamples = 0;
@@ -43,6 +54,34 @@ static int	ft8_pitch = 0;
 static int	ft8_mode = FT8_SEMI;
 static pthread_t ft8_thread;
 static int ft8_tx1st = 1;
+static int ft8_is_ft4 = 0;	// FT4 uses the same pipeline with 7.5 second slots
+
+/* additional messages sent in the same slots as ftx_tx_msg, each on its own
+pitch, to work several stations at once (like a fox) */
+#define FT8_MAX_STREAMS 4
+struct ft8_stream {
+	ftx_message_t msg;
+	int pitch;
+	char text[128];
+};
+static struct ft8_stream ft8_streams[FT8_MAX_STREAMS];
+static int ft8_nstreams = 0;
+
+/* the tx waveform is synthesized by ft8_thread, ahead of the slot.
+	ft8_do_synth hands the ft8_synth_* over to the thread and ft8_tx_buff
+	with the ft8_tx_buff_* back, it is stored with release and loaded with
+	acquire on both sides. Whoever doesn't own them leaves them alone. */
+static ftx_message_t ft8_synth_msg;
+static int ft8_synth_pitch = 0;
+static struct ft8_stream ft8_synth_streams[FT8_MAX_STREAMS];
+static int ft8_synth_nstreams = 0;
+static int ft8_synth_serial = 0;
+static int ft8_do_synth = 0;
+static int ft8_tx_buff_serial = -1; // the message serial in ft8_tx_buff
+static int ft8_tx_buff_pitch = 0;
+static int ft8_tx_buff_is_ft4 = 0;
+static int ft8_synth_is_ft4 = 0;
+static int ft8_tx_buff_len = 0;
 void ft8_tx(char *message, int freq);
 void ft8_interpret(char *received, char *transmit);
 extern void call_wipe();
@@ -50,7 +89,6 @@ extern void call_wipe();
 // how to handle a command option
 #define FT8_START_QSO 1
 #define FT8_CONTINUE_QSO 0
-static unsigned int wallclock =0;
 static const int kMin_score = 10; // Minimum sync score threshold for candidates
 static const int kMax_candidates = 120;
 static const int kLDPC_iterations = 20;
@@ -71,6 +109,14 @@ static const int kFieldType_style_map[] = {
 	STYLE_RST		// FTX_FIELD_RST (from the message text, not observed SNR)
 };
 
+static float ftx_slot_time(int is_ft4){
+	return is_ft4 ? FT4_SLOT_TIME : FT8_SLOT_TIME;
+}
+
+static const char *ftx_mode_name(int is_ft4){
+	return is_ft4 ? "FT4" : "FT8";
+}
+
 #define FT8_SYMBOL_BT 2.0f ///< symbol smoothing filter bandwidth factor (BT)
 #define FT4_SYMBOL_BT 1.0f ///< symbol smoothing filter bandwidth factor (BT)
 
@@ -184,80 +230,92 @@ static void gfsk_pulse(int n_spsym, float symbol_bt, float* pulse)
     }
 }
 
-/// Synthesize waveform data using GFSK phase shaping.
+/// Returns the GFSK pulse for n_spsym and symbol_bt, computing it only when
+/// either changes. All the streams of a transmission share it.
+static const float* gfsk_pulse_table(int n_spsym, float symbol_bt)
+{
+    static float *pulse = NULL;
+    static int pulse_n_spsym = 0;
+    static float pulse_bt = 0;
+
+    if (pulse && pulse_n_spsym == n_spsym && pulse_bt == symbol_bt)
+        return pulse;
+
+    // at 96 kHz the pulse is too large for the stack
+    pulse = (float *)realloc(pulse, 3 * n_spsym * sizeof(float));
+    gfsk_pulse(n_spsym, symbol_bt, pulse);
+    pulse_n_spsym = n_spsym;
+    pulse_bt = symbol_bt;
+    return pulse;
+}
+
+/// Synthesize waveform data using GFSK phase shaping and add it to signal.
 /// The output waveform will contain n_sym symbols.
+/// The smoothed frequency of each output sample is summed directly from the
+/// (at most three) overlapping symbol pulses and fed to the phase accumulator,
+/// so no intermediate frequency array is needed even at the radio's 96 kHz.
 /// @param[in] symbols Array of symbols (tones) (0-7 for FT8)
 /// @param[in] n_sym Number of symbols in the symbol array
 /// @param[in] f0 Audio frequency in Hertz for the symbol 0 (base frequency)
 /// @param[in] symbol_bt Symbol smoothing filter bandwidth (2 for FT8, 1 for FT4)
 /// @param[in] symbol_period Symbol period (duration), seconds
 /// @param[in] signal_rate Sample rate of synthesized signal, Hertz
-/// @param[out] signal Output array of signal waveform samples (should have space for n_sym*n_spsym samples)
+/// @param[in] amplitude Peak amplitude of this waveform
+/// @param[in,out] signal Array of signal waveform samples to add to (should have space for n_sym*n_spsym samples)
 ///
-static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol_bt, float symbol_period, int signal_rate, float* signal)
+static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol_bt, float symbol_period, int signal_rate, float amplitude, float* signal)
 {
     int n_spsym = (int)(0.5f + signal_rate * symbol_period); // Samples per symbol
     int n_wave = n_sym * n_spsym;                            // Number of output samples
     float hmod = 1.0f;
 
     LOG(LOG_DEBUG, "n_spsym = %d\n", n_spsym);
-    // Compute the smoothed frequency waveform.
-    // Length = (nsym+2)*n_spsym samples, first and last symbols extended
     float dphi_peak = 2 * M_PI * hmod / n_spsym;
-    float dphi[n_wave + 2 * n_spsym];
+    float dphi_f0 = 2 * M_PI * f0 / signal_rate;
+    const float *pulse = gfsk_pulse_table(n_spsym, symbol_bt);
 
-    // Shift frequency up by f0
-    for (int i = 0; i < n_wave + 2 * n_spsym; ++i)
-    {
-        dphi[i] = 2 * M_PI * f0 / signal_rate;
-    }
-
-    float pulse[3 * n_spsym];
-    gfsk_pulse(n_spsym, symbol_bt, pulse);
+    // envelope shaping of the first and last symbols
+    int n_ramp = n_spsym / 8;
 
-    for (int i = 0; i < n_sym; ++i)
+    // Symbol i spreads over [i*n_spsym, (i+3)*n_spsym) of the frequency waveform,
+    // which is offset by one symbol from the output. The dummy symbols at
+    // i = -1 and i = n_sym repeat the first and last tones respectively.
+    double phi = 0;
+    for (int k = 0; k < n_wave; ++k)
     {
-        int ib = i * n_spsym;
-        for (int j = 0; j < 3 * n_spsym; ++j)
+        float env = amplitude;
+        if (k < n_ramp)
+            env *= (1 - cosf(2 * M_PI * k / (2 * n_ramp))) / 2;
+        else if (k >= n_wave - n_ramp)
+            env *= (1 - cosf(2 * M_PI * (n_wave - 1 - k) / (2 * n_ramp))) / 2;
+        signal[k] += env * sinf(phi);
+
+        int e = k + n_spsym;
+        int last = e / n_spsym;
+        float dphi = dphi_f0;
+        for (int i = last - 2; i <= last; ++i)
         {
-            dphi[j + ib] += dphi_peak * symbols[i] * pulse[j];
+            if (i < -1 || i > n_sym)
+                continue;
+            int tone = symbols[i < 0 ? 0 : (i >= n_sym ? n_sym - 1 : i)];
+            dphi += dphi_peak * tone * pulse[e - i * n_spsym];
         }
-    }
-
-    // Add dummy symbols at beginning and end with tone values equal to 1st and last symbol, respectively
-    for (int j = 0; j < 2 * n_spsym; ++j)
-    {
-        dphi[j] += dphi_peak * pulse[j + n_spsym] * symbols[0];
-        dphi[j + n_sym * n_spsym] += dphi_peak * pulse[j] * symbols[n_sym - 1];
-    }
-
-    // Calculate and insert the audio waveform
-    float phi = 0;
-    for (int k = 0; k < n_wave; ++k)
-    { // Don't include dummy symbols
-        signal[k] = sinf(phi);
-        phi = fmodf(phi + dphi[k + n_spsym], 2 * M_PI);
-    }
-
-    // Apply envelope shaping to the first and last symbols
-    int n_ramp = n_spsym / 8;
-    for (int i = 0; i < n_ramp; ++i)
-    {
-        float env = (1 - cosf(2 * M_PI * i / (2 * n_ramp))) / 2;
-        signal[i] *= env;
-        signal[n_wave - 1 - i] *= env;
+        phi += dphi;
+        if (phi >= 2 * M_PI)
+            phi -= 2 * M_PI;
     }
 }
 
 /*!
-	Encode ftx_tx_msg.payload onto audio carrier \a freq and output to \a signal.
+	Encode \a msg payload onto audio carrier \a freq at peak \a amplitude
+	and add it to a slot of audio in \a signal, at FT8_TX_RATE,
+	the rate at which tx_process() consumes it.
+	The caller clears \a signal before adding the first message.
 	\a is_ft4 chooses FT4 encoding instead of FT8.
 	@return the number of audio samples
 */
-int sbitx_ftx_msg_audio(int32_t freq, float *signal, bool is_ft4)
+int sbitx_ftx_msg_audio(const ftx_message_t *msg, int32_t freq, float amplitude, float *signal, bool is_ft4)
 {
-	if (!freq)
-		freq = field_int("TX_PITCH");
     float frequency = 1.0 * freq;
 
     int num_tones = (is_ft4) ? FT4_NN : FT8_NN;
@@ -268,23 +326,18 @@ int sbitx_ftx_msg_audio(int32_t freq, float *signal, bool is_ft4)
     // Second, encode the binary message as a sequence of FSK tones
     uint8_t tones[num_tones]; // Array of 79 tones (symbols)
     if (is_ft4)
-        ft4_encode(ftx_tx_msg.payload, tones);
+        ft4_encode(msg->payload, tones);
     else
-        ft8_encode(ftx_tx_msg.payload, tones);
+        ft8_encode(msg->payload, tones);
 
     // Third, convert the FSK tones into an audio signal
-    int sample_rate = 12000;
+    int sample_rate = FT8_TX_RATE;
     int num_samples = (int)(0.5f + num_tones * symbol_period * sample_rate); // samples in the data signal
     int num_silence = (slot_time * sample_rate - num_samples) / 2;           // Silence  to make 15 seconds
     int num_total_samples = num_silence + num_samples + num_silence;         // total Number samples
 
-    for (int i = 0; i < num_silence; i++) {
-        signal[i] = 0;
-        signal[i + num_samples + num_silence] = 0;
-    }
-
-    // Synthesize waveform data (signal) and save it as WAV file
-    synth_gfsk(tones, num_tones, frequency, symbol_bt, symbol_period, sample_rate, signal + num_silence);
+    // Synthesize waveform data (signal)
+    synth_gfsk(tones, num_tones, frequency, symbol_bt, symbol_period, sample_rate, amplitude, signal + num_silence);
     return num_total_samples;
 }
 
@@ -298,6 +351,7 @@ int sbitx_ftx_msg_audio(int32_t freq, float *signal, bool is_ft4)
 int sbitx_ft8_encode(char *message, bool is_ft4)
 {
     ftx_message_rc_t rc = ftx_message_encode(&ftx_tx_msg, &hash_if, message);
+    ft8_tx_msg_serial++;
     if (rc != FTX_MESSAGE_RC_OK)
     {
         printf("Cannot encode FTx message! RC = %d\n", (int)rc);
@@ -325,6 +379,7 @@ int sbitx_ft8_encode_3f(const char* call_to, const char* call_de, const char* ex
 		}
 	}
 
+    ft8_tx_msg_serial++;
     if (rc != FTX_MESSAGE_RC_OK)
         printf("Cannot encode FTx 3-field message! RC = %d\n", (int)rc);
 
@@ -531,7 +586,11 @@ static int message_callsign_count(const ftx_message_offsets_t *spans)
 	return ret;
 }
 
-static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
+/*!
+	Decode \a num_samples at 12000 samples/sec in \a signal, captured from
+	the start of the slot at \a slot_time.
+*/
+static int sbitx_ft8_decode(float *signal, int num_samples, time_t slot_time, bool is_ft8)
 {
     int sample_rate = 12000;
 
@@ -548,11 +607,9 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
         .protocol = is_ft8 ? FTX_PROTOCOL_FT8 : FTX_PROTOCOL_FT4
     };
 
-		//timestamp the packets
-		//the time is shifted back by the time it took to capture these sameples
-		time_t	rawtime = (time_sbitx() / 15) * 15; //round to the earlier slot
+		//timestamp the packets with the start of the slot
 		char time_str[20], response[100];
-		struct tm *t = gmtime(&rawtime);
+		struct tm *t = gmtime(&slot_time);
 		sprintf(time_str, "%02d%02d%02d", t->tm_hour, t->tm_min, t->tm_sec);
 		const int time_str_len = strlen(time_str);
 
@@ -598,6 +655,8 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
 
         int freq_hz = lroundf((cand->freq_offset + (float)cand->freq_sub / mon.wf.freq_osr) / mon.symbol_period);
         float time_sec = (cand->time_offset + (float)cand->time_sub / mon.wf.time_osr) * mon.symbol_period;
+        // the signal starts half a second into the slot
+        float dt = time_sec - 0.5f;
 
         ftx_message_t message;
         ftx_decode_status_t status;
@@ -644,17 +703,16 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
             if (unpack_status != FTX_MESSAGE_RC_OK)
                 LOG(LOG_DEBUG, "Error [%d] while unpacking!", (int)unpack_status);
 
-			//message_add(char *mode, unsigned int frequency, int outgoing, char *message);
+			//message_add(const char *mode, unsigned int frequency, int outgoing, const char *message);
 			// TODO if allowed by settings:
-			message_add("FT8", freq_hz, 0, text);
+			message_add(ftx_mode_name(!is_ft8), freq_hz, 0, text);
 
 			char buf[64];
-			int prefix_len = snprintf(buf, sizeof(buf), "%s %3d %+03d %4d ~ ", time_str, cand->score, cand->snr, freq_hz);
+			// the time offset takes the column of the score, which nobody reads
+			int prefix_len = snprintf(buf, sizeof(buf), "%s %+4.1f %+03d %4d ~ ", time_str,
+				dt < -9.9f ? -9.9f : dt > 9.9f ? 9.9f : dt, cand->snr, freq_hz);
 			int line_len = prefix_len + snprintf(buf + prefix_len, sizeof(buf) - prefix_len, "%s\n", text);
-			LOG(LOG_DEBUG, "-> %s\n", buf);
-			//For troubleshooting you can display the time offset - n1qm
-			//sprintf(buff, "%s %d %+03d %-4.0f ~  %s\n", time_str, cand->time_offset,
-			//  cand->snr, freq_hz, message.payload);
+			LOG(LOG_DEBUG, "-> score %d %s\n", cand->score, buf);
 			text_span_semantic sem[FTX_MAX_MESSAGE_FIELDS + 4];
 			memset(sem, 0, sizeof(sem));
 			bool my_call_found = false;
@@ -667,7 +725,7 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
 			sem[sem_i++].semantic = STYLE_FT8_RX;
 			sem[sem_i].length = time_str_len; // 6
 			sem[sem_i++].semantic = STYLE_TIME;
-			col = time_str_len + 5; // skip "score"
+			col = time_str_len + 6; // skip the time offset
 			sem[sem_i].start_column = col;
 			sem[sem_i].length = 3;
 			sem[sem_i++].semantic = STYLE_SNR;
@@ -757,23 +815,63 @@ void ft8_setmode(int config){
 	}
 }
 
-static void ft8_start_tx(int offset_seconds){
+/*!
+	Ask ft8_thread to synthesize the current message at the current TX_PITCH,
+	unless ft8_tx_buff already holds it. The buffer is left alone while it is
+	being transmitted; ft8_poll() calls this again once the transmission ends.
+*/
+static void ft8_tx_prepare(){
+	int pitch = field_int("TX_PITCH");
+
+	if (ft8_tx_nsamples || __atomic_load_n(&ft8_do_synth, __ATOMIC_ACQUIRE))
+		return;
+	if (ft8_tx_buff_serial == ft8_tx_msg_serial && ft8_tx_buff_pitch == pitch
+		&& ft8_tx_buff_is_ft4 == ft8_is_ft4)
+		return;
+
+	ft8_synth_msg = ftx_tx_msg;
+	ft8_synth_pitch = pitch;
+	memcpy(ft8_synth_streams, ft8_streams, sizeof(ft8_streams));
+	ft8_synth_nstreams = ft8_nstreams;
+	ft8_synth_serial = ft8_tx_msg_serial;
+	ft8_synth_is_ft4 = ft8_is_ft4;
+	__atomic_store_n(&ft8_do_synth, 1, __ATOMIC_RELEASE);
+}
+
+static int ft8_tx_is_ready(){
+	return !__atomic_load_n(&ft8_do_synth, __ATOMIC_ACQUIRE) && ft8_tx_buff_serial == ft8_tx_msg_serial
+		&& ft8_tx_buff_pitch == field_int("TX_PITCH") && ft8_tx_buff_is_ft4 == ft8_is_ft4;
+}
+
+static void ft8_start_tx(){
 	char buf[100];
 	//timestamp the packets for display log
 	time_t	rawtime = time_sbitx();
 	struct tm *t = gmtime(&rawtime);
 
-	int freq = field_int("TX_PITCH");
-	if (freq != ft8_pitch)
-		ft8_pitch = freq;
-	ft8_tx_nsamples = sbitx_ftx_msg_audio(freq,  ft8_tx_buff, /* is_ft4*/ false);
+	// the waveform was already generated by ft8_thread
+	ft8_pitch = ft8_tx_buff_pitch;
 
-	snprintf(buf, sizeof(buf), "%02d%02d%02d  TX     %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, ft8_pitch, ft8_tx_text);
+	snprintf(buf, sizeof(buf), "%02d%02d%02d  TX      %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, ft8_pitch, ft8_tx_text);
 	write_console(STYLE_FT8_TX, buf);
-	message_add("FT8", ft8_pitch, 1, ft8_tx_text);
+	message_add(ftx_mode_name(ft8_is_ft4), ft8_pitch, 1, ft8_tx_text);
+	for (int i = 0; i < ft8_synth_nstreams; i++){
+		struct ft8_stream *st = ft8_synth_streams + i;
+		snprintf(buf, sizeof(buf), "%02d%02d%02d  TX      %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, st->pitch, st->text);
+		write_console(STYLE_FT8_TX, buf);
+		message_add(ftx_mode_name(ft8_is_ft4), st->pitch, 1, st->text);
+	}
 
-	ft8_tx_buff_index = offset_seconds * 96000;
-	printf("ft8_start_tx: starting @index %d based on offset_seconds %d\n", ft8_tx_buff_index, offset_seconds);
+	// pick up the waveform at the sample the slot has reached by now
+	uint64_t now = sound_sample_count();
+	double slot_time = ftx_slot_time(ft8_is_ft4);
+	double slot_start = floor(sound_sample_time(now) / slot_time) * slot_time;
+	int64_t offset = (int64_t)now - sound_time_sample(slot_start);
+	if (offset < 0)
+		offset = 0;
+	ft8_tx_buff_index = offset < ft8_tx_buff_len ? offset : ft8_tx_buff_len;
+	ft8_tx_nsamples = ft8_tx_buff_len;
+	printf("ft8_start_tx: starting @index %d into the slot\n", ft8_tx_buff_index);
 }
 
 /*!
@@ -797,8 +895,9 @@ void ft8_tx(char *message, int freq){
 		ft8_pitch = freq;
 	}
 	sbitx_ft8_encode(ft8_tx_text, false);
+	ft8_tx_prepare();
 
-	sprintf(buff, "%02d%02d%02d  TX     %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, freq, ft8_tx_text);
+	sprintf(buff, "%02d%02d%02d  TX      %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, freq, ft8_tx_text);
 	write_console(STYLE_FT8_QUEUED, buff);
 
 	//also set the times of transmission
@@ -841,10 +940,11 @@ void ft8_tx_3f(const char* call_to, const char* call_de, const char* extra) {
 	ft8_pitch = field_int("TX_PITCH");
 
 	snprintf(ft8_tx_text, sizeof(ft8_tx_text), "%s %s %s", call_to, call_de, extra);
-	sprintf(buff, "%02d%02d%02d  TX     %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, ft8_pitch, ft8_tx_text);
+	sprintf(buff, "%02d%02d%02d  TX      %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, ft8_pitch, ft8_tx_text);
 	write_console(STYLE_FT8_QUEUED, buff);
 
 	sbitx_ft8_encode_3f(call_to, call_de, extra, false);
+	ft8_tx_prepare();
 
 	// also set the times of transmission
 	char str_tx1st[10], str_repeat[10];
@@ -867,6 +967,47 @@ void ft8_tx_3f(const char* call_to, const char* call_de, const char* extra) {
 	}
 }
 
+/*!
+	Add \a message as another stream, modulated on \a freq, to be sent
+	in the same slots as the message queued by ft8_tx() or ft8_tx_3f().
+	@return -1 if the message can't be encoded or all the streams are taken
+*/
+int ft8_tx_stream(const char *message, int freq){
+	char buff[200];
+	time_t	rawtime = time_sbitx();
+	struct tm *t = gmtime(&rawtime);
+
+	if (ft8_nstreams >= FT8_MAX_STREAMS){
+		write_console(STYLE_LOG, "FT8: no free streams, use \\ft8stream clear\n");
+		return -1;
+	}
+
+	struct ft8_stream *st = ft8_streams + ft8_nstreams;
+	int i;
+	for (i = 0; message[i] && i < sizeof(st->text) - 1; i++)
+		st->text[i] = toupper(message[i]);
+	st->text[i] = 0;
+	st->pitch = freq;
+
+	if (ftx_message_encode(&st->msg, &hash_if, st->text) != FTX_MESSAGE_RC_OK){
+		printf("Cannot encode FTx stream message [%s]\n", st->text);
+		return -1;
+	}
+	ft8_nstreams++;
+	ft8_tx_msg_serial++;
+
+	sprintf(buff, "%02d%02d%02d  TX      %4d ~ %s\n", t->tm_hour, t->tm_min, t->tm_sec, freq, st->text);
+	write_console(STYLE_FT8_QUEUED, buff);
+	ft8_tx_prepare();
+	return 0;
+}
+
+// drop all the additional streams
+void ft8_tx_stream_clear(){
+	ft8_nstreams = 0;
+	ft8_tx_msg_serial++;
+}
+
 void *ft8_thread_function(void *ptr){
 	FILE *pf;
 	char buff[1000], mycallsign_upper[20]; //there are many ways to crash sbitx, bufferoverflow of callsigns is 1
@@ -875,51 +1016,92 @@ void *ft8_thread_function(void *ptr){
 	while(1){
 		usleep(1000);
 
+		if (__atomic_load_n(&ft8_do_synth, __ATOMIC_ACQUIRE)){
+			// share the peak amplitude equally, the PA sees the same PEP
+			// as a single stream
+			float amplitude = 1.0f / (1 + ft8_synth_nstreams);
+
+			memset(ft8_tx_buff, 0, sizeof(ft8_tx_buff));
+			ft8_tx_buff_len = sbitx_ftx_msg_audio(&ft8_synth_msg, ft8_synth_pitch,
+				amplitude, ft8_tx_buff, ft8_synth_is_ft4);
+			for (int i = 0; i < ft8_synth_nstreams; i++)
+				sbitx_ftx_msg_audio(&ft8_synth_streams[i].msg, ft8_synth_streams[i].pitch,
+					amplitude, ft8_tx_buff, ft8_synth_is_ft4);
+			ft8_tx_buff_pitch = ft8_synth_pitch;
+			ft8_tx_buff_serial = ft8_synth_serial;
+			ft8_tx_buff_is_ft4 = ft8_synth_is_ft4;
+			__atomic_store_n(&ft8_do_synth, 0, __ATOMIC_RELEASE);
+		}
+
 		if (!ft8_do_decode)
 			continue;
 
 		ft8_do_decode = 0;
-		sbitx_ft8_decode(ft8_rx_buffer, ft8_rx_buff_index, true);
-		//let the next batch begin
-		ft8_rx_buff_index = 0;
+		sbitx_ft8_decode(ft8_decode_buffer, ft8_decode_count, ft8_decode_slot_time, !ft8_decode_is_ft4);
 	}
 }
 
 // the ft8 sampling is at 12000, the incoming samples are at
-// 96000 samples/sec
+// 96000 samples/sec.
+// The slots are cut at the exact capture sample where they begin,
+// using the sample clock timebase of the sound loop
 void ft8_rx(int32_t *samples, int count){
 
 	int decimation_ratio = 96000/12000;
-
-	//if there is an overflow, then reset to the begining
-	if (ft8_rx_buff_index + (count/decimation_ratio) >= FT8_MAX_BUFF){
-		ft8_rx_buff_index = 0;
-		printf("Buffer Overflow\n");
+	int is_ft4 = ft8_is_ft4;
+	double slot_time = ftx_slot_time(is_ft4);
+
+	// the block holds the latest capture samples
+	uint64_t first = sound_sample_count() - count;
+	uint64_t end = first + count;
+
+	// has a new slot begun by the end of this block?
+	long slot = (long)floor(sound_sample_time(end) / slot_time);
+	uint64_t boundary = end;
+	int64_t slot_start = 0;
+	if (slot != ft8_rx_slot){
+		slot_start = sound_time_sample(slot * slot_time);
+		boundary = slot_start > (int64_t)first ? slot_start : first;
 	}
 
+	// if blocks were missed (while in another mode), this slot is incomplete
+	if (ft8_rx_next + decimation_ratio < first)
+		ft8_rx_skip = 1;
+
 	//down convert to 12000 Hz sampling rate
-	for (int i = 0; i < count; i += decimation_ratio)
-		//ft8_rx_buff[ft8_rx_buff_index++] = samples[i];
-		ft8_rx_buffer[ft8_rx_buff_index++] = samples[i] / 200000000.0f;
+	if (ft8_rx_next < first)
+		ft8_rx_next = first;
+	for (; ft8_rx_next < boundary; ft8_rx_next += decimation_ratio){
+		if (ft8_rx_buff_index < FT8_MAX_BUFF)
+			ft8_rx_buffer[ft8_rx_buff_index++] = samples[ft8_rx_next - first] / 200000000.0f;
+	}
 
-	int now = time_sbitx();
-	if (now != wallclock)
-		wallclock = now;
-	else
-		return;
+	//the transmissions end well before the last second of the slot,
+	//start decoding then (by the 14th second for ft8), the rest is silence anyway
+	if (ft8_rx_buff_index >= (slot_time - 1) * 12000 && !ft8_rx_skip){
+		ft8_rx_skip = 1;
+		ft8_decode_buffer = ft8_rx_buffer;
+		ft8_decode_count = ft8_rx_buff_index;
+		ft8_decode_slot_time = (time_t)(ft8_rx_slot * slot_time);
+		ft8_decode_is_ft4 = is_ft4;
+		ft8_do_decode = 1;
+	}
 
-	int slot_second = wallclock % 15;
-	if (slot_second == 0)
-		ft8_rx_buff_index = 0;
+	if (boundary == end)
+		return;
 
-//	printf("ft8 decoding trigger index %d, slot_second %d\n", ft8_rx_buff_index, slot_second);
-	//we should have atleast 12 seconds of samples to decode
-	if (ft8_rx_buff_index >= 13 * 12000 && slot_second > 13)
-		ft8_do_decode = 1;
+	// switch to the other buffer for the new slot
+	ft8_rx_slot = slot;
+	ft8_rx_buffer = ft8_rx_buffer == ft8_rx_buffers[0] ? ft8_rx_buffers[1] : ft8_rx_buffers[0];
+	ft8_rx_buff_index = 0;
+	// we may have joined the slot after it began
+	ft8_rx_skip = slot_start < (int64_t)first;
+	for (ft8_rx_next = boundary; ft8_rx_next < end; ft8_rx_next += decimation_ratio)
+		ft8_rx_buffer[ft8_rx_buff_index++] = samples[ft8_rx_next - first] / 200000000.0f;
 }
 
-void ft8_poll(int seconds, int tx_is_on){
-	static int last_second = 0;
+void ft8_poll(int tx_is_on){
+	static long last_slot = 0;
 
 	//if we are already transmitting, we continue
 	//until we run out of ft8 sampels
@@ -933,34 +1115,49 @@ void ft8_poll(int seconds, int tx_is_on){
 		return;
 	}
 
-	if (!ft8_repeat || seconds == last_second)
+	//we are here only if we are rx-ing and we have a pending transmission
+	double slot_time = ftx_slot_time(ft8_is_ft4);
+	long slot = (long)floor(sound_sample_time(sound_sample_count()) / slot_time);
+	if (!ft8_repeat || slot == last_slot)
 		return;
 
-	//we poll for this only once every second
-	//we are here only if we are rx-ing and we have a pending transmission
-	last_second = seconds = seconds % 60;
-
-	if (
-		(ft8_tx1st == 1 && ((seconds >= 0  && seconds < 15) ||
-			(seconds >=30 && seconds < 45))) ||
-		(ft8_tx1st == 0 && ((seconds >= 15 && seconds < 30)||
-			(seconds >= 45 && seconds < 59)))){
-		ft8_start_tx(seconds % 15);
+	// keep the waveform in step with the message and TX_PITCH
+	ft8_tx_prepare();
+	if (!ft8_tx_is_ready())
+		return;
+
+	//we decide only once for each slot: the even slots (the 0 and
+	//30 second ones for ft8) are the 'tx 1st' ones
+	last_slot = slot;
+	if (ft8_tx1st == !(slot % 2)){
+		ft8_start_tx();
 		if (ft8_tx_nsamples)
 			tx_on(TX_SOFT);
 		ft8_repeat--;
 	}
 }
 
-float ft8_next_sample(){
-		float sample = 0;
-		if (ft8_tx_buff_index/8 < ft8_tx_nsamples){
-			sample = ft8_tx_buff[ft8_tx_buff_index/8]/7;
-			ft8_tx_buff_index++;
-		}
-		else //stop transmitting ft8
-			ft8_tx_nsamples = 0;
-		return sample;
+/*!
+	Fill \a samples with the next \a count samples of the transmission,
+	padding with silence once the waveform runs out.
+	@return the number of waveform samples copied
+*/
+int ft8_next_block(float *samples, int count){
+	int n = ft8_tx_nsamples - ft8_tx_buff_index;
+
+	if (n > count)
+		n = count;
+	if (n < 0)
+		n = 0;
+	for (int i = 0; i < n; i++)
+		samples[i] = ft8_tx_buff[ft8_tx_buff_index++] / 7;
+	for (int i = n; i < count; i++)
+		samples[i] = 0;
+
+	//stop transmitting ft8
+	if (n < count)
+		ft8_tx_nsamples = 0;
+	return n;
 }
 
 bool is_token_char(char ch) {
@@ -1046,6 +1243,15 @@ int ft8_message_tokenize(char *message){
 	return 0;
 }
 
+/*!
+	Is the message time \a hhmmss in one of the 'tx 1st' (even) slots?
+	The FT4 slots start at half seconds, which are truncated in the time stamp.
+*/
+static int ftx_msg_slot_is_1st(int hhmmss){
+	int msg_second = hhmmss % 100;
+	return !((int)((msg_second + 0.5) / ftx_slot_time(ft8_is_ft4)) % 2);
+}
+
 void set_call_field(const char *s) {
 	if (strcmp(s, "<...>") == 0)
 		return;
@@ -1064,8 +1270,7 @@ void ft8_on_start_qso(char *message){
 
 	//for cq message that started on 0 or 30th second, use the 15 or 45 and
 	//vice versa
-	int msg_second = msg_time % 100;
-	if (msg_second < 15 || (msg_second >= 30 && msg_second < 45))
+	if (ftx_msg_slot_is_1st(msg_time))
 		ft8_tx1st = 0; //we tx on 2nd and 4ht slots for msgs on 1st and 3rd
 	else
 		ft8_tx1st = 1;
@@ -1160,7 +1365,7 @@ void ft8_call(int sel_time) {
 	report_send = field_str("SENT");
 	mycall = field_str("MYCALLSIGN");
 	// initial pitch; but it can also be adjusted between timeslots
-	// (audio is re-generated in ft8_start_tx())
+	// (audio is re-generated by ft8_tx_prepare())
 	ft8_pitch = field_int("TX_PITCH");
 	//use only the first 4 letters of the grid
 	strcpy(mygrid, field_str("MYGRID"));
@@ -1170,8 +1375,7 @@ void ft8_call(int sel_time) {
 	// for CQ (or other) message that started in the 0 or 30-second timeslot,
 	// send reply in the 15 or 45 second; and vice-versa
 	// i.e. tx on 2nd and 4th slots for msgs on 1st and 3rd
-	const int msg_second = msg_time % 100;
-	ft8_tx1st = !(msg_second < 15 || (msg_second >= 30 && msg_second < 45));
+	ft8_tx1st = !ftx_msg_slot_is_1st(msg_time);
 
 	ft8_tx_3f(call, mycall, mygrid);
 }
@@ -1263,7 +1467,17 @@ void ft8_init(){
 	pthread_create( &ft8_thread, NULL, ft8_thread_function, (void*)NULL);
 }
 
+// switch between FT8 and FT4, the next slot starts afresh
+void ft8_set_protocol(int is_ft4){
+	if (is_ft4 == ft8_is_ft4)
+		return;
+	ft8_abort();
+	ft8_is_ft4 = is_ft4;
+	write_console(STYLE_LOG, is_ft4 ? "FT4 slots are 7.5 seconds\n" : "FT8 slots are 15 seconds\n");
+}
+
 void ft8_abort(){
 	ft8_tx_nsamples = 0;
 	ft8_repeat = 0;
+	ft8_tx_stream_clear();
 }
@@ -1,10 +1,16 @@
 #define FT8_MAX_BUFF (12000 * 18)
+// tx waveforms are synthesized at the radio's sampling rate
+#define FT8_TX_RATE 96000
+#define FT8_TX_MAX_BUFF (FT8_TX_RATE * 15)
 void ft8_rx(int32_t *samples, int count);
 void ft8_init();
 void ft8_abort();
 void ft8_tx(char *message, int freq);
 void ft8_tx_3f(const char* call_to, const char* call_de, const char* extra);
-void ft8_poll(int seconds, int tx_is_on);
-float ft8_next_sample();
+int ft8_tx_stream(const char *message, int freq);
+void ft8_tx_stream_clear();
+void ft8_poll(int tx_is_on);
+void ft8_set_protocol(int is_ft4);
+int ft8_next_block(float *samples, int count);
 void ft8_call(int sel_time);
 void ft8_process(char *message, int operation);
@@ -0,0 +1,587 @@
+/*
+	Native PSK31 and PSK63 modem, in BPSK and QPSK.
+
+	Rxing:
+	1. The audio at 96000 samples/sec is low pass filtered and decimated
+	to 12000 samples/sec by decimator_run().
+
+	2. Each struct psk_channel mixes its signal down to zero with its own
+	oscillator, decimates it to 16 samples per symbol and passes it through
+	a symbol long raised cosine filter (psk_rx_channel()).
+
+	3. The symbol clock is recovered by balancing the energy of the early
+	and the late halves of the symbol (as fldigi does).
+
+	4. At each symbol, a Costas loop steers the channel's oscillator in phase
+	and frequency, so the channel stays on a signal that drifts. The data
+	is in the change of phase from the last symbol. BPSK bits are read
+	directly, QPSK symbols go to a Viterbi decoder (K=5, rate 1/2).
+
+	5. The bits are assembled into varicode characters.
+
+	The first channel is always on the pitch, and writes straight to the
+	console. When scanning, the rest of the channels are assigned to the
+	PSK signals found in the frequency bins of the receiver
+	(see psk_rx_bins()) and their text is written a line at a time, tagged
+	with their audio frequency.
+
+	Txing:
+	psk_tx_block() generates a block of samples at 96000 samples/sec.
+	The change of phase between the symbols is shaped as a raised cosine
+	over the whole symbol. The transmission starts with 32 phase reversals,
+	the typed text follows with idle reversals when there is nothing to send,
+	and a '^r' in the text ends the transmission with a steady carrier.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <pthread.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "modem_psk.h"
+
+static const char *psk_varicode[128] = {
+	"1010101011", "1011011011", "1011101101", "1101110111",	// NUL SOH STX ETX
+	"1011101011", "1101011111", "1011101111", "1011111101",	// EOT ENQ ACK BEL
+	"1011111111", "11101111",   "11101",      "1101101111",	// BS HT LF VT
+	"1011011101", "11111",      "1101110101", "1110101011",	// FF CR SO SI
+	"1011110111", "1011110101", "1110101101", "1110101111",	// DLE DC1 DC2 DC3
+	"1101011011", "1101101011", "1101101101", "1101010111",	// DC4 NAK SYN ETB
+	"1101111011", "1101111101", "1110110111", "1101010101",	// CAN EM SUB ESC
+	"1101011101", "1110111011", "1011111011", "1101111111",	// FS GS RS US
+	"1",          "111111111",  "101011111",  "111110101",	// space ! " #
+	"111011011",  "1011010101", "1010111011", "101111111",	// $ % & '
+	"11111011",   "11110111",   "101101111",  "111011111",	// ( ) * +
+	"1110101",    "110101",     "1010111",    "110101111",	// , - . /
+	"10110111",   "10111101",   "11101101",   "11111111",	// 0 1 2 3
+	"101110111",  "101011011",  "101101011",  "110101101",	// 4 5 6 7
+	"110101011",  "110110111",  "11110101",   "110111101",	// 8 9 : ;
+	"111101101",  "1010101",    "111010111",  "1010101111",	// < = > ?
+	"1010111101", "1111101",    "11101011",   "10101101",	// @ A B C
+	"10110101",   "1110111",    "11011011",   "11111101",	// D E F G
+	"101010101",  "1111111",    "111111101",  "101111101",	// H I J K
+	"11010111",   "10111011",   "11011101",   "10101011",	// L M N O
+	"11010101",   "111011101",  "10101111",   "1101111",	// P Q R S
+	"1101101",    "101010111",  "110110101",  "101011101",	// T U V W
+	"101110101",  "101111011",  "1010101101", "111110111",	// X Y Z [
+	"111101111",  "111111011",  "1010111111", "101101101",	// \ ] ^ _
+	"1011011111", "1011",       "1011111",    "101111",		// ` a b c
+	"101101",     "11",         "111101",     "1011011",		// d e f g
+	"101011",     "1101",       "111101011",  "10111111",	// h i j k
+	"11011",      "111011",     "1111",       "111",			// l m n o
+	"111111",     "110111111",  "10101",      "10111",		// p q r s
+	"101",        "110111",     "1111011",    "1101011",		// t u v w
+	"11011111",   "1011101",    "111010101",  "1010110111",	// x y z {
+	"110111011",  "1010110101", "1011010111", "1110110101"	// | } ~ DEL
+};
+
+// the varicode, read as a binary number, gives back the character
+static char psk_varicode_rx[1024];
+
+#define PSK_RATE 12000
+#define PSK_TX_RATE 96000
+#define PSK_SPS 16				// samples per symbol in the channels
+#define PSK_CHANNELS 8
+#define PSK_K 5						// constraint length of the QPSK code
+#define PSK_POLY1 0x19
+#define PSK_POLY2 0x17
+#define PSK_PREAMBLE 32
+#define PSK_POSTAMBLE 32
+#define PSK_AFC_RANGE 40	// Hz, that a channel can drift off its start
+#define PSK_SCAN_BLOCKS 32	// between looking for new signals
+#define PSK_IDLE_SYMBOLS 320	// without a carrier, before the channel is released
+
+struct psk_channel {
+	int in_use;
+	int freq_start;
+	double freq;		// tracked by the loop
+	double phase;
+
+	complex double acc;	// decimating to PSK_SPS per symbol
+	int acc_count;
+	complex double hist[2 * PSK_SPS];
+	int hist_index;
+
+	float syncbuf[PSK_SPS];
+	double bitclk;
+	complex double prev;
+	complex double last;	// the previous filtered sample
+	complex double fll;		// rotation between the samples, over a symbol
+
+	float quality;
+	int dcd;
+	int idle;
+	unsigned int shreg;		// varicode bits
+
+	// viterbi
+	float metric[16];
+	uint64_t path[16];
+	int viterbi_count;
+
+	char text[64];
+	int text_len;
+};
+
+static struct psk_channel psk_channels[PSK_CHANNELS];
+
+/* the variant in use, and the one asked for from the ui thread.
+The dsp thread switches at the start of a block */
+static int psk_baud = 31;		// 31 or 63
+static int psk_qpsk = 0;
+static int psk_new_baud = 31;
+static int psk_new_qpsk = 0;
+static int psk_scan = 0;
+static int psk_pitch = 1000;	// cached by psk_poll()
+
+static inline double psk_symbol_rate(){
+	return psk_baud == 63 ? 62.5 : 31.25;
+}
+
+static inline int psk_parity(unsigned int x){
+	return __builtin_parity(x);
+}
+
+// the encoder's two bits for the shift register holding the last K bits
+static inline int psk_encode(unsigned int shreg){
+	return psk_parity(shreg & PSK_POLY1) | (psk_parity(shreg & PSK_POLY2) << 1);
+}
+
+// the change of phase for each of the QPSK symbols
+static const double psk_qpsk_shift[4] = {M_PI, M_PI/2, 0, -M_PI/2};
+
+// decimating low pass filter from 96000 to 12000 samples/sec, cutoff at 4 KHz
+static struct decimator psk_decimator;
+// the raised cosine filter of the channels, a symbol long in the middle
+static float psk_shape[2 * PSK_SPS];
+
+static void psk_channel_start(struct psk_channel *p, int freq){
+	memset(p, 0, sizeof(struct psk_channel));
+	p->in_use = 1;
+	p->freq_start = freq;
+	p->freq = freq;
+	p->prev = 1;
+	for (int i = 1; i < 16; i++)
+		p->metric[i] = -1e6;
+}
+
+static void psk_channel_flush(struct psk_channel *p){
+	char buff[100];
+
+	if (!p->text_len)
+		return;
+	sprintf(buff, "@%4d %s\n", (int)p->freq, p->text);
+	write_console(STYLE_FLDIGI_RX, buff);
+	p->text_len = 0;
+	p->text[0] = 0;
+}
+
+static void psk_channel_write(struct psk_channel *p, char c){
+	char buff[2];
+
+	if (p == psk_channels){
+		buff[0] = c;
+		buff[1] = 0;
+		write_console(STYLE_FLDIGI_RX, buff);
+		return;
+	}
+	if (c == '\n' || c == '\r'){
+		psk_channel_flush(p);
+		return;
+	}
+	if (c < ' ' || (c == ' ' && p->text_len == 0))
+		return;
+	p->text[p->text_len++] = c;
+	p->text[p->text_len] = 0;
+	if (p->text_len >= sizeof(p->text) - 1 || (c == ' ' && p->text_len > 40))
+		psk_channel_flush(p);
+}
+
+static void psk_rx_bit(struct psk_channel *p, int bit){
+	p->shreg = (p->shreg << 1) | bit;
+	if ((p->shreg & 3) == 0){
+		unsigned int code = p->shreg >> 2;
+		if (code && code < 1024 && p->dcd && psk_varicode_rx[code])
+			psk_channel_write(p, psk_varicode_rx[code]);
+		p->shreg = 0;
+	}
+}
+
+/* one step of the viterbi decoder, the branches are scored by how close
+the change of phase is to each symbol. The bits come out 32 symbols late */
+static void psk_rx_viterbi(struct psk_channel *p, double dphi){
+	float metric[16];
+	uint64_t path[16];
+	float score[4];
+
+	for (int s = 0; s < 4; s++)
+		score[s] = cos(dphi - psk_qpsk_shift[s]);
+
+	for (int ns = 0; ns < 16; ns++){
+		int bit = ns & 1;
+		int ps0 = ns >> 1, ps1 = (ns >> 1) | 8;
+		float m0 = p->metric[ps0] + score[psk_encode((ps0 << 1) | bit)];
+		float m1 = p->metric[ps1] + score[psk_encode((ps1 << 1) | bit)];
+		if (m0 >= m1){
+			metric[ns] = m0;
+			path[ns] = (p->path[ps0] << 1) | bit;
+		}
+		else {
+			metric[ns] = m1;
+			path[ns] = (p->path[ps1] << 1) | bit;
+		}
+	}
+
+	int best = 0;
+	for (int ns = 0; ns < 16; ns++)
+		if (metric[ns] > metric[best])
+			best = ns;
+	// keep the metrics from running away
+	for (int ns = 0; ns < 16; ns++){
+		p->metric[ns] = metric[ns] - metric[best];
+		p->path[ns] = path[ns];
+	}
+
+	if (p->viterbi_count < 32)
+		p->viterbi_count++;
+	else
+		psk_rx_bit(p, (path[best] >> 31) & 1);
+}
+
+static void psk_rx_symbol(struct psk_channel *p, complex double z){
+	complex double d = z * conj(p->prev);
+	double dphi = carg(d);
+	double err, drift;
+
+	p->prev = z;
+
+	/* costas loop, the modulation is taken off by squaring (or ^4 for qpsk).
+	Until the carrier is found, the rotation between the samples within 
+	the symbols pulls the frequency in (the symbol to symbol drift is 
+	ambiguous beyond a quarter of the baud rate). The phase error trims it.
+	The transitions of qpsk bias the rotation, so it is left alone
+	once locked */
+	if (psk_qpsk)
+		err = carg(z * z * z * z) / 4;
+	else
+		err = carg(z * z) / 2;
+	drift = p->dcd ? 0 : carg(p->fll) * PSK_SPS;
+	p->fll = 0;
+	p->phase += 0.2 * err;
+	p->freq += ((0.1 * drift + 0.01 * err) * psk_symbol_rate()) / (2 * M_PI);
+	if (p->freq > p->freq_start + PSK_AFC_RANGE)
+		p->freq = p->freq_start + PSK_AFC_RANGE;
+	if (p->freq < p->freq_start - PSK_AFC_RANGE)
+		p->freq = p->freq_start - PSK_AFC_RANGE;
+
+	// the quality is 1 when each change of phase is right on a symbol
+	p->quality = (0.95 * p->quality) + 0.05 * cos((psk_qpsk ? 4 : 2) * dphi);
+	if (p->quality > 0.6)
+		p->dcd = 1;
+	else if (p->quality < 0.3){
+		if (p->dcd && p != psk_channels)
+			psk_channel_flush(p);
+		p->dcd = 0;
+	}
+	if (p->dcd)
+		p->idle = 0;
+	else
+		p->idle++;
+
+	if (psk_qpsk)
+		psk_rx_viterbi(p, dphi);
+	else
+		psk_rx_bit(p, cos(dphi) > 0);
+}
+
+static void psk_rx_channel(struct psk_channel *p, float *samples, int count){
+	int decimation = PSK_RATE / (psk_symbol_rate() * PSK_SPS);
+	double step = (2 * M_PI * p->freq) / PSK_RATE;
+
+	for (int i = 0; i < count; i++){
+		p->acc += samples[i] * cexp(-I * p->phase);
+		p->phase += step;
+		if (++p->acc_count < decimation)
+			continue;
+
+		p->hist[p->hist_index] = p->acc / decimation;
+		p->hist_index = (p->hist_index + 1) % (2 * PSK_SPS);
+		p->acc = 0;
+		p->acc_count = 0;
+
+		complex double z = 0;
+		for (int k = 0; k < 2 * PSK_SPS; k++)
+			z += psk_shape[k] * p->hist[(p->hist_index + k) % (2 * PSK_SPS)];
+		p->fll += z * conj(p->last);
+		p->last = z;
+
+		// the symbol clock
+		int idx = (int)p->bitclk;
+		double sum = 0, ampsum = 0;
+		p->syncbuf[idx] = (0.8 * p->syncbuf[idx]) + (0.2 * cabs(z));
+		for (int k = 0; k < PSK_SPS/2; k++){
+			sum += p->syncbuf[k] - p->syncbuf[k + PSK_SPS/2];
+			ampsum += p->syncbuf[k] + p->syncbuf[k + PSK_SPS/2];
+		}
+		sum = ampsum == 0 ? 0 : sum / ampsum;
+		p->bitclk -= sum / 5.0;
+		p->bitclk += 1;
+		if (p->bitclk < 0)
+			p->bitclk += PSK_SPS;
+		if (p->bitclk >= PSK_SPS){
+			p->bitclk -= PSK_SPS;
+			psk_rx_symbol(p, z);
+			step = (2 * M_PI * p->freq) / PSK_RATE;
+		}
+	}
+	p->phase = fmod(p->phase, 2 * M_PI);
+}
+
+static void psk_set_variant(){
+	psk_baud = psk_new_baud;
+	psk_qpsk = psk_new_qpsk;
+	for (int i = 1; i < PSK_CHANNELS; i++)
+		psk_channels[i].in_use = 0;
+	psk_channel_start(psk_channels, psk_pitch);
+}
+
+void psk_rx(int32_t *samples, int count){
+	float s[MAX_BINS/2];
+
+	if (psk_baud != psk_new_baud || psk_qpsk != psk_new_qpsk)
+		psk_set_variant();
+	if (psk_channels[0].freq_start != psk_pitch)
+		psk_channel_start(psk_channels, psk_pitch);
+
+	int n = count / (PSK_TX_RATE / PSK_RATE);
+	decimator_run(&psk_decimator, samples, count, s, PSK_TX_RATE / PSK_RATE);
+
+	for (int i = 0; i < PSK_CHANNELS; i++){
+		struct psk_channel *p = psk_channels + i;
+		if (!p->in_use)
+			continue;
+		psk_rx_channel(p, s, n);
+		if (i && p->idle > PSK_IDLE_SYMBOLS){
+			psk_channel_flush(p);
+			p->in_use = 0;
+		}
+	}
+}
+
+/* looking for the signals to decode
+
+	Each frequency bin keeps an average. The median of the averages
+	across the passband is the noise (see modem_bins_noise()).
+	A bin that peaks over 6 db above the noise gets a free channel, on the
+	peak interpolated between the bins.
+*/
+static float psk_avg[MAX_BINS/2];
+static int psk_scan_count = 0;
+
+void psk_rx_bins(fftw_complex *bins, int n_bins){
+	int lo = (200 * n_bins) / PSK_TX_RATE;
+	int hi = (3000 * n_bins) / PSK_TX_RATE;
+	double bin_width = (double)PSK_TX_RATE / n_bins;
+
+	if (!psk_scan)
+		return;
+
+	modem_bins_average(psk_avg, bins, lo, hi);
+
+	if (++psk_scan_count % PSK_SCAN_BLOCKS)
+		return;
+
+	float noise = modem_bins_noise(psk_avg, lo, hi);
+
+	for (int k = lo + 1; k < hi - 1; k++){
+		if (psk_avg[k] < 2 * noise
+			|| psk_avg[k] < psk_avg[k-1] || psk_avg[k] < psk_avg[k+1])
+			continue;
+
+		float d = psk_avg[k-1] - 2 * psk_avg[k] + psk_avg[k+1];
+		float offset = d == 0 ? 0 : (0.5 * (psk_avg[k-1] - psk_avg[k+1])) / d;
+		int freq = (k + offset) * bin_width;
+
+		int i, free_channel = -1;
+		for (i = 0; i < PSK_CHANNELS; i++){
+			if (psk_channels[i].in_use && fabs(psk_channels[i].freq - freq) < 60)
+				break;
+			if (!psk_channels[i].in_use && free_channel == -1)
+				free_channel = i;
+		}
+		if (i == PSK_CHANNELS && free_channel != -1)
+			psk_channel_start(psk_channels + free_channel, freq);
+	}
+}
+
+/* transmit state, reset by the ui thread while in rx */
+static int psk_tx_reset = 1;
+static int psk_tx_done = 0;
+static int psk_tx_ending = 0;
+static int psk_tx_preamble = 0;
+static int psk_tx_postamble = 0;
+static const char *psk_tx_bits = NULL;
+static int psk_tx_zeros = 0;
+static char psk_tx_pending = 0;
+static unsigned int psk_tx_shreg = 0;
+static complex double psk_tx_prev, psk_tx_now;
+static int psk_tx_pos = 0;
+static struct nco psk_tx_carrier;
+static float psk_tx_shape[PSK_TX_RATE / 31];
+
+static int psk_tx_next_char(char *c){
+	if (psk_tx_pending){
+		*c = psk_tx_pending;
+		psk_tx_pending = 0;
+		return 1;
+	}
+	return get_tx_data_byte(c);
+}
+
+static int psk_tx_next_bit(){
+	char c, buff[2];
+
+	if (psk_tx_preamble > 0){
+		psk_tx_preamble--;
+		return 0;
+	}
+	if (psk_tx_ending){
+		// flush the encoder with a few reversals, then the carrier
+		if (psk_tx_postamble-- > PSK_POSTAMBLE)
+			return 0;
+		if (psk_tx_postamble < 0)
+			psk_tx_done = 1;
+		return 1;
+	}
+	if (psk_tx_bits && *psk_tx_bits)
+		return *psk_tx_bits++ == '1';
+	if (psk_tx_zeros > 0){
+		psk_tx_zeros--;
+		return 0;
+	}
+
+	if (!psk_tx_next_char(&c))
+		return 0; //idle
+	if (c == '^'){
+		char next;
+		if (psk_tx_next_char(&next)){
+			if (next == 'r'){
+				psk_tx_ending = 1;
+				psk_tx_postamble = PSK_POSTAMBLE + 8;
+				return 0;
+			}
+			psk_tx_pending = next;
+		}
+	}
+
+	buff[0] = c;
+	buff[1] = 0;
+	write_console(STYLE_FLDIGI_TX, buff);
+	psk_tx_bits = psk_varicode[c & 0x7f];
+	psk_tx_zeros = 2;
+	return *psk_tx_bits++ == '1';
+}
+
+void psk_tx_block(float *samples, int count){
+	int sps = PSK_TX_RATE / psk_symbol_rate();
+
+	if (psk_tx_reset){
+		psk_tx_reset = 0;
+		psk_tx_done = 0;
+		psk_tx_ending = 0;
+		psk_tx_preamble = PSK_PREAMBLE;
+		psk_tx_bits = NULL;
+		psk_tx_zeros = 0;
+		psk_tx_pending = 0;
+		psk_tx_shreg = 0;
+		psk_tx_prev = psk_tx_now = 1;
+		psk_tx_pos = 0;
+		for (int i = 0; i < sps; i++)
+			psk_tx_shape[i] = (1 - cos((M_PI * i) / sps)) / 2;
+	}
+
+	// the carrier in i/q, the symbols rotate it
+	float carrier_i[count], carrier_q[count];
+	if (psk_tx_carrier.freq_hz != psk_pitch)
+		nco_set_freq(&psk_tx_carrier, psk_pitch);
+	nco_block(&psk_tx_carrier, carrier_i, carrier_q, count);
+
+	for (int i = 0; i < count; i++){
+		if (psk_tx_done){
+			samples[i] = 0;
+			continue;
+		}
+		if (psk_tx_pos == 0){
+			int bit = psk_tx_next_bit();
+			psk_tx_prev = psk_tx_now;
+			if (psk_qpsk){
+				psk_tx_shreg = ((psk_tx_shreg << 1) | bit) & ((1 << PSK_K) - 1);
+				psk_tx_now = psk_tx_prev * cexp(I * psk_qpsk_shift[psk_encode(psk_tx_shreg)]);
+			}
+			else if (!bit)
+				psk_tx_now = -psk_tx_prev;
+		}
+		float w = psk_tx_shape[psk_tx_pos];
+		complex double b = (psk_tx_prev * (1 - w)) + (psk_tx_now * w);
+		// the same drive as the cw keyer
+		samples[i] = ((creal(b) * carrier_i[i]) - (cimag(b) * carrier_q[i])) / 8;
+		if (++psk_tx_pos >= sps)
+			psk_tx_pos = 0;
+	}
+}
+
+void psk_poll(int bytes_available, int tx_is_on){
+	psk_pitch = field_int("PITCH");
+
+	if (!tx_is_on){
+		psk_tx_reset = 1;
+		if (bytes_available > 0)
+			tx_on(TX_SOFT);
+	}
+	else if (psk_tx_done)
+		tx_off();
+}
+
+void psk_abort(){
+	psk_tx_pending = 0;
+	psk_tx_ending = 1;
+	psk_tx_postamble = PSK_POSTAMBLE + 8;
+}
+
+// bpsk31, bpsk63, qpsk31 or qpsk63
+int psk_set_mode(const char *mode){
+	if (strlen(mode) != 6 || (strncmp(mode, "bpsk", 4) && strncmp(mode, "qpsk", 4)))
+		return -1;
+	int baud = atoi(mode + 4);
+	if (baud != 31 && baud != 63)
+		return -1;
+	psk_new_baud = baud;
+	psk_new_qpsk = mode[0] == 'q';
+	return 0;
+}
+
+void psk_set_scan(int on){
+	if (on && !psk_scan)
+		memset(psk_avg, 0, sizeof(psk_avg));
+	psk_scan = on;
+}
+
+void psk_init(){
+	decimator_init(&psk_decimator, 4000);
+
+	memset(psk_shape, 0, sizeof(psk_shape));
+	for (int i = 0; i < PSK_SPS; i++)
+		psk_shape[i + PSK_SPS/2] = (1 - cos((2 * M_PI * (i + 0.5)) / PSK_SPS)) / PSK_SPS;
+
+	memset(psk_varicode_rx, 0, sizeof(psk_varicode_rx));
+	for (int c = 0; c < 128; c++)
+		psk_varicode_rx[strtol(psk_varicode[c], NULL, 2)] = c;
+
+	for (int i = 1; i < PSK_CHANNELS; i++)
+		psk_channels[i].in_use = 0;
+	psk_channel_start(psk_channels, psk_pitch);
+	psk_tx_reset = 1;
+}
@@ -0,0 +1,8 @@
+void psk_init();
+void psk_rx(int32_t *samples, int count);
+void psk_rx_bins(fftw_complex *bins, int n_bins);
+void psk_tx_block(float *samples, int count);
+void psk_poll(int bytes_available, int tx_is_on);
+void psk_abort();
+int psk_set_mode(const char *mode);
+void psk_set_scan(int on);
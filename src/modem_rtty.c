@@ -0,0 +1,780 @@
+/*
+	Native RTTY modem, 45.45 or 50 baud FSK with 170, 425 or 850 Hz shift.
+
+	Rxing:
+	1. The audio at 96000 samples/sec is low pass filtered and decimated
+	to 12000 samples/sec by decimator_run().
+
+	2. Each struct rtty_channel mixes its signal down to zero around the
+	center of the two tones, then the mark and the space tones down to zero
+	on their own. Both are decimated to 1500 samples/sec and run through a
+	filter that is a bit long (the matched filter for the FSK bits).
+
+	3. The mark and space envelopes are compared with the automatic
+	threshold correction (ATC) of W7AY: the peak and the floor of each
+	envelope are tracked so that a fading mark or space still decides
+	the bit correctly.
+
+	4. A UART looks for the mark to space edge of the start bit, reads
+	the five data bits at the middle of each bit and checks the stop bit.
+	The characters are decoded from Baudot (ITA2), with the shift unlocked
+	on space, like most of the ham software.
+
+	5. While a channel has a signal, its frequency follows the signal
+	by the rotation of the stronger tone.
+
+	The first channel is always on the pitch, and writes straight to the
+	console. When scanning, the rest of the channels are assigned to the
+	RTTY signals found in the frequency bins of the receiver
+	(see rtty_rx_bins()) and their text is written a line at a time, tagged
+	with their audio frequency. This is how a contest is copied.
+
+	Txing:
+	rtty_tx_block() generates a block of continuous phase FSK samples at
+	96000 samples/sec. The shift between the tones is smoothed with
+	a raised cosine over 4 msec. Each character is a start bit, five data
+	bits and 1.5 stop bits. The transmission starts with a few LTRS,
+	the typed text follows with LTRS when there is nothing to send and
+	a '^r' in the text ends the transmission.
+
+	Normal RTTY has the mark on the higher frequency. As the sbitx
+	receives RTTY on the upper sideband, the mark is the higher tone of
+	the audio, '\rtty reverse' swaps them.
+
+	Testing:
+	The decoder can be run over recorded audio without the radio.
+	Compile this file on its own with RTTY_TEST defined:
+	gcc -DRTTY_TEST -o rtty_test src/modem_rtty.c -lm
+	./rtty_test recording.wav 2210 [more frequencies to decode ...]
+	The recording has to be a 16 bit wav at 12000, 24000, 48000 or 96000
+	samples/sec.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <complex.h>
+#include <fftw3.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "modem_rtty.h"
+
+#define RTTY_RATE 12000
+#define RTTY_TX_RATE 96000
+#define RTTY_DECIMATE 8			// from RTTY_RATE to RTTY_CH_RATE
+#define RTTY_CH_RATE 1500		// of the channels
+#define RTTY_MAX_SPB 40			// samples per bit, in the channels
+#define RTTY_CHANNELS 8
+#define RTTY_AFC_RANGE 60		// Hz, that a channel can drift off its start
+#define RTTY_SCAN_BLOCKS 32	// between looking for new signals
+#define RTTY_IDLE_BITS 200	// without a signal, before the channel is released
+#define RTTY_PREAMBLE 4			// LTRS before the text
+#define RTTY_POSTAMBLE 2		// LTRS after the text
+#define RTTY_EDGE 384				// samples to shift between the tones, 4 msec
+#define RTTY_RAMP 480				// samples to ramp the carrier up and down
+
+#define RTTY_LTRS 0x1f
+#define RTTY_FIGS 0x1b
+#define RTTY_SPACE 0x04
+
+// ITA2, indexed by the 5 bits with the first bit received in bit 0
+static const char rtty_letters[32] = {
+	0, 'E', '\n', 'A', ' ', 'S', 'I', 'U',
+	'\r', 'D', 'R', 'J', 'N', 'F', 'C', 'K',
+	'T', 'Z', 'L', 'W', 'H', 'Y', 'P', 'Q',
+	'O', 'B', 'G', 0, 'M', 'X', 'V', 0
+};
+static const char rtty_figures[32] = {
+	0, '3', '\n', '-', ' ', '\'', '8', '7',
+	'\r', '$', '4', 0, ',', '!', ':', '(',
+	'5', '+', ')', '2', '#', '6', '0', '1',
+	'9', '?', '&', 0, '.', '/', '=', 0
+};
+
+// the states of the uart
+#define RTTY_WAIT 0
+#define RTTY_START 1
+#define RTTY_DATA 2
+#define RTTY_STOP 3
+
+struct rtty_channel {
+	int in_use;
+	int freq_start;
+	double freq;			// of the center, tracked by the afc
+	complex double osc;		// at freq
+	complex double tone;	// at half the shift
+
+	complex double mark_acc, space_acc;	// decimating to RTTY_CH_RATE
+	int acc_count;
+	complex double mark_hist[RTTY_MAX_SPB], space_hist[RTTY_MAX_SPB];
+	complex double mark_sum, space_sum;	// the matched filters
+	complex double mark_last, space_last;
+	int hist_index;
+
+	// the automatic threshold correction
+	float mark_peak, mark_floor;
+	float space_peak, space_floor;
+
+	float quality;
+	int dcd;
+	int idle;				// samples without a signal
+	complex double afc;
+	int afc_count;
+
+	int state;
+	int last_bit;
+	double counter;	// samples to the middle of the next bit
+	int nbits;
+	int code;
+	int figs;
+
+	char text[64];
+	int text_len;
+};
+
+static struct rtty_channel rtty_channels[RTTY_CHANNELS];
+
+/* the settings in use, and the ones asked for from the ui thread.
+The dsp thread switches at the start of a block */
+static double rtty_baud = 45.45;
+static int rtty_shift = 170;
+static int rtty_reverse = 0;
+static double rtty_new_baud = 45.45;
+static int rtty_new_shift = 170;
+static int rtty_new_reverse = 0;
+static int rtty_scan = 0;
+static int rtty_pitch = 2125;	// cached by rtty_poll()
+
+static inline int rtty_spb(){
+	return (int)((RTTY_CH_RATE / rtty_baud) + 0.5);
+}
+
+// decimating low pass filter from 96000 to 12000 samples/sec, cutoff at 4 KHz
+static struct decimator rtty_decimator;
+
+static void rtty_channel_start(struct rtty_channel *p, int freq){
+	memset(p, 0, sizeof(struct rtty_channel));
+	p->in_use = 1;
+	p->freq_start = freq;
+	p->freq = freq;
+	p->osc = 1;
+	p->tone = 1;
+}
+
+static void rtty_channel_flush(struct rtty_channel *p){
+	char buff[100];
+
+	if (!p->text_len)
+		return;
+	sprintf(buff, "@%4d %s\n", (int)p->freq, p->text);
+	write_console(STYLE_FLDIGI_RX, buff);
+	p->text_len = 0;
+	p->text[0] = 0;
+}
+
+static void rtty_channel_write(struct rtty_channel *p, char c){
+	char buff[2];
+
+	if (c == '\r')
+		return;
+	if (p == rtty_channels){
+		buff[0] = c;
+		buff[1] = 0;
+		write_console(STYLE_FLDIGI_RX, buff);
+		return;
+	}
+	if (c == '\n'){
+		rtty_channel_flush(p);
+		return;
+	}
+	if (c == ' ' && p->text_len == 0)
+		return;
+	p->text[p->text_len++] = c;
+	p->text[p->text_len] = 0;
+	if (p->text_len >= sizeof(p->text) - 1 || (c == ' ' && p->text_len > 40))
+		rtty_channel_flush(p);
+}
+
+static void rtty_rx_char(struct rtty_channel *p, int code){
+	char c;
+
+	if (code == RTTY_LTRS){
+		p->figs = 0;
+		return;
+	}
+	if (code == RTTY_FIGS){
+		p->figs = 1;
+		return;
+	}
+	c = p->figs ? rtty_figures[code] : rtty_letters[code];
+	// unshift on space
+	if (code == RTTY_SPACE)
+		p->figs = 0;
+	if (c && p->dcd)
+		rtty_channel_write(p, c);
+}
+
+static void rtty_rx_uart(struct rtty_channel *p, int bit){
+	if (p->state == RTTY_WAIT){
+		// the start bit
+		if (p->last_bit && !bit){
+			p->state = RTTY_START;
+			p->counter = (RTTY_CH_RATE / rtty_baud) / 2;
+		}
+		p->last_bit = bit;
+		return;
+	}
+	p->last_bit = bit;
+
+	p->counter -= 1;
+	if (p->counter > 0)
+		return;
+	p->counter += RTTY_CH_RATE / rtty_baud;
+
+	switch(p->state){
+	case RTTY_START:
+		if (bit)
+			p->state = RTTY_WAIT; // it was a glitch
+		else {
+			p->state = RTTY_DATA;
+			p->nbits = 0;
+			p->code = 0;
+		}
+		break;
+	case RTTY_DATA:
+		p->code |= bit << p->nbits;
+		if (++p->nbits == 5)
+			p->state = RTTY_STOP;
+		break;
+	case RTTY_STOP:
+		// a framing error is dropped
+		if (bit)
+			rtty_rx_char(p, p->code);
+		p->state = RTTY_WAIT;
+		break;
+	}
+}
+
+// one sample of the channel at RTTY_CH_RATE
+static void rtty_rx_sample(struct rtty_channel *p, complex double mark_in,
+	complex double space_in){
+	int spb = rtty_spb();
+	float k = 1.0 / (16 * spb);	// the atc follows over 16 bits
+
+	p->mark_sum += mark_in - p->mark_hist[p->hist_index];
+	p->space_sum += space_in - p->space_hist[p->hist_index];
+	p->mark_hist[p->hist_index] = mark_in;
+	p->space_hist[p->hist_index] = space_in;
+	if (++p->hist_index >= spb)
+		p->hist_index = 0;
+
+	float m = cabs(p->mark_sum) / spb;
+	float s = cabs(p->space_sum) / spb;
+
+	// the peaks attack quickly and decay slowly, the floors the other way
+	p->mark_peak = m > p->mark_peak ? m : p->mark_peak + (m - p->mark_peak) * k;
+	p->mark_floor = m < p->mark_floor ? m : p->mark_floor + (m - p->mark_floor) * k;
+	p->space_peak = s > p->space_peak ? s : p->space_peak + (s - p->space_peak) * k;
+	p->space_floor = s < p->space_floor ? s : p->space_floor + (s - p->space_floor) * k;
+
+	float mc = (m > p->mark_peak ? p->mark_peak : m) - p->mark_floor;
+	float sc = (s > p->space_peak ? p->space_peak : s) - p->space_floor;
+	float mp = p->mark_peak - p->mark_floor;
+	float sp = p->space_peak - p->space_floor;
+	float v = (mc * mc) - (sc * sc) - 0.25 * ((mp * mp) - (sp * sp));
+
+	/* the quality is near 1 when one of the tones is always well over
+	the other, noise stays around 0.3 */
+	float contrast = m + s > 0 ? fabs(m - s) / (m + s) : 0;
+	p->quality += (contrast - p->quality) / (8 * spb);
+	if (p->quality > 0.45)
+		p->dcd = 1;
+	else if (p->quality < 0.38){
+		if (p->dcd && p != rtty_channels)
+			rtty_channel_flush(p);
+		p->dcd = 0;
+	}
+	if (p->dcd)
+		p->idle = 0;
+	else
+		p->idle++;
+
+	/* the afc follows the stronger tone, while it is clearly the stronger
+	and well over its floor (not the noise after the signal is gone) */
+	if (p->dcd && contrast > 0.5){
+		if (m > s && mc > mp / 2)
+			p->afc += p->mark_sum * conj(p->mark_last);
+		else if (s > m && sc > sp / 2)
+			p->afc += p->space_sum * conj(p->space_last);
+	}
+	p->mark_last = p->mark_sum;
+	p->space_last = p->space_sum;
+	if (++p->afc_count >= spb){
+		if (p->afc != 0){
+			double drift = (carg(p->afc) * RTTY_CH_RATE) / (2 * M_PI);
+			p->freq += 0.1 * drift;
+			if (p->freq > p->freq_start + RTTY_AFC_RANGE)
+				p->freq = p->freq_start + RTTY_AFC_RANGE;
+			if (p->freq < p->freq_start - RTTY_AFC_RANGE)
+				p->freq = p->freq_start - RTTY_AFC_RANGE;
+		}
+		p->afc = 0;
+		p->afc_count = 0;
+	}
+
+	rtty_rx_uart(p, rtty_reverse ? v < 0 : v > 0);
+}
+
+static void rtty_rx_channel(struct rtty_channel *p, float *samples, int count){
+	complex double step = cexp((I * 2 * M_PI * p->freq) / RTTY_RATE);
+	complex double tone_step = cexp((I * M_PI * rtty_shift) / RTTY_RATE);
+
+	for (int i = 0; i < count; i++){
+		complex double z = samples[i] * conj(p->osc);
+		p->osc *= step;
+		p->mark_acc += z * conj(p->tone);
+		p->space_acc += z * p->tone;
+		p->tone *= tone_step;
+		if (++p->acc_count < RTTY_DECIMATE)
+			continue;
+		rtty_rx_sample(p, p->mark_acc / RTTY_DECIMATE, p->space_acc / RTTY_DECIMATE);
+		p->mark_acc = 0;
+		p->space_acc = 0;
+		p->acc_count = 0;
+	}
+	// the oscillators lose their amplitude slowly, put it back
+	p->osc /= cabs(p->osc);
+	p->tone /= cabs(p->tone);
+}
+
+static void rtty_set_variant(){
+	rtty_baud = rtty_new_baud;
+	rtty_shift = rtty_new_shift;
+	rtty_reverse = rtty_new_reverse;
+	for (int i = 1; i < RTTY_CHANNELS; i++)
+		rtty_channels[i].in_use = 0;
+	rtty_channel_start(rtty_channels, rtty_pitch);
+}
+
+// the channels at RTTY_RATE, this is where the recordings come in
+static void rtty_rx_audio(float *s, int n){
+	for (int i = 0; i < RTTY_CHANNELS; i++){
+		struct rtty_channel *p = rtty_channels + i;
+		if (!p->in_use)
+			continue;
+		rtty_rx_channel(p, s, n);
+		if (i && p->idle > RTTY_IDLE_BITS * rtty_spb()){
+			rtty_channel_flush(p);
+			p->in_use = 0;
+		}
+	}
+}
+
+void rtty_rx(int32_t *samples, int count){
+	float s[MAX_BINS/2];
+
+	if (rtty_baud != rtty_new_baud || rtty_shift != rtty_new_shift
+		|| rtty_reverse != rtty_new_reverse)
+		rtty_set_variant();
+	if (rtty_channels[0].freq_start != rtty_pitch)
+		rtty_channel_start(rtty_channels, rtty_pitch);
+
+	decimator_run(&rtty_decimator, samples, count, s, RTTY_TX_RATE / RTTY_RATE);
+	rtty_rx_audio(s, count / (RTTY_TX_RATE / RTTY_RATE));
+}
+
+/* looking for the signals to decode
+
+	As with the psk scan, each frequency bin keeps an average and the
+	median of the averages is the noise. An RTTY signal has both of its
+	tones over 6 db above the noise, half the shift on either side of its
+	center. The centers are stepped 10 Hz at a time, interpolating the
+	tones between the bins, and the best center of each signal gets
+	a free channel.
+*/
+static float rtty_avg[MAX_BINS/2];
+static int rtty_scan_count = 0;
+
+// the weaker of the two tones, at a center frequency
+static float rtty_score(double freq, double bin_width){
+	double bin[2] = {(freq + rtty_shift / 2.0) / bin_width,
+		(freq - rtty_shift / 2.0) / bin_width};
+	float tone[2];
+
+	for (int i = 0; i < 2; i++){
+		int k = (int)bin[i];
+		float f = bin[i] - k;
+		tone[i] = (rtty_avg[k] * (1 - f)) + (rtty_avg[k + 1] * f);
+	}
+	return tone[0] < tone[1] ? tone[0] : tone[1];
+}
+
+void rtty_rx_bins(fftw_complex *bins, int n_bins){
+	int lo = (200 * n_bins) / RTTY_TX_RATE;
+	int hi = (3000 * n_bins) / RTTY_TX_RATE;
+	double bin_width = (double)RTTY_TX_RATE / n_bins;
+
+	if (!rtty_scan)
+		return;
+
+	// rtty_score() interpolates up to the bin after hi
+	modem_bins_average(rtty_avg, bins, lo, hi + 1);
+
+	if (++rtty_scan_count % RTTY_SCAN_BLOCKS)
+		return;
+
+	float noise = modem_bins_noise(rtty_avg, lo, hi);
+
+	int start = (lo * bin_width) + (rtty_shift / 2) + 10;
+	int end = (hi * bin_width) - (rtty_shift / 2) - 10;
+	for (int freq = start; freq < end; freq += 10){
+		float score = rtty_score(freq, bin_width);
+		if (score < 2 * noise || score < rtty_score(freq - 10, bin_width)
+			|| score < rtty_score(freq + 10, bin_width))
+			continue;
+
+		int i, free_channel = -1;
+		for (i = 0; i < RTTY_CHANNELS; i++){
+			if (rtty_channels[i].in_use
+				&& fabs(rtty_channels[i].freq - freq) < rtty_shift)
+				break;
+			if (!rtty_channels[i].in_use && free_channel == -1)
+				free_channel = i;
+		}
+		if (i == RTTY_CHANNELS && free_channel != -1)
+			rtty_channel_start(rtty_channels + free_channel, freq);
+	}
+}
+
+/* transmit state, reset by the ui thread while in rx */
+static int rtty_tx_reset = 1;
+static int rtty_tx_done = 0;
+static int rtty_tx_ending = 0;
+static int rtty_tx_preamble = 0;
+static int rtty_tx_postamble = 0;
+static char rtty_tx_pending = 0;
+static int rtty_tx_figs = 0;
+static int rtty_tx_queue[4];	// codes waiting after a shift
+static int rtty_tx_queued = 0;
+static int rtty_tx_bits[7];		// of the character being sent
+static int rtty_tx_lengths[7];
+static int rtty_tx_bit = 7;
+static int rtty_tx_left = 0;		// samples left in the bit
+static double rtty_tx_from, rtty_tx_to;	// the tone is moving between
+static int rtty_tx_edge = RTTY_EDGE;
+static int rtty_tx_env = 0;
+static double rtty_tx_phase = 0;
+static float rtty_edge[RTTY_EDGE + 1];
+
+static int rtty_tx_next_char(char *c){
+	if (rtty_tx_pending){
+		*c = rtty_tx_pending;
+		rtty_tx_pending = 0;
+		return 1;
+	}
+	return get_tx_data_byte(c);
+}
+
+// the code for a character, with the shift it needs
+static int rtty_tx_lookup(char c, int *figs){
+	c = toupper(c);
+	for (int i = 0; i < 32; i++){
+		if (i == RTTY_LTRS || i == RTTY_FIGS || !rtty_letters[i])
+			continue;
+		if (rtty_letters[i] == c){
+			*figs = 0;
+			return i;
+		}
+		if (rtty_figures[i] == c){
+			*figs = 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void rtty_tx_queue_char(char c){
+	int figs;
+	int code = rtty_tx_lookup(c, &figs);
+	char buff[2];
+
+	if (code == -1)
+		return;
+	if (code != RTTY_SPACE && code != 0x02 && code != 0x08 && figs != rtty_tx_figs){
+		rtty_tx_queue[rtty_tx_queued++] = figs ? RTTY_FIGS : RTTY_LTRS;
+		rtty_tx_figs = figs;
+	}
+	rtty_tx_queue[rtty_tx_queued++] = code;
+	// the receivers unshift on space
+	if (code == RTTY_SPACE)
+		rtty_tx_figs = 0;
+
+	buff[0] = c;
+	buff[1] = 0;
+	write_console(STYLE_FLDIGI_TX, buff);
+}
+
+// the next baudot code to send, -1 once the transmission is over
+static int rtty_tx_next_code(){
+	char c;
+
+	if (rtty_tx_preamble > 0){
+		rtty_tx_preamble--;
+		return RTTY_LTRS;
+	}
+	if (rtty_tx_queued){
+		int code = rtty_tx_queue[0];
+		memmove(rtty_tx_queue, rtty_tx_queue + 1, --rtty_tx_queued * sizeof(int));
+		return code;
+	}
+	if (rtty_tx_ending){
+		if (rtty_tx_postamble-- > 0)
+			return RTTY_LTRS;
+		rtty_tx_done = 1;
+		return -1;
+	}
+
+	if (!rtty_tx_next_char(&c))
+		return RTTY_LTRS;	//idle
+	if (c == '^'){
+		char next;
+		if (rtty_tx_next_char(&next)){
+			if (next == 'r'){
+				rtty_tx_ending = 1;
+				rtty_tx_postamble = RTTY_POSTAMBLE;
+				return RTTY_LTRS;
+			}
+			rtty_tx_pending = next;
+		}
+	}
+	if (c == '\n'){
+		rtty_tx_queue_char('\r');
+		rtty_tx_queue_char('\n');
+	}
+	else
+		rtty_tx_queue_char(c);
+	return rtty_tx_next_code();
+}
+
+// lays out the bits of the next character
+static void rtty_tx_next(){
+	int bit_length = RTTY_TX_RATE / rtty_baud;
+	int code = rtty_tx_next_code();
+
+	rtty_tx_bit = 0;
+	if (code == -1){
+		// steady mark until the tx is turned off
+		for (int i = 0; i < 7; i++){
+			rtty_tx_bits[i] = 1;
+			rtty_tx_lengths[i] = bit_length;
+		}
+		return;
+	}
+	rtty_tx_bits[0] = 0;
+	rtty_tx_lengths[0] = bit_length;
+	for (int i = 0; i < 5; i++){
+		rtty_tx_bits[i + 1] = (code >> i) & 1;
+		rtty_tx_lengths[i + 1] = bit_length;
+	}
+	rtty_tx_bits[6] = 1;
+	rtty_tx_lengths[6] = (bit_length * 3) / 2;
+}
+
+void rtty_tx_block(float *samples, int count){
+	double mark = rtty_pitch + (rtty_reverse ? -rtty_shift : rtty_shift) / 2.0;
+	double space = rtty_pitch - (rtty_reverse ? -rtty_shift : rtty_shift) / 2.0;
+
+	if (rtty_tx_reset){
+		rtty_tx_reset = 0;
+		rtty_tx_done = 0;
+		rtty_tx_ending = 0;
+		rtty_tx_queued = 0;
+		rtty_tx_figs = 0;
+		rtty_tx_pending = 0;
+		rtty_tx_preamble = RTTY_PREAMBLE;
+		rtty_tx_bit = 7;
+		rtty_tx_left = 0;
+		rtty_tx_from = rtty_tx_to = mark;
+		rtty_tx_edge = RTTY_EDGE;
+		rtty_tx_env = 0;
+	}
+
+	for (int i = 0; i < count; i++){
+		if (rtty_tx_left == 0){
+			if (rtty_tx_bit >= 7)
+				rtty_tx_next();
+			double tone = rtty_tx_bits[rtty_tx_bit] ? mark : space;
+			if (tone != rtty_tx_to){
+				rtty_tx_from = rtty_tx_to;
+				rtty_tx_to = tone;
+				rtty_tx_edge = 0;
+			}
+			rtty_tx_left = rtty_tx_lengths[rtty_tx_bit++];
+		}
+		rtty_tx_left--;
+
+		double freq = rtty_tx_from + (rtty_tx_to - rtty_tx_from) * rtty_edge[rtty_tx_edge];
+		if (rtty_tx_edge < RTTY_EDGE)
+			rtty_tx_edge++;
+
+		// ramp up at the start, down once done
+		if (rtty_tx_done){
+			if (rtty_tx_env > 0)
+				rtty_tx_env--;
+		}
+		else if (rtty_tx_env < RTTY_RAMP)
+			rtty_tx_env++;
+
+		// the same drive as the cw keyer
+		samples[i] = (sin(rtty_tx_phase) * rtty_tx_env) / (RTTY_RAMP * 8);
+		rtty_tx_phase += (2 * M_PI * freq) / RTTY_TX_RATE;
+		if (rtty_tx_phase > 2 * M_PI)
+			rtty_tx_phase -= 2 * M_PI;
+	}
+}
+
+void rtty_poll(int bytes_available, int tx_is_on){
+	rtty_pitch = field_int("PITCH");
+
+	if (!tx_is_on){
+		rtty_tx_reset = 1;
+		if (bytes_available > 0)
+			tx_on(TX_SOFT);
+	}
+	else if (rtty_tx_done && rtty_tx_env == 0)
+		tx_off();
+}
+
+void rtty_abort(){
+	rtty_tx_pending = 0;
+	rtty_tx_queued = 0;
+	rtty_tx_ending = 1;
+	rtty_tx_postamble = 0;
+}
+
+// 45, 50, 170, 425, 850, normal or reverse
+int rtty_set_mode(const char *mode){
+	if (!strcmp(mode, "45"))
+		rtty_new_baud = 45.45;
+	else if (!strcmp(mode, "50"))
+		rtty_new_baud = 50;
+	else if (!strcmp(mode, "170") || !strcmp(mode, "425") || !strcmp(mode, "850"))
+		rtty_new_shift = atoi(mode);
+	else if (!strcmp(mode, "normal"))
+		rtty_new_reverse = 0;
+	else if (!strcmp(mode, "reverse"))
+		rtty_new_reverse = 1;
+	else
+		return -1;
+	return 0;
+}
+
+void rtty_set_scan(int on){
+	if (on && !rtty_scan)
+		memset(rtty_avg, 0, sizeof(rtty_avg));
+	rtty_scan = on;
+}
+
+void rtty_init(){
+	decimator_init(&rtty_decimator, 4000);
+
+	for (int i = 0; i <= RTTY_EDGE; i++)
+		rtty_edge[i] = (1 - cos((M_PI * i) / RTTY_EDGE)) / 2;
+
+	for (int i = 1; i < RTTY_CHANNELS; i++)
+		rtty_channels[i].in_use = 0;
+	rtty_channel_start(rtty_channels, rtty_pitch);
+	rtty_tx_reset = 1;
+}
+
+#ifdef RTTY_TEST
+/* decodes a recording, the text of each channel is written out as it
+is decoded, in the same way as on the console of the sbitx */
+
+void write_console(sbitx_style style, const char *text){
+	fputs(text, stdout);
+	fflush(stdout);
+}
+
+int field_int(char *label){
+	return rtty_pitch;
+}
+
+int get_tx_data_byte(char *c){
+	return 0;
+}
+
+void tx_on(int trigger){
+}
+
+void tx_off(){
+}
+
+int main(int argc, char **argv){
+	char header[12], chunk[8];
+	int rate = 0, channels = 1, bits = 0;
+
+	if (argc < 3){
+		puts("Usage: rtty_test recording.wav frequency [frequency ...]");
+		return -1;
+	}
+
+	FILE *pf = fopen(argv[1], "r");
+	if (!pf || fread(header, 12, 1, pf) != 1 || strncmp(header + 8, "WAVE", 4)){
+		printf("%s is not a wav file\n", argv[1]);
+		return -1;
+	}
+	// skip to the samples, picking up the format on the way
+	while (fread(chunk, 8, 1, pf) == 1){
+		int size = *(int32_t *)(chunk + 4);
+		if (!strncmp(chunk, "fmt ", 4)){
+			unsigned char fmt[40];
+			if (fread(fmt, size < 40 ? size : 40, 1, pf) != 1)
+				break;
+			if (size > 40)
+				fseek(pf, size - 40, SEEK_CUR);
+			channels = fmt[2] | (fmt[3] << 8);
+			rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+			bits = fmt[14] | (fmt[15] << 8);
+		}
+		else if (!strncmp(chunk, "data", 4))
+			break;
+		else
+			fseek(pf, size, SEEK_CUR);
+	}
+	if (bits != 16 || channels > 2 || rate % RTTY_RATE || rate > RTTY_TX_RATE){
+		puts("The recording should be 16 bit at 12000, 24000, 48000 or 96000 samples/sec");
+		return -1;
+	}
+
+	rtty_init();
+	rtty_pitch = atoi(argv[2]);
+	rtty_channel_start(rtty_channels, rtty_pitch);
+	for (int i = 3; i < argc && i - 2 < RTTY_CHANNELS; i++)
+		rtty_channel_start(rtty_channels + i - 2, atoi(argv[i]));
+
+	// average down to RTTY_RATE
+	int factor = rate / RTTY_RATE;
+	int16_t frame[16];
+	float block[1024];
+	int n = 0;
+	while (fread(frame, sizeof(int16_t) * channels, factor, pf) > 0){
+		float sum = 0;
+		for (int i = 0; i < factor; i++)
+			sum += frame[i * channels];
+		block[n++] = sum / factor;
+		if (n == 1024){
+			rtty_rx_audio(block, n);
+			n = 0;
+		}
+	}
+	rtty_rx_audio(block, n);
+	for (int i = 1; i < RTTY_CHANNELS; i++)
+		rtty_channel_flush(rtty_channels + i);
+	putchar('\n');
+	fclose(pf);
+	return 0;
+}
+#endif
@@ -0,0 +1,8 @@
+void rtty_init();
+void rtty_rx(int32_t *samples, int count);
+void rtty_rx_bins(fftw_complex *bins, int n_bins);
+void rtty_tx_block(float *samples, int count);
+void rtty_poll(int bytes_available, int tx_is_on);
+void rtty_abort();
+int rtty_set_mode(const char *mode);
+void rtty_set_scan(int on);
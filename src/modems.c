@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <math.h>
@@ -27,6 +28,8 @@
 #include "sound.h"
 #include "modem_ft8.h"
 #include "modem_cw.h"
+#include "modem_psk.h"
+#include "modem_rtty.h"
 
 typedef float float32_t;
 
@@ -47,7 +50,11 @@ int qso_state = QSO_STATE_ZOMBIE;
 
 /*
 	This file implements modems for :
-	Fldigi: We use fldigi as a proxy for all the modems that it implements
+	CW, FT8/FT4, PSK31 and RTTY natively (modem_*.c).
+	Fldigi: in the DIGI mode, '\fldigi <modem name>' hands the modem to an
+	fldigi running on the loopback device, for the modes that are not
+	native. sbitx keys fldigi, sends it the typed text and shows what it
+	decodes. '\fldigi off' leaves the DIGI mode to the other apps.
 
 
 	General:
@@ -59,8 +66,9 @@ int qso_state = QSO_STATE_ZOMBIE;
 	3. On receive, each time a block of samples is received, modem_rx() is called and
 		 it despatches the block of samples to the currently selected modem.
 		 The demodulators call write_console() to call the routines to display the decoded text.
-	4. During transmit, modem_next_sample() is repeatedly called by the sdr to accumulate
-		 samples. In turn the sample generation routines call get_tx_data_byte() to read the next
+	4. During transmit, modem_next_block() is called by the sdr for each block of
+		 samples it transmits and the modem fills the whole block in one call.
+		 In turn the sample generation routines call get_tx_data_byte() to read the next
 		 text/ascii byte to encode.
 
 */
@@ -147,19 +155,91 @@ void b64_encode(char *clrstr, char *b64dst) {
 ********************************************************/
 /*
 An almost trivial xml, just enough to work fldigi
+
+All the calls to fldigi are made from the fldigi thread, over one
+HTTP/1.1 connection that is kept open. The rest of the sbitx only
+posts requests with fldigi_post(), which never blocks. The thread
+sends all the requests waiting in the queue together and then reads
+the replies in the same order.
+
+The replies that are needed are put away for the UI thread:
+the received text is queued for fldigi_read() and the trx state is
+kept in fldigi_trx_is_rx.
+While fldigi_rx_poll is set, the thread asks fldigi for the received
+text and the trx state every 250 msec by itself.
 */
 
+#define FLDIGI_REQUESTS 64
+#define FLDIGI_PIPELINE 8
+#define FLDIGI_POLL_MSEC 250
+
+// what to do with the reply
+#define FLDIGI_IGNORE 0
+#define FLDIGI_RX_TEXT 1
+#define FLDIGI_TRX_STATE 2
+
+struct fldigi_request {
+	char action[40];
+	char param[200];
+	int is_int;
+	int reply;
+	int serial;
+};
+
+static struct fldigi_request fldigi_requests[FLDIGI_REQUESTS];
+static int fldigi_req_head = 0, fldigi_req_tail = 0;
+static int fldigi_serial = 0;
+static pthread_mutex_t fldigi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fldigi_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t fldigi_thread;
+
+static char fldigi_rx_text[4096];	// received text, for the ui thread
+static int fldigi_rx_text_len = 0;
+static int fldigi_rx_poll = 0;
+static int fldigi_trx_is_rx = 0;		// as last reported by fldigi
+static int fldigi_trx_serial = 0;		// the request that reported it
+static int fldigi_carrier = 0;
+
 char fldigi_mode[100];
-long fldigi_retry_at = 0;
-/*
-An almost trivial xml, just enough to work fldigi
-*/
+static int fldigi_socket = -1;
+
+static int fldigi_post_locked(char *action, char *param, int is_int, int reply){
+	int next = (fldigi_req_head + 1) % FLDIGI_REQUESTS;
+	if (next == fldigi_req_tail)
+		return -1; //the queue is full, fldigi is not keeping up
+
+	struct fldigi_request *r = fldigi_requests + fldigi_req_head;
+	strncpy(r->action, action, sizeof(r->action) - 1);
+	r->action[sizeof(r->action) - 1] = 0;
+	strncpy(r->param, param, sizeof(r->param) - 1);
+	r->param[sizeof(r->param) - 1] = 0;
+	r->is_int = is_int;
+	r->reply = reply;
+	r->serial = ++fldigi_serial;
+	fldigi_req_head = next;
+	pthread_cond_signal(&fldigi_wake);
+	return r->serial;
+}
 
-int fldigi_call_i(char *action, int param, char *result){
-  char buffer[10000], q[10000], xml[1000];
+// returns the serial number of the request or -1
+int fldigi_post(char *action, char *param, int reply){
+	pthread_mutex_lock(&fldigi_lock);
+	int serial = fldigi_post_locked(action, param, 0, reply);
+	pthread_mutex_unlock(&fldigi_lock);
+	return serial;
+}
+
+int fldigi_post_i(char *action, int param){
+	char buff[20];
+	sprintf(buff, "%d", param);
+	pthread_mutex_lock(&fldigi_lock);
+	int serial = fldigi_post_locked(action, buff, 1, FLDIGI_IGNORE);
+	pthread_mutex_unlock(&fldigi_lock);
+	return serial;
+}
+
+static int fldigi_connect(){
   struct sockaddr_in serverAddr;
-  struct sockaddr_storage serverStorage;
-  socklen_t addr_size;
 	struct timeval timeout;
 
   serverAddr.sin_family = AF_INET;
@@ -167,124 +247,89 @@ int fldigi_call_i(char *action, int param, char *result){
   serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
   memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);
 
-	int fldigi_socket = socket(AF_INET, SOCK_STREAM, 0);
-/*	timeout.tv_sec = 0;
-	timeout.tv_usec = 1000;
+	fldigi_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (fldigi_socket < 0)
+		return -1;
+
+	// a hung fldigi only holds up the fldigi thread, and not for long
+	timeout.tv_sec = 2;
+	timeout.tv_usec = 0;
 	setsockopt(fldigi_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
 	setsockopt(fldigi_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
-*/
-	*result = 0; //start with a null string so it is returned if nothing is read
 
   if (connect(fldigi_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-		//puts("unable to connect to the flidigi\n");
-		close(fldigi_socket);
-		return -1;
-   }
-
-	sprintf(xml,
-"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-"<methodCall><methodName>%s</methodName>\n"
-"<params>\n<param><value><i4>%d</i4></value></param> </params></methodCall>\n",
-		action, param);
-
-	sprintf(q,
-		"POST / HTTP/1.1\n"
-		"Host: 127.0.0.1:7362\n"
-		"User-Agent: sbitx/v0.01\n"
-		"Accept:\n"
-		"Content-Length: %d\n"
-		"Content-Type: application/x-www-form-urlencoded\n\n"
-		"%s\n",
-		(int)strlen(xml), xml);
-
-  if (send(fldigi_socket, q, strlen(q), 0) < 0) {
-		puts("Unable to request fldigi");
 		close(fldigi_socket);
+		fldigi_socket = -1;
 		return -1;
-  }
-	char buff[10000]; //large, large
-	int e = recv(fldigi_socket, buff, sizeof(buff), 0);
-	if(e < 0) {
-//		puts("Unable to recv from fldigi");
-		close(fldigi_socket);
-		return -1;
-  }
-	buff[e] = 0;
-	result[0] = 0;
-
-	//now check if we got the data in base64
-	char *p = strstr(buff, "<base64>");
-	if (p){
-		p += strlen("<base64"); //skip past the tag
-		char *r =  strchr(p, '<'); //find the end
-		if (r){
-			*r = 0; //terminate the base64 at the end tag
-			int len =  (strlen(p) * 6)/8;
-			b64_decode(p, result);
-			result[len] = 0;
-		}
 	}
-	else
-		strcpy(result, buff);
-  close(fldigi_socket);
-
 	return 0;
 }
 
-int fldigi_call(char *action, char *param, char *result){
-  char buffer[10000], q[10000], xml[1000];
-  struct sockaddr_in serverAddr;
-  struct sockaddr_storage serverStorage;
-  socklen_t addr_size;
-	struct timeval timeout;
-
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(7362);
-  serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);
-	*result = 0;
-
-	int fldigi_socket = socket(AF_INET, SOCK_STREAM, 0);
-/*	timeout.tv_sec = 0;
-	timeout.tv_usec = 500;
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
-*/
-  if (connect(fldigi_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-		//puts("unable to connect to the flidigi\n");
+static void fldigi_disconnect(){
+	if (fldigi_socket >= 0)
 		close(fldigi_socket);
-		return -1;
-   }
+	fldigi_socket = -1;
+}
+
+static int fldigi_format(struct fldigi_request *r, char *q){
+	char xml[1000];
 
 	sprintf(xml,
 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
 "<methodCall><methodName>%s</methodName>\n"
-"<params>\n<param><value><string>%s</string></value></param> </params></methodCall>\n",
-		action, param);
-
-	sprintf(q,
-		"POST / HTTP/1.1\n"
-		"Host: 127.0.0.1:7362\n"
-		"User-Agent: sbitx/v0.01\n"
-		"Accept:\n"
-		"Content-Length: %d\n"
-		"Content-Type: application/x-www-form-urlencoded\n\n"
-		"%s\n",
+"<params>\n<param><value><%s>%s</%s></value></param> </params></methodCall>\n",
+		r->action, r->is_int ? "i4" : "string", r->param, r->is_int ? "i4" : "string");
+
+	return sprintf(q,
+		"POST / HTTP/1.1\r\n"
+		"Host: 127.0.0.1:7362\r\n"
+		"User-Agent: sbitx/v0.01\r\n"
+		"Accept:\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Length: %d\r\n"
+		"Content-Type: text/xml\r\n\r\n"
+		"%s",
 		(int)strlen(xml), xml);
+}
 
-  if (send(fldigi_socket, q, strlen(q), 0) < 0) {
-		puts("Unable to request fldigi");
-		close(fldigi_socket);
-		return -1;
-  }
-	char buff[10000]; //large, large
-	int e = recv(fldigi_socket, buff, sizeof(buff), 0);
-	if(e < 0) {
-//		puts("Unable to recv from fldigi");
-		close(fldigi_socket);
-		return -1;
-  }
-	buff[e] = 0;
+/* reads one reply off the connection, the bytes of the replies that
+follow stay in the buffer */
+static char fldigi_in[20000];
+static int fldigi_in_len = 0;
+
+static int fldigi_reply(char *body, int max){
+	while (1){
+		fldigi_in[fldigi_in_len] = 0;
+		char *header_end = strstr(fldigi_in, "\r\n\r\n");
+		if (header_end){
+			int content_length = 0;
+			for (char *p = fldigi_in; p < header_end; p++)
+				if (!strncasecmp(p, "Content-Length:", 15)){
+					content_length = atoi(p + 15);
+					break;
+				}
+			int total = (header_end + 4 - fldigi_in) + content_length;
+			if (total >= sizeof(fldigi_in) - 1 || content_length >= max)
+				return -1;
+			if (fldigi_in_len >= total){
+				memcpy(body, header_end + 4, content_length);
+				body[content_length] = 0;
+				fldigi_in_len -= total;
+				memmove(fldigi_in, fldigi_in + total, fldigi_in_len);
+				return 0;
+			}
+		}
+		if (fldigi_in_len >= sizeof(fldigi_in) - 1)
+			return -1;
+		int e = recv(fldigi_socket, fldigi_in + fldigi_in_len,
+			sizeof(fldigi_in) - 1 - fldigi_in_len, 0);
+		if (e <= 0)
+			return -1;
+		fldigi_in_len += e;
+	}
+}
+
+static void fldigi_parse(char *buff, char *result){
 	result[0] = 0;
 
 	//now check if we got the data in base64
@@ -310,44 +355,149 @@ int fldigi_call(char *action, char *param, char *result){
 	}
 	else
 		strcpy(result, buff);
-  close(fldigi_socket);
+}
+
+static void fldigi_done(struct fldigi_request *r, char *result){
+	pthread_mutex_lock(&fldigi_lock);
+	if (r->reply == FLDIGI_RX_TEXT){
+		int l = strlen(result);
+		if (fldigi_rx_text_len + l < sizeof(fldigi_rx_text)){
+			strcpy(fldigi_rx_text + fldigi_rx_text_len, result);
+			fldigi_rx_text_len += l;
+		}
+	}
+	else if (r->reply == FLDIGI_TRX_STATE){
+		fldigi_trx_is_rx = !strcmp(result, "RX");
+		fldigi_trx_serial = r->serial;
+	}
+	pthread_mutex_unlock(&fldigi_lock);
+}
 
+/* sends a batch of requests and reads their replies.
+On a failure, the connection is dropped and the rest of the batch is lost */
+static int fldigi_send(struct fldigi_request *batch, int count){
+	static char q[FLDIGI_PIPELINE * 1500];
+	char reply[10000], result[10000];
+	int len = 0;
+
+	for (int i = 0; i < count; i++)
+		len += fldigi_format(batch + i, q + len);
+
+	if (send(fldigi_socket, q, len, MSG_NOSIGNAL) < len)
+		return -1;
+
+	for (int i = 0; i < count; i++){
+		if (fldigi_reply(reply, sizeof(reply)) < 0)
+			return -1;
+		fldigi_parse(reply, result);
+		fldigi_done(batch + i, result);
+	}
 	return 0;
 }
 
+void *fldigi_thread_function(void *ptr){
+	struct fldigi_request batch[FLDIGI_PIPELINE];
+	struct timespec wait_until;
+	unsigned long next_poll = 0;
+
+	while(1){
+		pthread_mutex_lock(&fldigi_lock);
+		if (fldigi_req_head == fldigi_req_tail){
+			clock_gettime(CLOCK_REALTIME, &wait_until);
+			wait_until.tv_nsec += FLDIGI_POLL_MSEC * 1000000;
+			if (wait_until.tv_nsec >= 1000000000){
+				wait_until.tv_sec++;
+				wait_until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&fldigi_wake, &fldigi_lock, &wait_until);
+		}
+		if (fldigi_rx_poll && next_poll <= millis()){
+			fldigi_post_locked("rx.get_data", "", 0, FLDIGI_RX_TEXT);
+			fldigi_post_locked("main.get_trx_state", "", 0, FLDIGI_TRX_STATE);
+			next_poll = millis() + FLDIGI_POLL_MSEC;
+		}
+		int count = 0;
+		while (fldigi_req_tail != fldigi_req_head && count < FLDIGI_PIPELINE){
+			batch[count++] = fldigi_requests[fldigi_req_tail];
+			fldigi_req_tail = (fldigi_req_tail + 1) % FLDIGI_REQUESTS;
+		}
+		pthread_mutex_unlock(&fldigi_lock);
+
+		if (!count)
+			continue;
+
+		if (fldigi_socket < 0){
+			if (fldigi_connect() < 0){
+				//fldigi isn't running, drop these and try again later
+				sleep(1);
+				continue;
+			}
+			fldigi_in_len = 0;
+			//fldigi may have been restarted, set it up again
+			struct fldigi_request setup[2];
+			int n = 0;
+			pthread_mutex_lock(&fldigi_lock);
+			if (fldigi_mode[0]){
+				strcpy(setup[n].action, "modem.set_by_name");
+				strcpy(setup[n].param, fldigi_mode);
+				setup[n].is_int = 0;
+				setup[n++].reply = FLDIGI_IGNORE;
+			}
+			if (fldigi_carrier){
+				strcpy(setup[n].action, "modem.set_carrier");
+				sprintf(setup[n].param, "%d", fldigi_carrier);
+				setup[n].is_int = 1;
+				setup[n++].reply = FLDIGI_IGNORE;
+			}
+			pthread_mutex_unlock(&fldigi_lock);
+			if (n && fldigi_send(setup, n) < 0){
+				fldigi_disconnect();
+				continue;
+			}
+		}
+
+		if (fldigi_send(batch, count) < 0)
+			fldigi_disconnect();
+	}
+}
+
+// drops the text that fldigi has received so far
+void fldigi_flush(){
+	pthread_mutex_lock(&fldigi_lock);
+	fldigi_rx_text_len = 0;
+	fldigi_rx_text[0] = 0;
+	pthread_mutex_unlock(&fldigi_lock);
+	fldigi_post("rx.get_data", "", FLDIGI_IGNORE);
+}
+
 
 /*******************************************************
 **********      Modem dispatch routines          *******
 ********************************************************/
-int fldigi_in_tx = 0;
 static int rx_poll_count = 0;
 static int sps, deci, s_timer ;
 
 
+// called from the ui thread to display what fldigi has received
 void fldigi_read(){
-	char buffer[10000];
+	char buffer[sizeof(fldigi_rx_text)];
 
-	//poll only every 250msec
-	if (fldigi_retry_at > millis())
-		return;
+	pthread_mutex_lock(&fldigi_lock);
+	strcpy(buffer, fldigi_rx_text);
+	fldigi_rx_text_len = 0;
+	fldigi_rx_text[0] = 0;
+	pthread_mutex_unlock(&fldigi_lock);
 
-	if(!fldigi_call("rx.get_data", "", buffer)){
-		if (strlen(buffer)){
-				if (buffer[0] != '<' )
-					buffer[1] = 0;
-				write_console(STYLE_FLDIGI_RX, buffer);
-//				printf("fldigi rx.get_data{%s}\n", buffer);
-		}
-	}
-	fldigi_retry_at = millis() + 250;
+	if (strlen(buffer))
+		write_console(STYLE_FLDIGI_RX, buffer);
 }
 
 void fldigi_set_mode(char *mode){
-	char buffer[1000];
 	if (strcmp(fldigi_mode, mode)){
-		if(fldigi_call("modem.set_by_name", mode, buffer) == 0){
-			fldigi_retry_at = millis() + 2000;
+		if(fldigi_post("modem.set_by_name", mode, FLDIGI_IGNORE) > 0){
+			pthread_mutex_lock(&fldigi_lock);
 			strcpy(fldigi_mode, mode);
+			pthread_mutex_unlock(&fldigi_lock);
 		}
 	}
 }
@@ -355,18 +505,21 @@ void fldigi_set_mode(char *mode){
 void fldigi_tx_more_data(){
 	char c;
 	if (get_tx_data_byte(&c)){
-		char buff[10], resp[1000];
+		char buff[10];
 		buff[0] = c;
 		buff[1] = 0;
-		fldigi_call("text.add_tx", buff, resp);
+		fldigi_post("text.add_tx", buff, FLDIGI_IGNORE);
 		write_console(STYLE_FLDIGI_TX, buff);
 	}
 }
 
-static int fldigi_tx_stop(){
-	char buffer[10000];
+int fldigi_in_tx = 0;
+static int fldigi_tx_serial = 0;		// the request that started tx
+static int fldigi_on = 0;				// fldigi is the modem of the DIGI mode
+static int fldigi_started = 0;
 
-	if (!fldigi_call("main.rx", "", buffer)){
+static int fldigi_tx_stop(){
+	if (fldigi_post("main.rx", "", FLDIGI_IGNORE) > 0){
 		fldigi_in_tx = 0;
 		sound_input(0);
 		return 0;
@@ -375,67 +528,132 @@ static int fldigi_tx_stop(){
 		return -1;
 }
 
+// '\fldigi <modem name>' or '\fldigi off', returns -1 on a bad argument
+int fldigi_command(char *args){
+	if (!args || !strlen(args) || strlen(args) >= sizeof(fldigi_mode))
+		return -1;
+	if (!strcmp(args, "off")){
+		if (fldigi_in_tx)
+			fldigi_tx_stop();
+		fldigi_on = 0;
+		fldigi_rx_poll = 0;
+		return 0;
+	}
+	if (!fldigi_started){
+		pthread_create(&fldigi_thread, NULL, fldigi_thread_function, (void*)NULL);
+		fldigi_started = 1;
+	}
+	fldigi_set_mode(args);
+	fldigi_on = 1;
+	return 0;
+}
+
+// the carrier of fldigi follows the pitch
 void modem_set_pitch(int pitch, int mode){
+	if (mode != MODE_DIGITAL || !fldigi_on)
+		return;
+	pthread_mutex_lock(&fldigi_lock);
+	fldigi_carrier = pitch;
+	pthread_mutex_unlock(&fldigi_lock);
+	fldigi_post_i("modem.set_carrier", pitch);
+}
 
-	//Sends an xmlrpc command to fldigi, so be selective of which modes we actually use it on - n1qm
-	switch (mode) {
-		case MODE_CW:
-		case MODE_CWR:
-		case MODE_FT8:
-		case MODE_PSK31:
-		case MODE_RTTY: {
-			char response[1000];
-
-			fldigi_call_i("modem.set_carrier", pitch, response);
-			break;
-    }
+static void fldigi_poll(int tx_is_on){
+	//only trust the trx state if fldigi reported it after it was put in tx
+	pthread_mutex_lock(&fldigi_lock);
+	int fldigi_is_rx = fldigi_trx_is_rx && fldigi_trx_serial > fldigi_tx_serial;
+	pthread_mutex_unlock(&fldigi_lock);
+
+	//we will let the keyboard decide this
+	if (tx_is_on && !fldigi_in_tx){
+		int serial = fldigi_post("main.tx", "", FLDIGI_IGNORE);
+		if (serial > 0){
+			fldigi_tx_serial = serial;
+			fldigi_in_tx = 1;
+			sound_input(1);
+		}
+		else
+			puts("*fldigi tx failed");
+	}
+	//switch to rx if the sbitx is set to manual or the fldigi has gone back to rx
+	else if ((tx_is_on && fldigi_is_rx) || (!tx_is_on && fldigi_in_tx)){
+		if (fldigi_tx_stop() == -1)
+			puts("*fldigi rx failed");
 	}
+	fldigi_rx_poll = 1;
+	if (tx_is_on && get_tx_data_length() > 0)
+		fldigi_tx_more_data();
+	else
+		fldigi_read();
 }
 
 
-int last_pitch = 0;
 void modem_rx(int mode, int32_t *samples, int count){
-	int i, j, k, l;
-	int32_t *s;
-	FILE *pf;
-	char buff[10000];
-
-	if (get_pitch() != last_pitch
-		&& (mode == MODE_CW || mode == MODE_CWR || mode == MODE_RTTY || mode == MODE_PSK31))
-		modem_set_pitch(get_pitch(),mode);
-
-	s = samples;
 	switch(mode){
 	case MODE_FT8:
+	case MODE_FT4:
 		ft8_rx(samples, count);
 		break;
-	case MODE_RTTY:
-		fldigi_set_mode("RTTY");
-		fldigi_read();
+	case MODE_CW:
+	case MODE_CWR:
+		cw_rx(samples, count);
 		break;
 	case MODE_PSK31:
-		fldigi_set_mode("BPSK31");
-		fldigi_read();
+		psk_rx(samples, count);
 		break;
+	case MODE_RTTY:
+		rtty_rx(samples, count);
+		break;
+	}
+}
+
+// the frequency bins of the receiver, rotated to the tuned frequency
+void modem_rx_bins(int mode, fftw_complex *bins, int n_bins){
+	switch(mode){
 	case MODE_CW:
+		cw_skimmer_bins(bins, n_bins, 0);
+		break;
 	case MODE_CWR:
-		cw_rx(samples, count);
+		cw_skimmer_bins(bins, n_bins, 1);
+		break;
+	case MODE_PSK31:
+		psk_rx_bins(bins, n_bins);
+		break;
+	case MODE_RTTY:
+		rtty_rx_bins(bins, n_bins);
 		break;
 	}
 }
 
+/* the scans of the psk and rtty receivers look for signals the same way:
+each frequency bin keeps an average, the median of the averages across
+the passband is the noise, most of the bins have nothing else. */
+static int modem_bins_compare(const void *a, const void *b){
+	float x = *(const float *)a, y = *(const float *)b;
+	return x < y ? -1 : x > y;
+}
+
+void modem_bins_average(float *avg, fftw_complex *bins, int lo, int hi){
+	for (int k = lo; k < hi; k++)
+		avg[k] = (0.98 * avg[k]) + (0.02 * cabs(bins[k]));
+}
+
+float modem_bins_noise(float *avg, int lo, int hi){
+	float sorted[MAX_BINS/2];
+
+	memcpy(sorted, avg + lo, (hi - lo) * sizeof(float));
+	qsort(sorted, hi - lo, sizeof(float), modem_bins_compare);
+	return sorted[(hi - lo) / 2];
+}
+
 void modem_init(){
 	// init the ft8
 	cw_init();
 	ft8_init();
+	psk_init();
+	rtty_init();
+	// the fldigi thread starts with the first '\fldigi' command
 	strcpy(fldigi_mode, "");
-
-/*
-	//for now, launch fldigi in the background, if not already running
-	int e = system("pidof -x fldigi > /dev/null");
-	if (e == 256)
-		system("fldigi -i 2>/dev/null &");
-*/
 }
 
 
@@ -446,29 +664,30 @@ void modem_init(){
 void modem_poll(int mode, int ticks){
 	int tx_is_on = is_in_tx();
 	time_t t;
-	char buffer[10000];
 
 	millis_now = millis();
 
 	if (current_mode != mode){
 		//flush out the past decodes
 		current_mode = mode;
-		int l;
-		do{
-			int e = fldigi_call("rx.get_data", "", buffer);
-			l = strlen(buffer);
-		}while(l > 0);
+		if (fldigi_in_tx)
+			fldigi_tx_stop();
+		if (fldigi_started)
+			fldigi_flush();
 
 		//clear the text buffer
 		abort_tx();
 
-		if (current_mode == MODE_FT8)
+		if (current_mode == MODE_FT8 || current_mode == MODE_FT4){
 			macro_load("FT8", NULL);
+			ft8_set_protocol(current_mode == MODE_FT4);
+		}
 		else if (current_mode == MODE_RTTY || current_mode == MODE_PSK31 || current_mode == MODE_CWR || current_mode == MODE_CW)
 		{
 			macro_load("CW1", NULL);
-			modem_set_pitch(get_pitch(),current_mode);
 		}
+		else if (current_mode == MODE_DIGITAL)
+			modem_set_pitch(get_pitch(), current_mode);
 
 		if (current_mode == MODE_CW || current_mode == MODE_CWR)
 			cw_init();
@@ -476,10 +695,9 @@ void modem_poll(int mode, int ticks){
 
 	switch(mode){
 	case MODE_FT8:
-		if (ticks % 100) {
-			t = time_sbitx();
-			ft8_poll(t % 60, tx_is_on);
-		}
+	case MODE_FT4:
+		if (ticks % 100)
+			ft8_poll(tx_is_on);
 		break;
 	case MODE_CW:
 	case MODE_CWR: {
@@ -487,49 +705,45 @@ void modem_poll(int mode, int ticks){
 		cw_poll(bytes_available, tx_is_on);
 	}
 	break;
-
+	case MODE_PSK31:
+		psk_poll(get_tx_data_length(), tx_is_on);
+		fldigi_rx_poll = 0;
+		break;
 	case MODE_RTTY:
-	case MODE_PSK31: {
-		fldigi_call("main.get_trx_state", "", buffer);
-		//we will let the keyboard decide this
-		if (tx_is_on && !fldigi_in_tx){
-			if (!fldigi_call("main.tx", "", buffer)){
-				fldigi_in_tx = 1;
-				sound_input(1);
-			}
-			else
-				puts("*fldigi tx failed");
-		}
-		//switch to rx if the sbitx is set to manual or the fldigi has gone back to rx
-		else if ((tx_is_on && !strcmp(buffer, "RX")) || (!tx_is_on && fldigi_in_tx)){
-			if (fldigi_tx_stop() == -1)
-				puts("*fldigi rx failed");
-		}
-		int bytes_available = get_tx_data_length();
-		if (tx_is_on && bytes_available > 0)
-			fldigi_tx_more_data();
+		rtty_poll(get_tx_data_length(), tx_is_on);
+		fldigi_rx_poll = 0;
+		break;
+	case MODE_DIGITAL:
+		if (fldigi_on)
+			fldigi_poll(tx_is_on);
 		else
-			fldigi_read();
-	}
-	break;
+			fldigi_rx_poll = 0;
+		break;
+	default:
+		fldigi_rx_poll = 0;
 	}
 }
 
-float modem_next_sample(int mode){
-	float sample=0;
-
+// fill a whole block of transmit samples in one call
+void modem_next_block(int mode, float *samples, int count){
 	switch(mode){
-		// the ft8 samples are generated at 12ksps, we need to feed the
-		// sdr with 96 ksps (eight times as much)
 	case MODE_FT8:
-			sample = ft8_next_sample();
+	case MODE_FT4:
+		ft8_next_block(samples, count);
 		break;
 	case MODE_CW:
 	case MODE_CWR:
-		sample = cw_tx_get_sample();
+		cw_tx_block(samples, count);
 		break;
+	case MODE_PSK31:
+		psk_tx_block(samples, count);
+		break;
+	case MODE_RTTY:
+		rtty_tx_block(samples, count);
+		break;
+	default:
+		memset(samples, 0, count * sizeof(float));
 	}
-	return sample;
 }
 
 
@@ -542,11 +756,14 @@ void modem_abort(){
 
 	switch(current_mode){
 	case MODE_FT8:
+	case MODE_FT4:
 		ft8_abort();
 		break;
 	case MODE_RTTY:
+		rtty_abort();
+		break;
 	case MODE_PSK31:
-		fldigi_tx_stop();
+		psk_abort();
 		break;
 	case MODE_CW:
 	case MODE_CWR:
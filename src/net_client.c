@@ -0,0 +1,35 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "net_client.h"
+
+/* Closing the clients of an epoll loop
+
+	A client may be closed while the loop is going through the events of
+	an epoll_wait(), and the events after it may be for the same client.
+	So it is not freed right away: its socket is taken out of the epoll
+	set and closed, it is marked closed and put on a list of the dead.
+	The loop skips the events of a closed client and frees the dead
+	with net_client_reap() once it is done with the batch.
+
+	The servers take the client out of their own list of clients before
+	calling net_client_close(), closing it again does nothing.
+*/
+
+void net_client_close(int epoll_fd, struct net_client **dead, struct net_client *c){
+	if (c->closed)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->closed = 1;
+	c->dead = *dead;
+	*dead = c;
+}
+
+void net_client_reap(struct net_client **dead){
+	while (*dead){
+		struct net_client *c = *dead;
+		*dead = c->dead;
+		free(c);
+	}
+}
@@ -0,0 +1,11 @@
+/* A client of the epoll servers (hamlib.c, remote.c), it is the first
+	member of their own client structs (see net_client.c) */
+
+struct net_client {
+	int fd;
+	int closed;						// its pending events are to be skipped
+	struct net_client *dead;		// the next on the list of the closed
+};
+
+void net_client_close(int epoll_fd, struct net_client **dead, struct net_client *c);
+void net_client_reap(struct net_client **dead);
@@ -58,6 +58,16 @@ time_t time_sbitx(){
 		return time_delta + (long)(millis()/1000l);
 }
 
+// the same clock as time_sbitx(), to a fraction of a second
+double time_sbitx_precise(){
+	struct timespec ts;
+
+	if (time_delta)
+		return time_delta + millis() / 1000.0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
 void rtc_write_ntp(int year, int month, int day, int hours, int minutes, int seconds){
 	uint8_t rtc_time[10];
 
@@ -93,134 +93,105 @@ void init_eq(parametriceq* eq, const char* section) {
     }
 
     fclose(file);
+    eq_changed(eq);
 }
 
 
-// Structure for Biquad filter
-typedef struct {
-    double a0, a1, a2, b0, b1, b2;
-    double x1, x2, y1, y2;
-} Biquad;
+/* The filters
 
-// Function to calculate filter coefficients
-void calculate_coefficients(EQBand* band, double sample_rate, Biquad* filter) {
+	The bands run one after the other (a cascade) of peaking biquads, each
+	band carries its own gain, so a band at 0 dB passes the audio through
+	untouched. The filters live in the parametriceq and keep their state
+	from one block to the next.
+
+	The coefficients are worked out only when a band changes: the ui
+	bumps eq->version (through eq_changed()) and the audio thread picks
+	up the new coefficients at the start of its next block, never in the
+	middle of one. The state of the filters is kept across the change,
+	except that of a band that passes through, which is cleared.
+*/
+
+// Function to calculate the coefficients of one band (RBJ peaking eq)
+static void calculate_coefficients(EQBand* band, double sample_rate, EQCoeffs* c) {
     double clamped_gain = fmax(fmin(band->gain, 24.0), -24.0); // Clamp gain to ±24 dB
+
+    // a band that is off or out of the range passes through
+    if (band->frequency <= 0 || band->frequency >= sample_rate / 2 || band->bandwidth <= 0
+        || clamped_gain == 0) {
+        c->b0 = 1.0;
+        c->b1 = c->b2 = c->a1 = c->a2 = 0.0;
+        return;
+    }
+
     double A = pow(10.0, clamped_gain / 40.0);
     double omega = 2.0 * M_PI * band->frequency / sample_rate;
     double sin_omega = sin(omega);
     double cos_omega = cos(omega);
     double alpha = sin_omega * sinh(log(2.0) / 2.0 * band->bandwidth * omega / fmax(sin_omega, 1e-10));
-
-    // Ensure the filter coefficients are stable
-    filter->b0 = 1.0 + alpha * A;
-    filter->b1 = -2.0 * cos_omega;
-    filter->b2 = 1.0 - alpha * A;
-    filter->a0 = 1.0 + alpha / A;
-    filter->a1 = -2.0 * cos_omega;
-    filter->a2 = 1.0 - alpha / A;
-
-    // Check if a0 is close to zero to prevent division by zero
-    if (fabs(filter->a0) < 1e-10) {
-        filter->a0 = 1e-10; // Prevent division by zero
-    }
-
-    // Normalize the coefficients
-    filter->b0 /= filter->a0;
-    filter->b1 /= filter->a0;
-    filter->b2 /= filter->a0;
-    filter->a1 /= filter->a0;
-    filter->a2 /= filter->a0;
-
-    // a0 should always be normalized to 1.0
-    filter->a0 = 1.0;
-
-    // Initialize filter states
-    filter->x1 = filter->x2 = 0.0;
-    filter->y1 = filter->y2 = 0.0;
+    double a0 = 1.0 + alpha / A;
+
+    // Normalize the coefficients, a0 is always 1.0
+    c->b0 = (1.0 + alpha * A) / a0;
+    c->b1 = (-2.0 * cos_omega) / a0;
+    c->b2 = (1.0 - alpha * A) / a0;
+    c->a1 = (-2.0 * cos_omega) / a0;
+    c->a2 = (1.0 - alpha / A) / a0;
 }
 
-// Function to process a single sample through the filter
-int32_t process_sample(Biquad* filter, int32_t sample) {
-    double result = filter->b0 * sample + filter->b1 * filter->x1 + filter->b2 * filter->x2
-        - filter->a1 * filter->y1 - filter->a2 * filter->y2;
-    
-    // Update filter states
-    filter->x2 = filter->x1;
-    filter->x1 = sample;
-    filter->y2 = filter->y1;
-    filter->y1 = result;
-
-    // Ensure result is within valid range
-    if (result > INT32_MAX) result = INT32_MAX;
-    if (result < INT32_MIN) result = INT32_MIN;
-
-    return (int32_t)result;
+// Call after changing any of the bands, it is picked up at the next block
+void eq_changed(parametriceq* eq) {
+    __atomic_add_fetch(&eq->version, 1, __ATOMIC_RELEASE);
 }
 
-// Function to remove DC offset
-void remove_dc_offset(int32_t* samples, int num_samples) {
-    int64_t sum = 0;
-    for (int i = 0; i < num_samples; i++) {
-        sum += samples[i];
-    }
-    int32_t average = (int32_t)(sum / num_samples);
-    for (int i = 0; i < num_samples; i++) {
-        samples[i] -= average;
-    }
-}
+// Function to apply EQ to a block of float samples, in place
+void apply_eq_float(parametriceq* eq, float* samples, int num_samples, double sample_rate) {
+    int version = __atomic_load_n(&eq->version, __ATOMIC_ACQUIRE);
 
-// Function to scale samples by a gain factor
-void scale_samples(int32_t* samples, int num_samples, float gain_factor) {
-    for (int i = 0; i < num_samples; i++) {
-        // Apply the gain factor and clamp values to avoid overflow/underflow
-        int64_t scaled_sample = (int64_t)(samples[i] * gain_factor);
-        if (scaled_sample > INT32_MAX) scaled_sample = INT32_MAX;
-        if (scaled_sample < INT32_MIN) scaled_sample = INT32_MIN;
-        samples[i] = (int32_t)scaled_sample;
+    if (version != eq->applied_version || sample_rate != eq->sample_rate) {
+        for (int i = 0; i < NUM_BANDS; i++)
+            calculate_coefficients(&eq->bands[i], sample_rate, &eq->coeffs[i]);
+        eq->applied_version = version;
+        eq->sample_rate = sample_rate;
     }
-}
-
-// Function to apply EQ and gain scaling
-void apply_eq(parametriceq* eq, int32_t* samples, int num_samples, double sample_rate) {
-    Biquad filters[NUM_BANDS];
 
-    // Step 1: Calculate coefficients for each band
+    // a band at a time over the whole block (transposed direct form II)
     for (int i = 0; i < NUM_BANDS; i++) {
-        calculate_coefficients(&eq->bands[i], sample_rate, &filters[i]);
-    }
+        EQCoeffs* c = &eq->coeffs[i];
+        float z1 = eq->z1[i], z2 = eq->z2[i];
 
-    // Step 2: Initialize output buffer
-    int32_t output_samples[num_samples];
-    memset(output_samples, 0, sizeof(output_samples));
-
-    // Step 3: Process samples for each band
-    for (int i = 0; i < NUM_BANDS; i++) {
-        double band_gain = pow(10.0, eq->bands[i].gain / 20.0); // Convert dB to linear scale
+        // a band that passes through starts from rest when it is turned on again
+        if (c->b0 == 1.0f && c->b1 == 0.0f && c->b2 == 0.0f) {
+            eq->z1[i] = eq->z2[i] = 0;
+            continue;
+        }
 
         for (int n = 0; n < num_samples; n++) {
-            // Apply the filter to the current sample
-            double filtered_sample = process_sample(&filters[i], samples[n]);
-
-            // Accumulate the scaled filtered output
-            output_samples[n] += (int32_t)(filtered_sample * band_gain);
+            float x = samples[n];
+            float y = c->b0 * x + z1;
+            z1 = c->b1 * x - c->a1 * y + z2;
+            z2 = c->b2 * x - c->a2 * y;
+            samples[n] = y;
         }
+        eq->z1[i] = z1;
+        eq->z2[i] = z2;
     }
-
-    // Step 4: Normalize the summed output
-    for (int n = 0; n < num_samples; n++) {
-        output_samples[n] /= NUM_BANDS; // Prevent unintentional gain
-    }
-
-    // Step 5: Scale and clamp using scale_samples
-    scale_samples(output_samples, num_samples, 1.0);
-
-    // Step 6: Copy normalized output back to input buffer
-    memcpy(samples, output_samples, sizeof(int32_t) * num_samples);
 }
 
+// Function to apply EQ to a block of int32 samples (the rx audio)
+void apply_eq(parametriceq* eq, int32_t* samples, int num_samples, double sample_rate) {
+    float buff[num_samples];
 
+    for (int n = 0; n < num_samples; n++)
+        buff[n] = samples[n];
 
+    apply_eq_float(eq, buff, num_samples, sample_rate);
 
-
-
-
+    for (int n = 0; n < num_samples; n++) {
+        if (buff[n] >= 2147483647.0f)
+            samples[n] = INT32_MAX;
+        else if (buff[n] <= -2147483648.0f)
+            samples[n] = INT32_MIN;
+        else
+            samples[n] = (int32_t)buff[n];
+    }
+}
@@ -17,9 +17,19 @@ typedef struct {
     double bandwidth;
 } EQBand;
 
-// Define parametriceq structure
+// Define the coefficients of one band's biquad
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} EQCoeffs;
+
+// Define parametriceq structure, the filters and their state persist between blocks
 typedef struct {
     EQBand bands[NUM_BANDS];
+    int version;            // bumped by eq_changed() when a band is modified
+    int applied_version;    // the version that the coeffs were calculated for
+    double sample_rate;
+    EQCoeffs coeffs[NUM_BANDS];
+    float z1[NUM_BANDS], z2[NUM_BANDS];
 } parametriceq;
 
 extern parametriceq eq;
@@ -30,7 +40,9 @@ extern void modify_eq_band_frequency(parametriceq *eq, int band_index, double ne
 extern void modify_eq_band_gain(parametriceq *eq, int band_index, double new_gain);
 extern void modify_eq_band_bandwidth(parametriceq *eq, int band_index, double new_bandwidth);
 extern void print_eq_int(const parametriceq *eq, const char *label);
+extern void eq_changed(parametriceq *eq);
 extern void apply_eq(parametriceq* eq, int32_t* samples, int num_samples, double sample_rate);
+extern void apply_eq_float(parametriceq* eq, float* samples, int num_samples, double sample_rate);
 extern int eq_is_enabled;
 extern int rx_eq_is_enabled;
 
@@ -1,122 +1,413 @@
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <complex.h>
 #include <math.h>
-#include <fcntl.h>
-#include <complex.h>
 #include <fftw3.h>
+#include <pthread.h>
 #include "sdr.h"
 #include "sdr_ui.h"
+#include "remote.h"
+#include "net_client.h"
 
-static int welcome_socket = -1, data_socket = -1;
-#define MAX_DATA 1000
-static char incoming_data[MAX_DATA];
-static int incoming_ptr;
+/* The telnet remote (port 8081)
 
-#define MAX_LINE 30
+	Any number of clients can connect, they are served by an epoll loop
+	on a thread of its own, so a command doesn't wait on the gui ticks.
+	Each client sends a command a line. '?<label>' asks for the value of
+	a field, anything else is a command for cmd_exec. Both go into a
+	queue that the ui thread empties from remote_poll() in its tick, the
+	answers to the questions come back through a second queue and an
+	eventfd that wakes the loop.
 
-void remote_start() {
-    char buffer[MAX_DATA];
-    struct sockaddr_in serverAddr;
-    struct sockaddr_storage serverStorage;
-    socklen_t addr_size;
+	What the radio writes to the remotes (the console, the spots) goes
+	into one ring, written once whatever the number of clients. Each
+	client has a cursor into it and is sent straight out of it, outside
+	its lock; a client that falls a whole ring behind skips ahead. The welcome screen and
+	the answers go through a small output buffer of each client, which
+	goes out before the ring. A client that doesn't read is dropped.
+*/
+
+#define REMOTE_PORT 8081
+#define REMOTE_MAX_EVENTS 32
+#define REMOTE_MAX_LINE 1000
+#define REMOTE_MAX_OUT 8192
+#define REMOTE_RING 65536
+
+static char ring[REMOTE_RING];
+static uint64_t ring_head = 0;		// counts every byte ever written
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct remote_message {
+	uint64_t client;
+	char *text;
+};
+
+// the commands to the ui thread and the answers that come back
+#define REMOTE_QUEUE 256
+static struct remote_message commands[REMOTE_QUEUE], answers[REMOTE_QUEUE];
+static int commands_count = 0, answers_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    welcome_socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+static int wake_fd = -1;
+static int epoll_fd = -1;
 
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(8081);
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);
+struct remote_client {
+	struct net_client net;		// first, net_client_reap() frees it
+	uint64_t id;
+	char in[REMOTE_MAX_LINE];
+	int in_len;
+	char out[REMOTE_MAX_OUT];
+	int out_len;
+	uint64_t cursor;			// into the ring
+	struct remote_client *next;
+};
 
-    /* Bind the address struct to the socket */
-    bind(welcome_socket, (struct sockaddr *) &serverAddr, sizeof(serverAddr));
+static struct remote_client *clients = NULL;
+static struct net_client *dead = NULL;		// closed, freed after the events
+static uint64_t next_client_id = 1;
 
-    /* Listen on the socket, with 5 max connection requests queued */
-    if(listen(welcome_socket,5) != 0)
-        printf("telnet listen() Error\n");
-    incoming_ptr = 0;
+static void remote_wake(){
+	uint64_t one = 1;
+	if (wake_fd != -1)
+		write(wake_fd, &one, sizeof(one));
 }
 
-void remote_send(char *m) {
-    send(data_socket, m, strlen(m), 0);
+// called from any thread, goes to all the clients
+void remote_write(const char *message) {
+	int n = strlen(message);
+
+	if (wake_fd == -1 || !n)
+		return;
+	if (n > REMOTE_RING)
+		message += n - REMOTE_RING, n = REMOTE_RING;
+
+	pthread_mutex_lock(&ring_lock);
+	for (int i = 0; i < n; i++)
+		ring[(ring_head + i) % REMOTE_RING] = message[i];
+	ring_head += n;
+	pthread_mutex_unlock(&ring_lock);
+	remote_wake();
 }
 
-void remote_init() {
-    remote_send("\033[1;1H"); //goto 1,1
-    remote_send("\033[r"); //clear the scrollable area
-    remote_send("\033[2J"); //clear the screen
-    remote_send("\033[25;1r");
+static void remote_send(struct remote_client *c, const char *m) {
+	int n = strlen(m);
+	if (c->out_len + n > REMOTE_MAX_OUT)
+		n = REMOTE_MAX_OUT - c->out_len;
+	memcpy(c->out + c->out_len, m, n);
+	c->out_len += n;
+}
+
+static void remote_init(struct remote_client *c) {
+	remote_send(c, "\033[1;1H"); //goto 1,1
+	remote_send(c, "\033[r"); //clear the scrollable area
+	remote_send(c, "\033[2J"); //clear the screen
+	remote_send(c, "\033[25;1r");
 
-    remote_send(VER_STR);
-    remote_send("\r\n");
+	remote_send(c, VER_STR);
+	remote_send(c, "\r\n");
 }
 
-void remote_write(const char *message) {
-    if (data_socket < 0)
-        return;
-
-    int e = send(data_socket, message, strlen(message), 0);
-    if (e >= 0)
-        return;
-    close(data_socket);
-    data_socket = -1;
+static void remote_close(struct remote_client *c){
+	struct remote_client **p;
+
+	if (c->net.closed)
+		return;
+	printf("Telnet client on socket %d closed\n", c->net.fd);
+	for (p = &clients; *p; p = &(*p)->next)
+		if (*p == c){
+			*p = c->next;
+			break;
+		}
+	net_client_close(epoll_fd, &dead, &c->net);
+}
+
+// returns -1 if the client was closed
+static int remote_flush(struct remote_client *c){
+	struct epoll_event ev;
+	int pending;
+
+	if (c->out_len >= REMOTE_MAX_OUT){
+		remote_close(c);
+		return -1;
+	}
+	while (c->out_len > 0){
+		int n = send(c->net.fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0){
+			remote_close(c);
+			return -1;
+		}
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
+	}
+
+	/* the ring is sent without holding its lock, the writers may go
+	round it meanwhile and write over what is being sent. The head is
+	looked at again after the send, what was sent of a lapped ring is
+	marked like a skip. */
+	uint64_t sent = c->cursor;
+	for (;;){
+		pthread_mutex_lock(&ring_lock);
+		uint64_t head = ring_head;
+		pthread_mutex_unlock(&ring_lock);
+
+		if (head - sent > REMOTE_RING){
+			c->cursor = head;
+			remote_send(c, "\r\n...\r\n");
+		}
+		sent = c->cursor;
+		if (c->out_len || c->cursor >= head)
+			break;
+
+		// upto the end of the ring, and the rest from its start
+		struct iovec iov[2];
+		int start = c->cursor % REMOTE_RING;
+		int len = head - c->cursor;
+		int first = len < REMOTE_RING - start ? len : REMOTE_RING - start;
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = len > first ? 2 : 1};
+
+		iov[0].iov_base = ring + start;
+		iov[0].iov_len = first;
+		iov[1].iov_base = ring;
+		iov[1].iov_len = len - first;
+		int n = sendmsg(c->net.fd, &msg, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0){
+			remote_close(c);
+			return -1;
+		}
+		c->cursor += n;
+	}
+	pthread_mutex_lock(&ring_lock);
+	pending = c->out_len || c->cursor < ring_head;
+	pthread_mutex_unlock(&ring_lock);
+
+	ev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->net.fd, &ev);
+	return 0;
+}
+
+static void remote_queue(struct remote_client *c, char *line){
+	pthread_mutex_lock(&queue_lock);
+	if (commands_count < REMOTE_QUEUE){
+		commands[commands_count].client = c->id;
+		commands[commands_count].text = strdup(line);
+		commands_count++;
+	}
+	else
+		remote_send(c, "busy\r\n");
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static void remote_receive(struct remote_client *c){
+	for (;;){
+		int n = recv(c->net.fd, c->in + c->in_len, REMOTE_MAX_LINE - c->in_len, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0){
+			remote_close(c);
+			return;
+		}
+		c->in_len += n;
+
+		char *end;
+		while ((end = memchr(c->in, '\n', c->in_len)) != NULL){
+			char line[REMOTE_MAX_LINE + 1];
+			int len = end - c->in;
+
+			memcpy(line, c->in, len);
+			line[len] = 0;
+			memmove(c->in, end + 1, c->in_len - len - 1);
+			c->in_len -= len + 1;
+
+			line[strcspn(line, "\r")] = 0;
+			if (strlen(line))
+				remote_queue(c, line);
+		}
+		// a line too long to be a command
+		if (c->in_len == REMOTE_MAX_LINE)
+			c->in_len = 0;
+	}
+	remote_flush(c);
+}
+
+static void remote_accept(int listen_fd){
+	for (;;){
+		struct sockaddr_in address;
+		socklen_t addrlen = sizeof(address);
+		struct epoll_event ev;
+		int fd = accept4(listen_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK);
+		if (fd < 0)
+			return;
+
+		struct remote_client *c = calloc(1, sizeof(struct remote_client));
+		if (!c){
+			close(fd);
+			continue;
+		}
+		puts("Accepted telnet connection\n");
+		c->net.fd = fd;
+		c->id = next_client_id++;
+		pthread_mutex_lock(&ring_lock);
+		c->cursor = ring_head;
+		pthread_mutex_unlock(&ring_lock);
+		c->next = clients;
+		clients = c;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+		// init the console
+		remote_init(c);
+		remote_flush(c);
+	}
+}
+
+// the answers from the ui and the new output in the ring
+static void remote_wakeup(){
+	struct remote_message ready[REMOTE_QUEUE];
+	struct remote_client *c, *next;
+	uint64_t count;
+	int n;
+
+	read(wake_fd, &count, sizeof(count));
+	pthread_mutex_lock(&queue_lock);
+	n = answers_count;
+	memcpy(ready, answers, n * sizeof(struct remote_message));
+	answers_count = 0;
+	pthread_mutex_unlock(&queue_lock);
+
+	for (int i = 0; i < n; i++){
+		for (c = clients; c && c->id != ready[i].client; c = c->next)
+			;
+		if (c)
+			remote_send(c, ready[i].text);
+		free(ready[i].text);
+	}
+
+	for (c = clients; c; c = next){
+		next = c->next;
+		remote_flush(c);
+	}
 }
 
-void remote_slice() {
-    struct sockaddr_storage server_storage;
-    socklen_t addr_size;
-    int e, len;
-    char buffer[1024];
-
-    if (data_socket == -1) {
-        addr_size = sizeof server_storage;
-        e = accept(welcome_socket, (struct sockaddr *) &server_storage, &addr_size);
-        if (e == -1)
-            return;
-        puts("Accepted telnet connection\n");
-        incoming_ptr = 0;
-        data_socket = e;
-        fcntl(data_socket, F_SETFL, fcntl(data_socket, F_GETFL) | O_NONBLOCK);
-
-        // init the console
-        remote_init();
-    } else {
-        //this section was changed by W9JES
-        len = recv(data_socket, buffer, sizeof(buffer), 0);
-        if (len > 0) {
-            buffer[len] = '\0'; // Ensure the buffer is null-terminated. Changed by W9JES
-            printf("Received on remote : [%s]\n", buffer);
-            // Strip off the last \r or \n
-            buffer[strcspn(buffer, "\r\n")] = '\0';
-            if (buffer[0] == '?') {
-                char response[2000];
-                get_field_value_by_label(buffer+1, response);
-                strcat(response, "\n");
-                remote_write(response);
-            } else if(strlen(buffer)) {
-                remote_execute(buffer);
-            }
-        } else if (len == 0) {
-            // The recv function returned 0 -> the client closed the connection. Added by w9JES
-            puts("Client closed the connection. Restarting to listen...");
-            close(data_socket);
-            data_socket = -1;
-        } else {
-            // An error occurred, check if it's EAGAIN or EWOULDBLOCK to keep the connection open. Modifed by W9JES
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return; // No data available right now, try again later
-            // For other errors, close the socket.
-            puts("Connection error. Dropping the connection...");
-            close(data_socket);
-            data_socket = -1;
-        }
-    }
+static void *remote_thread(void *arg){
+	struct sockaddr_in server_addr;
+	struct epoll_event ev, events[REMOTE_MAX_EVENTS];
+	int listen_fd, yes = 1;
+	static int wake_marker;
+
+	listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(REMOTE_PORT);
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+	memset(server_addr.sin_zero, '\0', sizeof server_addr.sin_zero);
+
+	/* Bind the address struct to the socket */
+	if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0
+		|| listen(listen_fd, 16) != 0){
+		printf("telnet listen() Error\n");
+		close(listen_fd);
+		return NULL;
+	}
+
+	epoll_fd = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &wake_marker;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	for (;;){
+		int n = epoll_wait(epoll_fd, events, REMOTE_MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR){
+			perror("telnet epoll");
+			break;
+		}
+		for (int i = 0; i < n; i++){
+			struct remote_client *c = events[i].data.ptr;
+			if (c == NULL)
+				remote_accept(listen_fd);
+			else if (events[i].data.ptr == &wake_marker)
+				remote_wakeup();
+			else if (c->net.closed)
+				continue;	// by an earlier event of this batch
+			else if (events[i].events & (EPOLLERR | EPOLLHUP))
+				remote_close(c);
+			else if (events[i].events & EPOLLIN)
+				remote_receive(c);
+			else if (events[i].events & EPOLLOUT)
+				remote_flush(c);
+		}
+		net_client_reap(&dead);
+	}
+	close(listen_fd);
+	return NULL;
+}
+
+void remote_start() {
+	pthread_t thread;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (pthread_create(&thread, NULL, remote_thread, NULL) != 0){
+		perror("Failed to create the telnet thread");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/* called from the ui tick, runs the commands that came in and
+	answers the questions */
+void remote_poll() {
+	struct remote_message pending[REMOTE_QUEUE];
+	int n, answered = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	n = commands_count;
+	memcpy(pending, commands, n * sizeof(struct remote_message));
+	commands_count = 0;
+	pthread_mutex_unlock(&queue_lock);
+
+	for (int i = 0; i < n; i++){
+		char *line = pending[i].text;
+		printf("Received on remote : [%s]\n", line);
+		if (line[0] == '?') {
+			char response[2000];
+			response[0] = 0;
+			get_field_value_by_label(line + 1, response);
+			strcat(response, "\n");
+
+			pthread_mutex_lock(&queue_lock);
+			if (answers_count < REMOTE_QUEUE){
+				answers[answers_count].client = pending[i].client;
+				answers[answers_count].text = strdup(response);
+				answers_count++;
+				answered = 1;
+			}
+			pthread_mutex_unlock(&queue_lock);
+		}
+		else
+			remote_run_command(line);
+		free(line);
+	}
+	if (answered)
+		remote_wake();
 }
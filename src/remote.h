@@ -1,3 +1,3 @@
 void remote_write(const char *message);
 void remote_start();
-void remote_slice();
+void remote_poll();
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "remote_audio.h"
+
+/* The audio for the remote (web) heads
+
+	The speaker audio comes in at 96000 samples per second, it is brought
+	down to 8000, 12000 or 16000 samples per second for the remote heads.
+	The lowpass before the decimation keeps everything above the new
+	nyquist out, so nothing aliases into the audio. Only the samples that
+	are kept are calculated, one dot product of the taps for every
+	output sample, this is the polyphase decimator folded into a single
+	loop: each output sees every phase of the filter once.
+
+	The decimated samples go into a ring as 16-bit values. Each web
+	session reads them from its own cursor (as pcm or encoded as
+	IMA-ADPCM), so every listener gets all the audio. The dsp is the only
+	writer, it publishes the head after the samples are in, the readers
+	take no locks.
+*/
+
+#define REMOTE_IN_RATE 96000
+#define REMOTE_MAX_TAPS 800
+#define REMOTE_RING 16384	// a second at 16000 samples per second
+
+static int16_t ring[REMOTE_RING];
+static unsigned int ring_head = 0;	// counts every sample ever written
+
+static float taps[REMOTE_MAX_TAPS];
+static float history[2 * REMOTE_MAX_TAPS];	// twice over, so that the window is contiguous
+static int n_taps = 0;
+static int factor = 6;
+static int phase = 0;
+static int history_index = 0;
+static int rate = 0;
+static volatile int new_rate = 16000;
+
+// a blackman windowed sinc, from 0.4 to 0.5 of the new rate
+static void remote_audio_design(int out_rate){
+	double fc = 0.45 * out_rate / REMOTE_IN_RATE;
+	double transition = 0.1 * out_rate / REMOTE_IN_RATE;
+
+	factor = REMOTE_IN_RATE / out_rate;
+	n_taps = (int)(5.5 / transition);
+	n_taps -= n_taps % factor;
+	if (n_taps > REMOTE_MAX_TAPS)
+		n_taps = REMOTE_MAX_TAPS - REMOTE_MAX_TAPS % factor;
+
+	double sum = 0;
+	for (int i = 0; i < n_taps; i++){
+		double n = i - (n_taps - 1) / 2.0;
+		double sinc = n == 0 ? 2 * fc : sin(2 * M_PI * fc * n) / (M_PI * n);
+		double window = 0.42 - 0.5 * cos(2 * M_PI * i / (n_taps - 1))
+			+ 0.08 * cos(4 * M_PI * i / (n_taps - 1));
+		taps[i] = sinc * window;
+		sum += taps[i];
+	}
+	for (int i = 0; i < n_taps; i++)
+		taps[i] /= sum;
+
+	memset(history, 0, sizeof(history));
+	history_index = 0;
+	phase = 0;
+	rate = out_rate;
+}
+
+// called from the webserver, the dsp picks it up at the next block
+int remote_audio_set_rate(int out_rate){
+	if (out_rate != 8000 && out_rate != 12000 && out_rate != 16000)
+		return -1;
+	new_rate = out_rate;
+	return 0;
+}
+
+int remote_audio_rate(){
+	return new_rate;
+}
+
+// the speaker samples of a block, at 96000 samples per second
+void remote_audio_write(int32_t *samples, int count){
+	if (rate != new_rate)
+		remote_audio_design(new_rate);
+
+	for (int i = 0; i < count; i++){
+		// scaled down to 16 bits
+		float x = samples[i] / 32768.0f;
+		history[history_index] = history[history_index + n_taps] = x;
+		if (++history_index == n_taps)
+			history_index = 0;
+
+		if (++phase < factor)
+			continue;
+		phase = 0;
+
+		// the taps are symmetric, the window runs from the oldest sample
+		float *window = history + history_index;
+		float y = 0;
+		for (int k = 0; k < n_taps; k++)
+			y += taps[k] * window[k];
+
+		if (y > 32767)
+			y = 32767;
+		else if (y < -32768)
+			y = -32768;
+		ring[ring_head % REMOTE_RING] = y;
+		__atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+// where a new listener starts
+unsigned int remote_audio_cursor(){
+	return __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+}
+
+// the samples after the cursor, upto max, a listener that fell behind skips ahead
+int remote_audio_read(unsigned int *cursor, int16_t *samples, int max){
+	unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	if (head - *cursor > REMOTE_RING / 2)
+		*cursor = head - REMOTE_RING / 4;
+	while (*cursor != head && count < max)
+		samples[count++] = ring[(*cursor)++ % REMOTE_RING];
+	return count;
+}
+
+/* IMA-ADPCM, 4 bits a sample
+
+	Each frame starts with the predictor and the step index, so a frame
+	decodes on its own, a lost frame does not upset the ones that follow.
+*/
+
+static const int adpcm_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int adpcm_step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// encodes count samples into out, the low nibble first, returns the bytes used
+int adpcm_encode(struct adpcm_state *s, int16_t *samples, int count, uint8_t *out){
+	int predictor = s->predictor;
+	int index = s->index;
+
+	for (int i = 0; i < count; i++){
+		int step = adpcm_step_table[index];
+		int diff = samples[i] - predictor;
+		int code = 0;
+
+		if (diff < 0){
+			code = 8;
+			diff = -diff;
+		}
+
+		// the same steps as the decoder takes, so the predictor tracks it
+		int delta = step >> 3;
+		if (diff >= step){
+			code |= 4;
+			diff -= step;
+			delta += step;
+		}
+		step >>= 1;
+		if (diff >= step){
+			code |= 2;
+			diff -= step;
+			delta += step;
+		}
+		step >>= 1;
+		if (diff >= step){
+			code |= 1;
+			delta += step;
+		}
+
+		if (code & 8)
+			predictor -= delta;
+		else
+			predictor += delta;
+		if (predictor > 32767)
+			predictor = 32767;
+		else if (predictor < -32768)
+			predictor = -32768;
+
+		index += adpcm_index_table[code];
+		if (index < 0)
+			index = 0;
+		else if (index > 88)
+			index = 88;
+
+		if (i & 1)
+			out[i / 2] |= code << 4;
+		else
+			out[i / 2] = code;
+	}
+
+	s->predictor = predictor;
+	s->index = index;
+	return (count + 1) / 2;
+}
+
+// decodes count samples from the codes, the low nibble first
+void adpcm_decode(struct adpcm_state *s, uint8_t *in, int count, int16_t *samples){
+	int predictor = s->predictor;
+	int index = s->index;
+
+	for (int i = 0; i < count; i++){
+		int code = (i & 1) ? in[i / 2] >> 4 : in[i / 2] & 0x0f;
+		int step = adpcm_step_table[index];
+		int delta = step >> 3;
+
+		if (code & 4)
+			delta += step;
+		if (code & 2)
+			delta += step >> 1;
+		if (code & 1)
+			delta += step >> 2;
+		if (code & 8)
+			predictor -= delta;
+		else
+			predictor += delta;
+		if (predictor > 32767)
+			predictor = 32767;
+		else if (predictor < -32768)
+			predictor = -32768;
+
+		index += adpcm_index_table[code];
+		if (index < 0)
+			index = 0;
+		else if (index > 88)
+			index = 88;
+		samples[i] = predictor;
+	}
+
+	s->predictor = predictor;
+	s->index = index;
+}
+
+/* The mic of a remote head
+
+	A browser that holds the PTT sends its mic as frames of samples at
+	8000, 12000 or 16000 samples per second, each stamped with the
+	position of its first sample in the browser's sample clock. The
+	webserver thread writes them into the jitter buffer at that position,
+	a gap (a frame the browser dropped) is filled with silence and what
+	comes in late is thrown away.
+
+	The dsp reads it at 96000 samples per second in place of the local
+	mic. It waits till MIC_TARGET_MSEC of the audio is in before it
+	starts, then steers the playout rate by upto MIC_STEER to hold
+	the buffer at that depth: the two sound cards never run at exactly
+	the same rate and the network comes in bursts. When the buffer runs
+	dry, the last few milliseconds are repeated, fading out, and the
+	buffer fills up to the target again before it plays on.
+*/
+
+#define MIC_RING 32768				// two seconds at 16000
+#define MIC_TARGET_MSEC 80
+#define MIC_STEER 0.02
+#define MIC_CONCEAL 160				// 10 msec at 16000, the period that is repeated
+
+static int16_t mic_ring[MIC_RING];
+static pthread_mutex_t mic_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mic_live = 0;			// a remote head has the mic
+static int mic_playing = 0;			// the target depth was reached
+static int mic_rate = 16000;
+static int64_t mic_end;				// just after the last sample written
+static double mic_play;				// where the dsp reads
+static int64_t mic_conceal;			// samples repeated since the underrun
+static float mic_fade;
+static unsigned int mic_underruns, mic_late;
+
+static void remote_mic_restart(int64_t at){
+	mic_end = at;
+	mic_play = at;
+	mic_playing = 0;
+	mic_fade = 0;
+}
+
+// called from the webserver thread with a frame from the browser
+void remote_mic_write(uint32_t timestamp, int sample_rate, int16_t *samples, int count){
+	if (sample_rate != 8000 && sample_rate != 12000 && sample_rate != 16000)
+		return;
+
+	pthread_mutex_lock(&mic_lock);
+	if (!mic_live)
+		mic_underruns = mic_late = 0;
+	if (!mic_live || sample_rate != mic_rate){
+		mic_live = 1;
+		mic_rate = sample_rate;
+		remote_mic_restart(timestamp);
+	}
+
+	// the timestamps are 32 bits and wrap, the positions here don't
+	int64_t at = mic_end + (int32_t)(timestamp - (uint32_t)mic_end);
+	if (at > mic_end + MIC_RING / 2 || at + count <= mic_play){
+		// way off, the browser must have started over
+		remote_mic_restart(at);
+	}
+	else if (at < mic_end){
+		int late = mic_end - at;
+		if (late >= count){
+			mic_late++;
+			pthread_mutex_unlock(&mic_lock);
+			return;
+		}
+		samples += late;
+		count -= late;
+		at = mic_end;
+	}
+	while (mic_end < at)
+		mic_ring[mic_end++ % MIC_RING] = 0;
+	for (int i = 0; i < count; i++)
+		mic_ring[mic_end++ % MIC_RING] = samples[i];
+
+	// the reader is too far behind, pull it up to the target
+	if (mic_end - mic_play > MIC_RING - MIC_CONCEAL)
+		mic_play = mic_end - mic_rate * MIC_TARGET_MSEC / 1000;
+	pthread_mutex_unlock(&mic_lock);
+}
+
+// the webserver lets go of the mic when the ptt is let go or the link is lost
+void remote_mic_release(){
+	pthread_mutex_lock(&mic_lock);
+	mic_live = 0;
+	pthread_mutex_unlock(&mic_lock);
+}
+
+int remote_mic_active(){
+	return mic_live;
+}
+
+/* fills a block of the mic at 96000 samples per second, scaled like the
+	local mic. Returns 0 when no remote head has the mic */
+int remote_mic_read(int32_t *mic, int count){
+	pthread_mutex_lock(&mic_lock);
+	if (!mic_live){
+		pthread_mutex_unlock(&mic_lock);
+		return 0;
+	}
+
+	int target = mic_rate * MIC_TARGET_MSEC / 1000;
+	double depth = mic_end - mic_play;
+	if (!mic_playing && depth >= target){
+		mic_playing = 1;
+		mic_conceal = 0;
+	}
+
+	double steer = (depth - target) / target;
+	if (steer > 1)
+		steer = 1;
+	else if (steer < -1)
+		steer = -1;
+	double step = (double)mic_rate / REMOTE_IN_RATE * (1 + MIC_STEER * steer);
+
+	for (int i = 0; i < count; i++){
+		float y;
+		if (mic_playing && mic_play + 1 < mic_end){
+			int64_t n = (int64_t)mic_play;
+			float frac = mic_play - n;
+			y = mic_ring[n % MIC_RING] * (1 - frac) + mic_ring[(n + 1) % MIC_RING] * frac;
+			mic_play += step;
+		}
+		else {
+			// ran dry, repeat the last period, fading, till there is enough again
+			if (mic_playing){
+				mic_playing = 0;
+				mic_underruns++;
+				mic_conceal = 0;
+				mic_fade = 1;
+			}
+			int64_t n = mic_end - MIC_CONCEAL
+				+ (mic_conceal++ * mic_rate / REMOTE_IN_RATE) % MIC_CONCEAL;
+			y = mic_end >= MIC_CONCEAL ? mic_ring[n % MIC_RING] * mic_fade : 0;
+			mic_fade *= 0.9995;
+		}
+		mic[i] = y * 65536;
+	}
+	pthread_mutex_unlock(&mic_lock);
+	return 1;
+}
+
+void remote_mic_stats(unsigned int *underruns, unsigned int *late, int *depth_msec){
+	pthread_mutex_lock(&mic_lock);
+	*underruns = mic_underruns;
+	*late = mic_late;
+	*depth_msec = mic_live ? (mic_end - mic_play) * 1000 / mic_rate : 0;
+	pthread_mutex_unlock(&mic_lock);
+}
@@ -0,0 +1,17 @@
+struct adpcm_state {
+	int predictor;
+	int index;
+};
+
+int remote_audio_set_rate(int out_rate);
+int remote_audio_rate();
+void remote_audio_write(int32_t *samples, int count);
+unsigned int remote_audio_cursor();
+int remote_audio_read(unsigned int *cursor, int16_t *samples, int max);
+int adpcm_encode(struct adpcm_state *s, int16_t *samples, int count, uint8_t *out);
+void adpcm_decode(struct adpcm_state *s, uint8_t *in, int count, int16_t *samples);
+void remote_mic_write(uint32_t timestamp, int sample_rate, int16_t *samples, int count);
+void remote_mic_release();
+int remote_mic_active();
+int remote_mic_read(int32_t *mic, int count);
+void remote_mic_stats(unsigned int *underruns, unsigned int *late, int *depth_msec);
@@ -24,6 +24,10 @@
 #include "si5351.h"
 #include "ini.h"
 #include "para_eq.h"
+#include "speech.h"
+#include "webserver.h"
+#include "remote_audio.h"
+#include "shm_tap.h"
 
 #define DEBUG 0
 
@@ -94,7 +98,7 @@ static double spectrum_speed = 0.3;
 static int in_tx = 0;
 static int rx_tx_ramp = 0;
 static int sidetone = 100;
-struct vfo tone_a, tone_b, am_carrier; // these are audio tone generators
+struct nco tone_a, tone_b, am_carrier; // these are audio tone generators
 static int tx_use_line = 0;
 struct rx *rx_list = NULL;
 struct rx *tx_list = NULL;
@@ -172,8 +176,6 @@ struct power_settings band_power[] = {
 #define TUNING_SHIFT (0)
 #define MDS_LEVEL (-135)
 
-struct Queue qremote;
-
 void radio_tune_to(u_int32_t f)
 {
 	if (rx_list->mode == MODE_CW)
@@ -342,41 +344,6 @@ static int create_mcast_socket(){
 }
 */
 
-void apply_fixed_compression(float *input, int num_samples, int compression_control_value)
-{
-	float compression_level = compression_control_value / 10.0;
-
-	// I dont think we need to provide too many confusng controls so let's define internal fixed compression parameters
-	float internal_threshold = 0.1f;
-	float internal_ratio = 4.0f;
-
-	for (int i = 0; i < num_samples; i++)
-	{
-		float sample = input[i];
-
-		if (sample > internal_threshold)
-		{
-			sample = internal_threshold + (sample - internal_threshold) / internal_ratio;
-		}
-		else if (sample < -internal_threshold)
-		{
-			sample = -internal_threshold + (sample + internal_threshold) / internal_ratio;
-		}
-
-		// Apply some makeup gain proportional to control level
-		sample *= 1.0 + compression_level;
-
-		// Ensure sample stays within range or we'll clip
-		if (sample > 1.0)
-			sample = 1.0;
-		if (sample < -1.0)
-			sample = -1.0;
-
-		// Send the processed sample back
-		input[i] = sample;
-	}
-}
-
 int calculate_s_meter()
 {
 	double signal_strength = 0.0;
@@ -422,16 +389,6 @@ int calculate_s_meter()
 	return (s_units * 100) + additional_db;
 }
 
-int remote_audio_output(int16_t *samples)
-{
-	int length = q_length(&qremote);
-	for (int i = 0; i < length; i++)
-	{
-		samples[i] = q_read(&qremote) / 32786;
-	}
-	return length;
-}
-
 static int prev_lpf = -1;
 void set_lpf_40mhz(int frequency)
 {
@@ -812,6 +769,9 @@ void rx_linear(int32_t *input_rx,  int32_t *input_mic,
 		r->fft_freq[i] = fft_out[b];
 	}
 
+	// the skimmer reads the bins before they are filtered
+	modem_rx_bins(r->mode, r->fft_freq, MAX_BINS);
+
 	static int rx_eq_initialized = 0;
 
 	if (!rx_eq_initialized)
@@ -822,7 +782,7 @@ void rx_linear(int32_t *input_rx,  int32_t *input_mic,
 
 	// STEP 4a: BIN processing functions for a better life.
 
-	if (r->mode != MODE_DIGITAL && r->mode != MODE_FT8 && r->mode != MODE_2TONE)
+	if (r->mode != MODE_DIGITAL && r->mode != MODE_FT8 && r->mode != MODE_FT4 && r->mode != MODE_2TONE && r->mode != MODE_PSK31 && r->mode != MODE_RTTY)
 	{
 		double sampling_rate = 96000.0; // Sample rate
 		static double noise_est[MAX_BINS] = {0};
@@ -1049,9 +1009,8 @@ void rx_linear(int32_t *input_rx,  int32_t *input_mic,
 			}
 		}
 
-		// Push the samples to the remote audio queue, decimated to 16000 samples/sec
-		for (i = 0; i < MAX_BINS / 2; i += 6)
-			q_write(&qremote, output_speaker[i]);
+		// Push the samples to the remote audio queue, filtered and decimated
+		remote_audio_write(output_speaker, MAX_BINS / 2);
 	}
 
 	if (mute_count)
@@ -1064,12 +1023,12 @@ void rx_linear(int32_t *input_rx,  int32_t *input_mic,
 	modem_rx(rx_list->mode, output_speaker, MAX_BINS / 2);
 
 	// Apply RXEQ after Modem only on non-digital modes
-	if (r->mode != MODE_DIGITAL && r->mode != MODE_FT8 && r->mode != MODE_2TONE)
+	if (r->mode != MODE_DIGITAL && r->mode != MODE_FT8 && r->mode != MODE_FT4 && r->mode != MODE_2TONE && r->mode != MODE_PSK31 && r->mode != MODE_RTTY)
 	{
 		if (rx_eq_is_enabled == 1)
 		{
-			// Step 1: Apply EQ with built-in normalization and clamping
-			apply_eq(&rx_eq, output_speaker, n_samples, 48000.0);
+			// Step 1: Apply EQ, its filters carry their state from block to block
+			apply_eq(&rx_eq, output_speaker, n_samples, 96000.0);
 
 			// Step 2: Optionally apply soft limiting (only if additional smoothing is required)
 			const double limiter_threshold = 0.8 * 500000000; // Lower limiter threshold for headroom
@@ -1149,29 +1108,17 @@ void read_power()
 
 static int tx_process_restart = 0;
 
-void tx_process(
-	int32_t *input_rx, int32_t *input_mic,
-	int32_t *output_speaker, int32_t *output_tx,
-	int n_samples)
-{
-	int i;
-	double i_sample, q_sample, i_carrier;
-
-  //uncomment this to test a simple audio loop of mic to speaker
-	//memcpy(output_speaker, input_mic, sizeof(int32_t) * n_samples);
-	//return;
+/* The tx sources
 
-	//if (pf_debug)
-	//	fwrite(input_mic, sizeof(int32_t), n_samples, pf_debug);
-
-	struct rx *r = tx_list;
+	Each mode has a source that fills a block of MAX_BINS/2 samples
+	to be modulated, and the audio for the speaker (the monitor or the
+	sidetone). tx_process() picks the source once per block, so the loops
+	over the samples have no decisions to make.
+*/
 
-	// fix the burst at the start of transmission
-	if (tx_process_restart)
-	{
-		fft_reset_m_bins();
-		tx_process_restart = 0;
-	}
+// the mic through the speech processor, for the modes that use the mic
+static void tx_voice_chain(struct rx *r, int32_t *input_mic, float *samples, float clip_level)
+{
 	static int eq_initialized = 0;
 
 	if (!eq_initialized)
@@ -1180,129 +1127,158 @@ void tx_process(
 		eq_initialized = 1;
 	}
 
-	if (in_tx && (r->mode != MODE_DIGITAL && r->mode != MODE_FT8 && r->mode != MODE_2TONE && r->mode != MODE_CW && r->mode != MODE_CWR))
+	for (int i = 0; i < MAX_BINS / 2; i++)
+		samples[i] = input_mic[i] / 2000000000.0;
+
+	// tx_process() only runs in tx, the compression and the eq always apply
+	speech_process(samples, MAX_BINS / 2, eq_is_enabled == 1 ? &tx_eq : NULL,
+		compression_control_level, clip_level);
+
+	if (mute_count && r->mode != MODE_NBFM)
 	{
+		memset(samples, 0, (MAX_BINS / 2) * sizeof(float));
+		mute_count--;
+	}
+}
 
-		// Apply compression is the value of the dial is set to 1-10 (0 = off)
-		if (compression_control_level >= 1 && compression_control_level <= 10)
-		{
-			float temp_input_mic[n_samples];
-			for (int i = 0; i < 5 && i < n_samples; i++)
-			{
-			}
-			// Convert input_mic (int32_t) to float for compression
-			for (int i = 0; i < n_samples; i++)
-			{
-				temp_input_mic[i] = (float)input_mic[i] / 2000000000.0;
-			}
+// the monitor of the voice modes, only if the txmon control is up
+static void tx_monitor(float *samples, int32_t *output_speaker)
+{
+	if (txmon_control_level >= 1 && txmon_control_level <= 10)
+		for (int i = 0; i < MAX_BINS / 2; i++)
+			output_speaker[i] = samples[i] * txmon_control_level * 1000000000.0;
+	else
+		memset(output_speaker, 0, (MAX_BINS / 2) * sizeof(int32_t));
+}
 
-			for (int i = 0; i < 5 && i < n_samples; i++)
-			{
-			}
-			// Now we can call the apply_fixed_compression function with the parameters
-			apply_fixed_compression(temp_input_mic, n_samples, compression_control_level);
+// usb, lsb and nbfm
+static void tx_source_voice(struct rx *r, int32_t *input_mic, float *samples, int32_t *output_speaker)
+{
+	// clip the overdrive to prevent damage up the processing chain, PA
+	tx_voice_chain(r, input_mic, samples, r->mode == MODE_NBFM ? 0 : voice_clip_level);
+	tx_monitor(samples, output_speaker);
+}
 
-			for (int i = 0; i < 5 && i < n_samples; i++)
-			{
-			}
-			// Convert back the processed data to int32_t after compression
-			for (int i = 0; i < n_samples; i++)
-			{
-				input_mic[i] = (int32_t)(temp_input_mic[i] * 2000000000.0);
-			}
-			for (int i = 0; i < 5 && i < n_samples; i++)
-			{
-			}
-		}
+// the am is already a carrier modulated at 24 KHz (at the levels of the 30 bit vfo)
+static void tx_source_am(struct rx *r, int32_t *input_mic, float *samples, int32_t *output_speaker)
+{
+	float carrier[MAX_BINS / 2];
+	float voice[MAX_BINS / 2];
 
-		if (eq_is_enabled == 1)
-		{
-			apply_eq(&tx_eq, input_mic, n_samples, 48000.0);
-		}
+	// the voice peaks at the clip level, that is the full modulation
+	tx_voice_chain(r, input_mic, voice, voice_clip_level);
+	nco_block(&am_carrier, carrier, NULL, MAX_BINS / 2);
+
+	for (int i = 0; i < MAX_BINS / 2; i++)
+	{
+		float modulation = voice[i] / voice_clip_level;
+		samples[i] = (1.0 + modulation) * carrier[i] * (1073741824.0 / 50000000000.0);
 	}
 
-	if (mute_count && (r->mode == MODE_USB || r->mode == MODE_LSB || r->mode == MODE_AM))
+	tx_monitor(samples, output_speaker);
+}
+
+// the modems hand over a whole block at a time, with a sidetone
+static void tx_source_modem(struct rx *r, float *samples, int32_t *output_speaker)
+{
+	modem_next_block(r->mode, samples, MAX_BINS / 2);
+	for (int i = 0; i < MAX_BINS / 2; i++)
 	{
-		memset(input_mic, 0, n_samples * sizeof(int32_t));
-		mute_count--;
+		samples[i] /= 3;
+		output_speaker[i] = (int)(samples[i] * 20000000.0) * sidetone;
 	}
-	// first add the previous M samples
-	for (i = 0; i < MAX_BINS / 2; i++)
-		fft_in[i] = fft_m[i];
+}
 
-	int m = 0;
-	int j = 0;
+// two tone test and tune (at the levels of the 30 bit vfo)
+static void tx_source_tones(struct rx *r, float *samples, int32_t *output_speaker)
+{
+	float tone_b_samples[MAX_BINS / 2];
 
-	// double max = -10.0, min = 10.0;
-	// gather the samples into a time domain array
-	for (i = MAX_BINS / 2; i < MAX_BINS; i++)
+	nco_block(&tone_a, samples, NULL, MAX_BINS / 2);
+	if (r->mode == MODE_2TONE)
 	{
-		if (r->mode == MODE_2TONE)
-			i_sample = (1.0 * (vfo_read(&tone_a) + vfo_read(&tone_b))) / 50000000000.0;
-		else if (r->mode == MODE_CALIBRATE)
-			i_sample = (1.0 * (vfo_read(&tone_a))) / 30000000000.0;
-		else if (r->mode == MODE_CW || r->mode == MODE_CWR || r->mode == MODE_FT8)
-			i_sample = modem_next_sample(r->mode) / 3;
-		else if (r->mode == MODE_AM)
-		{
-			double modulation = (1.0 * input_mic[j]) / 200000000.0;
-			if (modulation < -1.0)
-				modulation = -1.0;
-			i_carrier = (1.0 * vfo_read(&am_carrier)) / 50000000000.0;
-			i_sample = (1.0 + modulation) * i_carrier;
-		}
-		else
-			i_sample = (1.0 * input_mic[j]) / 2000000000.0;
+		nco_block(&tone_b, tone_b_samples, NULL, MAX_BINS / 2);
+		for (int i = 0; i < MAX_BINS / 2; i++)
+			samples[i] = (samples[i] + tone_b_samples[i]) * (1073741824.0 / 50000000000.0);
+	}
+	else
+		for (int i = 0; i < MAX_BINS / 2; i++)
+			samples[i] *= 1073741824.0 / 30000000000.0;
+	memset(output_speaker, 0, (MAX_BINS / 2) * sizeof(int32_t));
+}
 
-		// clip the overdrive to prevent damage up the processing chain, PA
-		if (r->mode == MODE_USB || r->mode == MODE_LSB || r->mode == MODE_AM)
-		{
-			if (i_sample < (-1.0 * voice_clip_level))
-				i_sample = -1.0 * voice_clip_level;
-			else if (i_sample > voice_clip_level)
-				i_sample = voice_clip_level;
-		}
+// the audio from the other programs, through the loopback
+static void tx_source_digital(struct rx *r, int32_t *input_mic, float *samples, int32_t *output_speaker)
+{
+	for (int i = 0; i < MAX_BINS / 2; i++)
+	{
+		samples[i] = input_mic[i] / 2000000000.0;
+		output_speaker[i] = input_mic[i] / 1000 * sidetone;
+	}
+}
 
-		// Don't echo the voice modes
-		switch(r->mode){
-			case MODE_USB:
-			case MODE_LSB:
-			case MODE_AM:
-			case MODE_NBFM:
-				// Unless of course you want to use the txmon control
-				if (txmon_control_level >= 1 && txmon_control_level <= 10)
-					output_speaker[j] = i_sample * txmon_control_level * 1000000000.0;
-				else
-					output_speaker[j] = 0;
-				break;
-			case MODE_CW:
-			case MODE_CWR:
-			case MODE_FT8:
-				output_speaker[j] = (int)(i_sample * 20000000.0) * sidetone;
-				break;
-			case MODE_DIGITAL:
-				output_speaker[j] = input_mic[j] / 1000 * sidetone;
-				break;
-		}
+void tx_process(
+	int32_t *input_rx, int32_t *input_mic,
+	int32_t *output_speaker, int32_t *output_tx,
+	int n_samples)
+{
+	int i;
 
-		q_sample = 0;
+  //uncomment this to test a simple audio loop of mic to speaker
+	//memcpy(output_speaker, input_mic, sizeof(int32_t) * n_samples);
+	//return;
 
-		j++;
+	//if (pf_debug)
+	//	fwrite(input_mic, sizeof(int32_t), n_samples, pf_debug);
 
-		__real__ fft_m[m] = i_sample;
-		__imag__ fft_m[m] = q_sample;
+	struct rx *r = tx_list;
 
-		__real__ fft_in[i] = i_sample;
-		__imag__ fft_in[i] = q_sample;
-		m++;
+	// fix the burst at the start of transmission
+	if (tx_process_restart)
+	{
+		fft_reset_m_bins();
+		tx_process_restart = 0;
+	}
+
+	// the source of the mode fills a block, then it is modulated
+	float tx_samples[MAX_BINS / 2];
+	switch (r->mode)
+	{
+	case MODE_CW:
+	case MODE_CWR:
+	case MODE_FT8:
+	case MODE_FT4:
+	case MODE_PSK31:
+	case MODE_RTTY:
+		tx_source_modem(r, tx_samples, output_speaker);
+		break;
+	case MODE_2TONE:
+	case MODE_CALIBRATE:
+		tx_source_tones(r, tx_samples, output_speaker);
+		break;
+	case MODE_AM:
+		tx_source_am(r, input_mic, tx_samples, output_speaker);
+		break;
+	case MODE_DIGITAL:
+		tx_source_digital(r, input_mic, tx_samples, output_speaker);
+		break;
+	default:
+		tx_source_voice(r, input_mic, tx_samples, output_speaker);
+	}
+
+	// the previous M samples and the new ones, the new ones are kept for the next block
+	for (i = 0; i < MAX_BINS / 2; i++)
+	{
+		fft_in[i] = fft_m[i];
+		fft_m[i] = tx_samples[i];
+		fft_in[i + (MAX_BINS / 2)] = tx_samples[i];
 	}
 
 	//if (pf_debug)
 	//	fwrite(output_speaker, sizeof(int32_t), MAX_BINS/2, pf_debug);
 
-	// push the samples to the remote audio queue, decimated to 16000 samples/sec
-	for (i = 0; i < MAX_BINS / 2; i += 6)
-		q_write(&qremote, output_speaker[i]);
+	// push the samples to the remote audio queue, filtered and decimated
+	remote_audio_write(output_speaker, MAX_BINS / 2);
 
 	// convert to frequency
 	fftw_execute(plan_fwd);
@@ -1395,6 +1371,8 @@ void sound_process(
 {
 	if (in_tx)
 	{
+		// a web client that holds the ptt talks through its own mic
+		remote_mic_read(input_mic, n_samples);
 		tx_process(input_rx, input_mic, output_speaker, output_tx, n_samples);
 	}
 	else
@@ -1406,6 +1384,13 @@ void sound_process(
 	{
 		wav_record(in_tx == 0 ? output_speaker : input_mic, n_samples);
 	}
+
+	// the local programs that read the tap
+	shm_tap_write(input_rx, output_speaker, n_samples, freq_hdr,
+		rx_list->tuned_bin * 96000 / MAX_BINS, rx_list->mode, in_tx);
+
+	// the web sessions that stream can have their spectrum and audio now
+	webserver_wakeup();
 }
 
 // Existing set_rx_filter function
@@ -1897,10 +1882,11 @@ void setup(const char *audio_output_device)
 
 	fft_init();
 	vfo_init_phase_table();
+	nco_init_table();
 	setup_oscillators();
-	q_init(&qremote, 8000);
 
 	modem_init();
+	shm_tap_open();
 
 	add_rx(7000000, MODE_LSB, -3000, -300);
 	add_tx(7000000, MODE_LSB, -3000, -300);
@@ -1922,9 +1908,9 @@ void setup(const char *audio_output_device)
 
 	sleep(1); // why? to allow the aloop to initialize?
 
-	vfo_start(&tone_a, 700, 0);
-	vfo_start(&tone_b, 1900, 0);
-	vfo_start(&am_carrier, 24000, 0);
+	nco_start(&tone_a, 700, 0);
+	nco_start(&tone_b, 1900, 0);
+	nco_start(&am_carrier, 24000, 0);
 	delay(2000);
 	//	pf_debug = fopen("am_test.raw", "w");
 }
@@ -1972,6 +1958,12 @@ void sdr_request(char *request, char *response)
 			rx_list->mode = MODE_CALIBRATE;
 		else if (!strcmp(value, "FT8"))
 			rx_list->mode = MODE_FT8;
+		else if (!strcmp(value, "FT4"))
+			rx_list->mode = MODE_FT4;
+		else if (!strcmp(value, "PSK31"))
+			rx_list->mode = MODE_PSK31;
+		else if (!strcmp(value, "RTTY"))
+			rx_list->mode = MODE_RTTY;
 		else if (!strcmp(value, "AM"))
 			rx_list->mode = MODE_AM;
 		else if (!strcmp(value, "DIGI"))
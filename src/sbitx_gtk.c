@@ -42,6 +42,9 @@ The initial sync between the gui values, the core radio values, settings, et al
 #include "hamlib.h"
 #include "remote.h"
 #include "modem_ft8.h"
+#include "modem_cw.h"
+#include "modem_psk.h"
+#include "modem_rtty.h"
 #include "i2cbb.h"
 #include "webserver.h"
 #include "logbook.h"
@@ -49,6 +52,7 @@ The initial sync between the gui values, the core radio values, settings, et al
 #include "ntputil.h"
 #include "para_eq.h"
 #include "eq_ui.h"
+#include "speech.h"
 #include <time.h>
 
 extern int get_rx_gain(void);
@@ -63,7 +67,6 @@ void highlight_band_field(int new_band);
 struct Queue q_remote_commands;
 struct Queue q_tx_text;
 struct Queue q_zbitx_console;
-struct Queue q_web;
 int eq_is_enabled = 0;
 int rx_eq_is_enabled = 0;
 int eptt_enabled = 0;
@@ -239,6 +242,8 @@ struct encoder enc_a, enc_b;
 //the PTT and DASH lines are pulled high
 int ptt_state = HIGH, dash_state = HIGH;
 struct field *cw_input = NULL;
+// decoded from CW_INPUT by key_method_update(), read by the key's ISRs
+static int key_input_method = CW_IAMBIC;
 struct field *f_mode = NULL;
 struct field *f_text_in = NULL;
 struct field *f_pitch = NULL;
@@ -286,7 +291,6 @@ void zbitx_poll(int all);
 void zbitx_get_spectrum(char *buff);
 void zbitx_write(int style, const char *text);
 
-struct Queue q_web;
 int noise_threshold = 0;		// DSP
 int noise_update_interval = 50; // DSP
 int bfo_offset = 0;
@@ -442,7 +446,7 @@ struct field
 	int step;
 	int section;
 	char is_dirty;
-	char update_remote;
+	unsigned int changed_version; // the latest entry of the field in the change journal
 	unsigned int updated_at;
 	void *data;
 };
@@ -487,9 +491,12 @@ static int *tx_mod_buff = NULL;
 static int tx_mod_index = 0;
 static int tx_mod_max = 0;
 
+// calibrate and tune are never kept in the band stack, they have no name
 char *mode_name[MAX_MODES] = {
-	"USB", "LSB", "CW", "CWR", "NBFM", "AM", "FT8", "PSK31", "RTTY",
-	"DIGI", "2TONE"};
+	[MODE_USB] = "USB", [MODE_LSB] = "LSB", [MODE_CW] = "CW", [MODE_CWR] = "CWR",
+	[MODE_NBFM] = "NBFM", [MODE_AM] = "AM", [MODE_FT8] = "FT8",
+	[MODE_PSK31] = "PSK31", [MODE_RTTY] = "RTTY", [MODE_DIGITAL] = "DIGI",
+	[MODE_2TONE] = "2TONE", [MODE_FT4] = "FT4"};
 
 static int serial_fd = -1;
 static int xit = 512;
@@ -636,7 +643,7 @@ struct field main_controls[] = {
 	{"#bw", do_bandwidth, 495, 5, 40, 40, "BW", 40, "", FIELD_NUMBER, STYLE_FIELD_VALUE,
 	 "", 50, 5000, 50, COMMON_CONTROL},
 	{"r1:mode", NULL, 5, 5, 40, 40, "MODE", 40, "USB", FIELD_SELECTION, STYLE_FIELD_VALUE,
-	 "USB/LSB/AM/CW/CWR/FT8/DIGI/2TONE", 0, 0, 0, COMMON_CONTROL},
+	 "USB/LSB/AM/CW/CWR/FT8/FT4/PSK31/RTTY/DIGI/2TONE", 0, 0, 0, COMMON_CONTROL},
 
 	/* logger controls */
 	{"#contact_callsign", do_text, 5, 50, 85, 20, "CALL", 70, "", FIELD_TEXT, STYLE_LOG,
@@ -1215,7 +1222,87 @@ int get_field_value_by_label(const char *label, char *value)
 	return 0;
 }
 
-// prepare to send the latest value of a field to the remote head
+/* The change journal for the remote heads
+
+	Every change to a field is noted in a ring with a version number
+	that only goes up. Each remote head (every web session, the zbitx)
+	holds a cursor, the last version it has seen, and pulls the fields
+	that changed after that. A field that changed many times since the
+	cursor is sent just once, with its latest value. A head that falls
+	more than the ring behind is told to take all the fields afresh.
+*/
+
+#define FIELD_JOURNAL_SIZE 512
+
+static struct
+{
+	unsigned int version;
+	struct field *f;
+} field_journal[FIELD_JOURNAL_SIZE];
+static unsigned int field_journal_version = 0;
+static pthread_mutex_t field_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void field_journal_add(struct field *f)
+{
+	pthread_mutex_lock(&field_journal_lock);
+	unsigned int v = ++field_journal_version;
+	field_journal[v % FIELD_JOURNAL_SIZE].version = v;
+	field_journal[v % FIELD_JOURNAL_SIZE].f = f;
+	f->changed_version = v;
+	pthread_mutex_unlock(&field_journal_lock);
+}
+
+// the next field changed after the cursor, NULL when the cursor is up to date
+// *lost is set if the cursor fell off the journal, the head needs all the fields
+static struct field *field_journal_next(unsigned int *cursor, int *lost)
+{
+	struct field *f = NULL;
+
+	*lost = 0;
+	pthread_mutex_lock(&field_journal_lock);
+	if (field_journal_version - *cursor > FIELD_JOURNAL_SIZE)
+		*lost = 1;
+	else
+		while (*cursor != field_journal_version)
+		{
+			unsigned int v = *cursor + 1;
+			*cursor = v;
+			if (field_journal[v % FIELD_JOURNAL_SIZE].f->changed_version == v)
+			{
+				f = field_journal[v % FIELD_JOURNAL_SIZE].f;
+				break;
+			}
+		}
+	pthread_mutex_unlock(&field_journal_lock);
+	return f;
+}
+
+// the version to start a cursor from, before taking all the fields
+unsigned int remote_journal_version()
+{
+	pthread_mutex_lock(&field_journal_lock);
+	unsigned int v = field_journal_version;
+	pthread_mutex_unlock(&field_journal_lock);
+	return v;
+}
+
+static void remote_field_text(struct field *f, char *text)
+{
+	strcpy(text, f->label);
+	strcat(text, " ");
+	strcat(text, f->value);
+}
+
+// the status line with the time, the remote head gets it afresh on every poll
+void remote_status(char *text)
+{
+	time_t now = time_sbitx();
+	struct tm *tmp = gmtime(&now);
+	sprintf(text, "STATUS %04d/%02d/%02d %02d:%02d:%02dZ",
+			tmp->tm_year + 1900, tmp->tm_mon + 1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec);
+}
+
+// the latest value of the i'th field for the remote head, -1 past the last field
 int remote_update_field(int i, char *text)
 {
 	struct field *f = active_layout + i;
@@ -1223,28 +1310,31 @@ int remote_update_field(int i, char *text)
 	if (f->cmd[0] == 0)
 		return -1;
 
-	// always send status afresh
 	if (!strcmp(f->label, "STATUS"))
-	{
-		// send time
-		time_t now = time_sbitx();
-		struct tm *tmp = gmtime(&now);
-		sprintf(text, "STATUS %04d/%02d/%02d %02d:%02d:%02dZ",
-				tmp->tm_year + 1900, tmp->tm_mon + 1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec);
-		return 1;
-	}
+		remote_status(text);
+	else
+		remote_field_text(f, text);
+	return 1;
+}
 
-	strcpy(text, f->label);
-	strcat(text, " ");
-	strcat(text, f->value);
-	int update = f->update_remote;
-	f->update_remote = 0;
+// the next field that changed since the cursor: 1 with the text,
+// 0 when there are no more, -1 when all the fields have to be sent again
+int remote_next_update(unsigned int *cursor, char *text)
+{
+	int lost;
+	struct field *f;
 
-	// debug on
-	// if (!strcmp(f->cmd, "#text_in") && strlen(f->value))
-	// printf("#text_in [%s] %d\n", f->value, update);
-	// debug off
-	return update;
+	do
+	{
+		f = field_journal_next(cursor, &lost);
+		if (lost)
+			return -1;
+		if (!f)
+			return 0;
+	} while (!strcmp(f->label, "STATUS"));
+
+	remote_field_text(f, text);
+	return 1;
 }
 
 // console is a list view, resembling a terminal with styled text
@@ -1257,17 +1347,53 @@ void console_init()
 	console_current_line = 0;
 }
 
+/* The console for the web sessions
+
+	The console text, tagged with its style, goes into a ring. Each web
+	session reads it from its own cursor, so every browser sees all of
+	it. web_console_head counts every byte that was ever written, the
+	ring holds the last WEB_CONSOLE_SIZE of them.
+*/
+
+#define WEB_CONSOLE_SIZE 8192
+
+static char web_console[WEB_CONSOLE_SIZE];
+static unsigned int web_console_head = 0;
+static unsigned int web_console_tail = 0;	// the oldest byte that is still of use
+static pthread_mutex_t web_console_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void web_add_string(char *string)
 {
+	pthread_mutex_lock(&web_console_lock);
 	while (*string)
-	{
-		q_write(&q_web, *string++);
-	}
+		web_console[web_console_head++ % WEB_CONSOLE_SIZE] = *string++;
+	if (web_console_head - web_console_tail > WEB_CONSOLE_SIZE)
+		web_console_tail = web_console_head - WEB_CONSOLE_SIZE;
+	pthread_mutex_unlock(&web_console_lock);
+}
+
+// drops the old messages, the sessions skip past them
+void web_console_clear()
+{
+	pthread_mutex_lock(&web_console_lock);
+	web_console_tail = web_console_head;
+	pthread_mutex_unlock(&web_console_lock);
+}
+
+// where a new session starts reading the console
+unsigned int web_console_cursor()
+{
+	pthread_mutex_lock(&web_console_lock);
+	unsigned int cursor = web_console_tail;
+	pthread_mutex_unlock(&web_console_lock);
+	return cursor;
 }
 
 void web_write(int style, char *data)
 {
 	char tag[20];
+	char *escaped = malloc(strlen(data) * 6 + 1);
+	char *p = escaped;
 
 	switch (style)
 	{
@@ -1300,56 +1426,38 @@ void web_write(int style, char *data)
 		strcpy(tag, "LOG");
 	}
 
-	web_add_string("<");
-	web_add_string(tag);
-	web_add_string(">");
 	while (*data)
 	{
 		switch (*data)
 		{
 		case '<':
-			q_write(&q_web, '&');
-			q_write(&q_web, 'l');
-			q_write(&q_web, 't');
-			q_write(&q_web, ';');
+			p = stpcpy(p, "&lt;");
 			break;
 		case '>':
-			q_write(&q_web, '&');
-			q_write(&q_web, 'g');
-			q_write(&q_web, 't');
-			q_write(&q_web, ';');
+			p = stpcpy(p, "&gt;");
 			break;
 		case '"':
-			q_write(&q_web, '&');
-			q_write(&q_web, 'q');
-			q_write(&q_web, 'u');
-			q_write(&q_web, 't');
-			q_write(&q_web, 'e');
-			q_write(&q_web, ';');
+			p = stpcpy(p, "&quote;");
 			break;
 		case '\'':
-			q_write(&q_web, '&');
-			q_write(&q_web, 'a');
-			q_write(&q_web, 'p');
-			q_write(&q_web, 'o');
-			q_write(&q_web, 's');
-			q_write(&q_web, ';');
+			p = stpcpy(p, "&apos;");
 			break;
 		case '\n':
-			q_write(&q_web, '&');
-			q_write(&q_web, '#');
-			q_write(&q_web, 'x');
-			q_write(&q_web, 'A');
-			q_write(&q_web, ';');
+			p = stpcpy(p, "&#xA;");
 			break;
 		default:
-			q_write(&q_web, *data);
+			*p++ = *data;
 		}
 		data++;
 	}
-	web_add_string("</");
-	web_add_string(tag);
-	web_add_string(">");
+	*p = 0;
+
+	// all of the message goes in at once, a session never sees half of it
+	char *message = malloc(strlen(escaped) + 2 * strlen(tag) + 6);
+	sprintf(message, "<%s>%s</%s>", tag, escaped, tag);
+	web_add_string(message);
+	free(message);
+	free(escaped);
 }
 
 int console_init_next_line()
@@ -1361,11 +1469,13 @@ int console_init_next_line()
 	return console_current_line;
 }
 
+// one write, so that the braces and the text can't be split by another writer
 void write_to_remote_app(int style, const char *text)
 {
-	remote_write("{");
-	remote_write(text);
-	remote_write("}");
+	char buff[1002];
+
+	snprintf(buff, sizeof(buff), "{%.*s}", (int)sizeof(buff) - 3, text);
+	remote_write(buff);
 }
 
 /*!
@@ -1603,7 +1713,7 @@ int console_long_press(void *p)
 	gtk_clipboard_set_text(clipboard, console_line, -1);
 
 	// FT8-specific functionality
-	if (!strcmp(get_field("r1:mode")->value, "FT8")) {
+	if (!strcmp(get_field("r1:mode")->value, "FT8") || !strcmp(get_field("r1:mode")->value, "FT4")) {
 		struct field *console = get_field("#console");
 		const int line_height = font_table[console->font_index].height;
 		int call_start = console_extract_semantic(console_selected_callsign,
@@ -1871,6 +1981,8 @@ static int mode_id(const char *mode_str){
 		return MODE_LSB;
 	else if (!strcmp(mode_str, "FT8"))
 		return MODE_FT8;
+	else if (!strcmp(mode_str, "FT4"))
+		return MODE_FT4;
 	else if (!strcmp(mode_str, "PSK31"))
 		return MODE_PSK31;
 	else if (!strcmp(mode_str, "RTTY"))
@@ -1973,7 +2085,7 @@ void enter_qso()
 	printf(buff);
 	update_logs = 1;
 	//wipe the call if not FT8
-	if (strcmp(field_str("MODE"), "FT8"))
+	if (strcmp(field_str("MODE"), "FT8") && strcmp(field_str("MODE"), "FT4"))
 		call_wipe();
 }
 
@@ -2340,6 +2452,16 @@ void draw_tx_meters(struct field *f, cairo_t *gfx)
 	draw_text(gfx, f->x + 20, f->y + 5, meter_str, STYLE_FIELD_LABEL);
 	sprintf(meter_str, "VSWR: %d.%d", vswr / 10, vswr % 10);
 	draw_text(gfx, f->x + 200, f->y + 5, meter_str, STYLE_FIELD_LABEL);
+
+	// the voice modes go through the speech processor, show how hard it works
+	int mode = mode_id(get_field("r1:mode")->value);
+	if (mode == MODE_USB || mode == MODE_LSB || mode == MODE_AM || mode == MODE_NBFM)
+	{
+		float comp, alc;
+		speech_reduction(&comp, &alc);
+		sprintf(meter_str, "Comp: %.1f dB  ALC: %.1f dB", comp, alc);
+		draw_text(gfx, f->x + 330, f->y + 5, meter_str, STYLE_FIELD_LABEL);
+	}
 }
 
 void draw_waterfall(struct field *f, cairo_t *gfx)
@@ -2782,7 +2904,7 @@ void draw_spectrum(struct field *f_spectrum, cairo_t *gfx)
 		cairo_stroke(gfx);
 	}
 
-	if (tx_pitch >= f_spectrum->x && !strcmp(mode_f->value, "FT8")){
+	if (tx_pitch >= f_spectrum->x && (!strcmp(mode_f->value, "FT8") || !strcmp(mode_f->value, "FT4"))){
 		cairo_set_source_rgb(gfx, palette[COLOR_TX_PITCH][0],
 			palette[COLOR_TX_PITCH][1], palette[COLOR_TX_PITCH][2]);
 		cairo_move_to(gfx, tx_pitch, f->y);
@@ -3210,7 +3332,7 @@ void draw_spectrum(struct field *f_spectrum, cairo_t *gfx)
 		cairo_stroke(gfx);
 	}
 
-	if (tx_pitch >= f_spectrum->x && !strcmp(mode_f->value, "FT8"))
+	if (tx_pitch >= f_spectrum->x && (!strcmp(mode_f->value, "FT8") || !strcmp(mode_f->value, "FT4")))
 	{
 		cairo_set_source_rgb(gfx, palette[COLOR_TX_PITCH][0],
 							 palette[COLOR_TX_PITCH][1], palette[COLOR_TX_PITCH][2]);
@@ -3607,6 +3729,7 @@ static void layout_ui()
 	switch (m_id)
 	{
 	case MODE_FT8:
+	case MODE_FT4:
 		// Place buttons and calculate highest Y position for FT8
 		field_move("CONSOLE", 5, y1, 350, y2 - y1 - 52);
 		field_move("SPECTRUM", 360, y1, x2 - 365, default_spectrum_height);
@@ -3842,7 +3965,7 @@ void update_field(struct field *f)
 {
 	if (f->y >= 0)
 		f->is_dirty = 1;
-	f->update_remote = 1;
+	field_journal_add(f);
 	f->updated_at = millis();
 }
 
@@ -3869,7 +3992,7 @@ static void edit_field(struct field *f, int action)
 	if (f->fn)
 	{
 		f->is_dirty = 1;
-		f->update_remote = 1;
+		field_journal_add(f);
 		f->updated_at = millis();
 		if (f->fn(f, NULL, FIELD_EDIT, action, 0, 0))
 			return;
@@ -3962,7 +4085,7 @@ static void edit_field(struct field *f, int action)
 	sprintf(buff, "%s %s", f->label, f->value);
 	do_control_action(buff);
 	f->is_dirty = 1;
-	f->update_remote = 1;
+	field_journal_add(f);
 	f->updated_at = millis();
 	//	update_field(f);
 	settings_updated++;
@@ -4343,6 +4466,7 @@ void set_filter_high_low(int hz)
 		high = hz;
 		break;
 	case MODE_FT8:
+	case MODE_FT4:
 		low = 50;
 		high = 4000;
 		break;
@@ -4376,7 +4500,7 @@ int do_status(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 		int line_height = font_table[f->font_index].height;
 		strcpy(f->value, buff);
 		f->is_dirty = 1;
-		f->update_remote = 1;
+		field_journal_add(f);
 		f->updated_at = millis();
 		sprintf(buff, "sBitx %s %s %04d/%02d/%02d %02d:%02d:%02dZ",
 				get_field("#mycallsign")->value, get_field("#mygrid")->value,
@@ -4416,7 +4540,7 @@ int do_text(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 			f->value[0] = 0;
 			update_field(f);
 		}
-		else if ((a == '\n' || a == MIN_KEY_ENTER) && !strcmp(get_field("r1:mode")->value, "FT8") && f->value[0] != COMMAND_ESCAPE)
+		else if ((a == '\n' || a == MIN_KEY_ENTER) && (!strcmp(get_field("r1:mode")->value, "FT8") || !strcmp(get_field("r1:mode")->value, "FT4")) && f->value[0] != COMMAND_ESCAPE)
 		{
 			ft8_tx(f->value, field_int("TX_PITCH"));
 			f->value[0] = 0;
@@ -4434,7 +4558,7 @@ int do_text(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 			f->value[l] = 0;
 		}
 		f->is_dirty = 1;
-		f->update_remote = 1;
+		field_journal_add(f);
 		f->updated_at = millis();
 		f_last_text = f;
 		return 1;
@@ -4505,6 +4629,7 @@ int do_pitch(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 			bw = field_int("BW_AM");
 			break;
 		case MODE_FT8:
+		case MODE_FT4:
 			bw = 4000;
 			break;
 		default:
@@ -4833,7 +4958,7 @@ int do_macro(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 			tx_on(TX_SOFT);
 		}
 
-		if (!strcmp(mode, "FT8") && strlen(buff))
+		if ((!strcmp(mode, "FT8") || !strcmp(mode, "FT4")) && strlen(buff))
 		{
 			ft8_tx(buff, atoi(get_field("#tx_pitch")->value));
 			set_field("#text_in", "");
@@ -4919,6 +5044,7 @@ void modify_eq_band_frequency(parametriceq *eq, int band_index, double new_frequ
 	if (band_index >= 0 && band_index < NUM_BANDS)
 	{
 		eq->bands[band_index].frequency = new_frequency;
+		eq_changed(eq);
 		// print_eq_int(eq);
 	}
 	else
@@ -4943,6 +5069,7 @@ void modify_eq_band_gain(parametriceq *eq, int band_index, double new_gain)
 			new_gain = 16.0;
 		}
 		eq->bands[band_index].gain = new_gain;
+		eq_changed(eq);
 		// print_eq_int(eq);
 		// fflush(stdout);
 	}
@@ -4958,6 +5085,7 @@ void modify_eq_band_bandwidth(parametriceq *eq, int band_index, double new_bandw
 	if (band_index >= 0 && band_index < NUM_BANDS)
 	{
 		eq->bands[band_index].bandwidth = new_bandwidth;
+		eq_changed(eq);
 		//       print_eq_int(eq);
 	}
 	else
@@ -5358,6 +5486,10 @@ void tx_on(int trigger)
 			tx_mode = MODE_2TONE;
 		else if (!strcmp(f->value, "DIGI"))
 			tx_mode = MODE_DIGITAL;
+		else if (!strcmp(f->value, "PSK31"))
+			tx_mode = MODE_PSK31;
+		else if (!strcmp(f->value, "RTTY"))
+			tx_mode = MODE_RTTY;
 		else if (!strcmp(f->value, "TUNE")) // Defined TUNE mode - W9JES
 			tx_mode = MODE_CALIBRATE;
 	}
@@ -6114,22 +6246,22 @@ void check_read_ina260_cadence(float *voltage, float *current)
 	}
 }
 
-int key_poll()
+/* the keying type is decoded only when CW_INPUT changes, on the ui thread.
+	The key is read again, the same paddles key differently on a straight key */
+static void key_method_update()
 {
-	int key = CW_IDLE;
-	//int input_method = get_cw_input_method();
-	if (cw_input == NULL){
-		printf("cw_input field must point to the CW_INPUT field\n");
-		return 0;
-	}
+	static char key_method_char = -1;
+	int input_method = CW_IAMBIC;
+
+	if (cw_input == NULL || cw_input->value[6] == key_method_char)
+		return;
 
 	//quick look up of one of the three values of keying type
 	//STRAIG[H]T
 	//IAMBIC[\0]
 	//IAMBIC[B]
-
-	int input_method = CW_IAMBIC;
-	switch(cw_input->value[6]){
+	key_method_char = cw_input->value[6];
+	switch(key_method_char){
 		case 0:
 			input_method = CW_IAMBIC;
 			break;
@@ -6140,7 +6272,14 @@ int key_poll()
 			input_method = CW_IAMBICB;
 			break;
 	}
+	__atomic_store_n(&key_input_method, input_method, __ATOMIC_RELAXED);
+	cw_key_edge(key_poll());
+}
 
+int key_poll()
+{
+	int key = CW_IDLE;
+	int input_method = __atomic_load_n(&key_input_method, __ATOMIC_RELAXED);
 
 	if (input_method == CW_IAMBIC || input_method == CW_IAMBICB) {
 		if (ptt_state == LOW)
@@ -6227,6 +6366,7 @@ void tuning_isr(void)
 void key_isr(void){
 	dash_state = digitalRead(DASH);
 	ptt_state = digitalRead(PTT);
+	cw_key_edge(key_poll());
 }
 
 void oled_toggle_band()
@@ -6370,25 +6510,36 @@ void bin_dump(int length, uint8_t *data)
 	printf("\n");
 }
 
-int web_get_console(char *buff, int max)
+// the console text after the cursor, upto max bytes, returns the bytes read
+int web_get_console(unsigned int *cursor, char *buff, int max)
 {
 	char c;
 	int i;
 
-	if (q_length(&q_web) == 0)
+	pthread_mutex_lock(&web_console_lock);
+	// skip what was cleared, or what the ring has lost
+	if (web_console_head - *cursor > web_console_head - web_console_tail)
+		*cursor = web_console_tail;
+	if (*cursor == web_console_head)
+	{
+		pthread_mutex_unlock(&web_console_lock);
 		return 0;
+	}
 	strcpy(buff, "CONSOLE ");
 	buff += strlen("CONSOLE ");
-	for (i = 0; (c = q_read(&q_web)) && i < max; i++)
+	for (i = 0; *cursor != web_console_head && i < max; i++)
 	{
+		c = web_console[(*cursor)++ % WEB_CONSOLE_SIZE];
 		if (c < 128 && c >= ' ')
 			*buff++ = c;
 	}
+	pthread_mutex_unlock(&web_console_lock);
 	*buff = 0;
 	return i;
 }
 
-void web_get_spectrum(char *buff)
+// the spectrum (or the modulation on tx) for the web, as 0 to 95 per bin
+int web_get_spectrum_bins(uint8_t *bins, int *tx)
 {
 
 	int n_bins = (int)((1.0 * spectrum_span) / 46.875);
@@ -6397,38 +6548,48 @@ void web_get_spectrum(char *buff)
 	int starting_bin = (3 * MAX_BINS) / 4 - n_bins / 2;
 	int ending_bin = starting_bin + n_bins;
 
-	int j = 3;
+	int j = 0;
+	*tx = in_tx;
 	if (in_tx)
 	{
-		strcpy(buff, "TX ");
 		for (int i = 0; i < MOD_MAX; i++)
 		{
 			int y = (2 * mod_display[i]) + 32;
 			if (y > 127)
-				buff[j++] = 127;
+				bins[j++] = 95;
 			else if (y > 0 && y <= 95)
-				buff[j++] = y + 32;
+				bins[j++] = y;
 			else
-				buff[j++] = ' ';
+				bins[j++] = 0;
 		}
 	}
 	else
 	{
-		strcpy(buff, "RX ");
 		for (int i = starting_bin; i <= ending_bin; i++)
 		{
 			int y = spectrum_plot[i] + waterfall_offset;
 			if (y > 95)
-				buff[j++] = 127;
+				bins[j++] = 95;
 			else if (y >= 0)
-				buff[j++] = y + 32;
+				bins[j++] = y;
 			else
-				buff[j++] = ' ';
+				bins[j++] = 0;
 		}
 	}
+	return j;
+}
 
-	buff[j++] = 0;
-	return;
+// the same, as text for the browsers that poll
+void web_get_spectrum(char *buff)
+{
+	uint8_t bins[MAX_BINS];
+	int tx;
+	int n = web_get_spectrum_bins(bins, &tx);
+
+	strcpy(buff, tx ? "TX " : "RX ");
+	for (int i = 0; i < n; i++)
+		buff[i + 3] = bins[i] + 32;
+	buff[n + 3] = 0;
 }
 
 void set_radio_mode(char *mode)
@@ -6464,6 +6625,7 @@ void set_radio_mode(char *mode)
 		new_bandwidth = field_int("BW_AM");
 		break;
 	case MODE_FT8:
+	case MODE_FT4:
 		new_bandwidth = 4000;
 		set_field("#current_macro", "FT8");
 		break;
@@ -6689,39 +6851,44 @@ static void zbitx_logs(){
 	fclose(pf);
 }
 
+static void zbitx_send_field(struct field *f){
+	char buff[MAX_FIELD_LENGTH + 40];
+	int e;
+	int retry;
+
+	if (!strcmp(f->label, "WATERFALL") || !strcmp(f->label, "SPECTRUM") || !strcmp(f->label, "CONSOLE"))
+		return;
+	sprintf(buff, "%s %s}", f->label, f->value);
+	retry = 3;
+	do {
+		e = i2cbb_write_i2c_block_data(ZBITX_I2C_ADDRESS, '{', strlen(buff), buff);
+		if (!e){
+			if (retry < 3)
+				printf("Sucess on %d\n", retry);
+			break;
+		}
+		delay(3);
+		printf("Retrying I2C %d\n", retry);
+	}while(retry--);
+	delay(10);
+}
+
 void zbitx_poll(int all){
 	char buff[3000];
-	static unsigned int last_update = 0;
-
-	int count = 0;
+	static unsigned int cursor = 0;
+	struct field *f;
+	int lost = 0;
 	int e = 0;
-	int retry;
-	unsigned int this_time = millis();
-
-	for (int i = 0; active_layout[i].cmd[0] > 0; i++){
-		struct field *f = active_layout+i;
-		if (!strcmp(f->label, "WATERFALL") || !strcmp(f->label, "SPECTRUM") || !strcmp(f->label, "CONSOLE"))
-			continue;
-		if (all || f->updated_at >  last_update){
-			sprintf(buff, "%s %s}", f->label, f->value);
-			retry = 3;
-			do {
-				e = i2cbb_write_i2c_block_data(ZBITX_I2C_ADDRESS, '{', strlen(buff), buff);
-				if (!e){
-					if (retry < 3)
-						printf("Sucess on %d\n", retry);
-					break;
-				}
-				delay(3);
-				printf("Retrying I2C %d\n", retry);
-			}while(retry--);
 
-			f->update_remote = 0;
-			count++;
-			delay(10);
-		}
+	// only the fields that changed since the last poll, unless the zbitx fell behind
+	if (!all)
+		while ((f = field_journal_next(&cursor, &lost)) != NULL)
+			zbitx_send_field(f);
+	if (all || lost){
+		cursor = remote_journal_version();
+		for (int i = 0; active_layout[i].cmd[0] > 0; i++)
+			zbitx_send_field(active_layout + i);
 	}
-	last_update = this_time;
 
 	//check if the console q has any new updates
 	while (q_length(&q_zbitx_console) > 0){
@@ -6781,7 +6948,6 @@ void zbitx_poll(int all){
 			remote_execute(buff);
 		}
 	}
-	last_update = this_time;
 }
 
 void zbitx_init()
@@ -6826,6 +6992,19 @@ void try_ntp(){
 		next_sync = millis() + 30000;
 }
 
+// runs a command from the web or the telnet remotes, on the ui thread
+void remote_run_command(char *remote_cmd)
+{
+	// echo the keystrokes for chatty modes like cw/rtty/psk31/etc
+	if (!strncmp(remote_cmd, "key ", 4)) {
+		for (int i = 4; remote_cmd[i] > 0; i++)
+			edit_field(get_field("#text_in"), remote_cmd[i]);
+	} else if (strlen(remote_cmd)) {
+		cmd_exec(remote_cmd);
+		settings_updated = 1; // save the settings
+	}
+}
+
 gboolean ui_tick(gpointer gook)
 {
 	int static ticks = 0;
@@ -6842,15 +7021,7 @@ gboolean ui_tick(gpointer gook)
 			remote_cmd[i] = c;
 		}
 		remote_cmd[i] = 0;
-
-		// echo the keystrokes for chatty modes like cw/rtty/psk31/etc
-		if (!strncmp(remote_cmd, "key ", 4)) {
-			for (int i = 4; remote_cmd[i] > 0; i++)
-				edit_field(get_field("#text_in"), remote_cmd[i]);
-		} else if (strlen(remote_cmd)) {
-			cmd_exec(remote_cmd);
-			settings_updated = 1; // save the settings
-		}
+		remote_run_command(remote_cmd);
 	}
 
 	//the Gtk invalidations can only be done from this thread, so..
@@ -6887,6 +7058,8 @@ gboolean ui_tick(gpointer gook)
 		// write_console(STYLE_LOG, message);
 	}
 
+	key_method_update();
+
 	//the modem tick is called on every tick
 	//each modem has to optimize for efficient operation
 
@@ -6899,6 +7072,7 @@ gboolean ui_tick(gpointer gook)
 			tick_count = 50;
 			break;
 		case MODE_FT8:
+		case MODE_FT4:
 			tick_count = 200;
 			break;
 		default:
@@ -7002,8 +7176,8 @@ gboolean ui_tick(gpointer gook)
 	}
 	// update_field(get_field("#text_in")); //modem might have extracted some text
 
-	// hamlib_slice();
-	remote_slice();
+	hamlib_poll();
+	remote_poll();
 	save_user_settings(0);
 
 	f = get_field("r1:mode");
@@ -7042,7 +7216,6 @@ void ui_init(int argc, char *argv[])
 		screen_height = gdk_screen_height();
 	#pragma pop
 	*/
-	q_init(&q_web, 5000);
 	q_init(&q_zbitx_console, 1000);
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -7109,7 +7282,7 @@ int get_tx_data_byte(char *c)
 			f->value[i] = f->value[i + 1];
 	}
 	f->is_dirty = 1;
-	f->update_remote = 1;
+	field_journal_add(f);
 	f->updated_at = millis();
 	//update_field(f);
 	return length;
@@ -7197,7 +7370,7 @@ void change_band(char *request)
 	set_operating_freq(band_stack[new_band].freq[stack], resp);
 	field_set("FREQ", buff);
 	int mode_ix = band_stack[new_band].mode[stack];
-	if (mode_ix < 0 || mode_ix > MAX_MODES)
+	if (mode_ix < 0 || mode_ix >= MAX_MODES || !mode_name[mode_ix])
 	{
 		printf("Illegal MODE id %d\n", mode_ix);
 		mode_ix = MODE_CW;
@@ -7209,7 +7382,7 @@ void change_band(char *request)
 
 	sprintf(buff, "%d", new_band);
 	set_field("#selband", buff); // signals web app to clear lists
-	q_empty(&q_web);			 // Clear old messages in queue
+	web_console_clear();		 // Clear old messages in queue
 	console_init();				 // Clear old FT8 messages
 
 	// this fixes bug with filter settings not being applied after a band change, not sure why it's a bug - k3ng 2022-09-03
@@ -7766,6 +7939,74 @@ void cmd_exec(char *cmd)
 	{
 		ft8_process(args, FT8_START_QSO);
 	}
+	else if (!strcmp(exec, "ft8stream"))
+	{
+		char *message = strchr(args, ' ');
+		if (!strcmp(args, "clear"))
+			ft8_tx_stream_clear();
+		else if (atoi(args) > 0 && message)
+			ft8_tx_stream(message + 1, atoi(args));
+		else
+			write_console(STYLE_LOG, "Usage: \\ft8stream [pitch] [message] or \\ft8stream clear\n");
+	}
+	else if (!strcmp(exec, "keysim"))
+	{
+		// simulates the paddles (or the straight key) without the gpio
+		int known = 1;
+		if (!strcmp(args, "dot") || !strcmp(args, "down"))
+			dash_state = LOW;
+		else if (!strcmp(args, "dash"))
+			ptt_state = LOW;
+		else if (!strcmp(args, "both"))
+			dash_state = ptt_state = LOW;
+		else if (!strcmp(args, "up"))
+			dash_state = ptt_state = HIGH;
+		else
+			known = 0;
+		if (known)
+			cw_key_edge(key_poll());
+		else
+			write_console(STYLE_LOG, "Usage: \\keysim dot|dash|both|down|up\n");
+	}
+	else if (!strcmp(exec, "skimmer"))
+	{
+		if (!strcmp(args, "on"))
+			cw_skimmer(1);
+		else if (!strcmp(args, "off"))
+			cw_skimmer(0);
+		else
+			write_console(STYLE_LOG, "Usage: \\skimmer on|off\n");
+	}
+	else if (!strcmp(exec, "psk"))
+	{
+		if (!strcmp(args, "scan on"))
+			psk_set_scan(1);
+		else if (!strcmp(args, "scan off"))
+			psk_set_scan(0);
+		else if (psk_set_mode(args) == -1)
+			write_console(STYLE_LOG, "Usage: \\psk bpsk31|bpsk63|qpsk31|qpsk63|scan on|scan off\n");
+	}
+	else if (!strcmp(exec, "fldigi"))
+	{
+		if (fldigi_command(args) == -1)
+			write_console(STYLE_LOG, "Usage: \\fldigi <fldigi modem name, like OLIVIA-8-500>|off\n");
+	}
+	else if (!strcmp(exec, "rtty"))
+	{
+		if (!strcmp(args, "scan on"))
+			rtty_set_scan(1);
+		else if (!strcmp(args, "scan off"))
+			rtty_set_scan(0);
+		else if (rtty_set_mode(args) == -1)
+			write_console(STYLE_LOG, "Usage: \\rtty 45|50|170|425|850|normal|reverse|scan on|scan off\n");
+	}
+	else if (!strcmp(exec, "speech"))
+	{
+		char meters[200];
+		speech_meters(meters);
+		strcat(meters, "\n");
+		write_console(STYLE_LOG, meters);
+	}
 	else if (!strcmp(exec, "callsign"))
 	{
 		strcpy(get_field("#mycallsign")->value, args);
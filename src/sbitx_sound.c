@@ -5,6 +5,7 @@
 #include <fftw3.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
 #include "sound.h"
 #include "wiringPi.h"
 #include "sdr.h"
@@ -685,6 +686,70 @@ unsigned long sbitx_millis(){
 	return sound_millis;
 }
 
+/* sample clock timebase
+
+	The capture device is the steadiest clock we have, so the count of
+	samples captured is anchored to the wall clock, the one of time_sbitx()
+	(CLOCK_REALTIME, or the RTC's time when it was read at the start).
+	After every read, the time that the first sample ever captured must
+	have been taken is estimated from the samples read and the samples still
+	waiting in the capture buffer. Scheduling delays only make the estimate
+	later, so we keep the earliest one and let it creep up by a microsecond
+	per block, that follows the drift between the codec and the wall clock.
+	A jump of more than 50 msec (lost samples, the clock being stepped by ntp
+	or set from the RTC) re-anchors it.
+*/
+#define TIMEBASE_RATE 96000
+#define TIMEBASE_CREEP 0.000001
+#define TIMEBASE_JUMP 0.05
+
+static pthread_mutex_t timebase_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t timebase_samples = 0;
+static double timebase_anchor = 0;
+
+static void timebase_update(int frames_read){
+	int frames_waiting = snd_pcm_avail(pcm_capture_handle);
+	if (frames_waiting < 0)
+		frames_waiting = 0;
+	double now = time_sbitx_precise();
+
+	pthread_mutex_lock(&timebase_lock);
+	timebase_samples += frames_read;
+	double estimate = now - (double)(timebase_samples + frames_waiting) / TIMEBASE_RATE;
+
+	if (timebase_anchor == 0 || fabs(estimate - timebase_anchor) > TIMEBASE_JUMP)
+		timebase_anchor = estimate;
+	else if (estimate < timebase_anchor)
+		timebase_anchor = estimate;
+	else
+		timebase_anchor += TIMEBASE_CREEP;
+	pthread_mutex_unlock(&timebase_lock);
+}
+
+// the number of samples captured so far
+uint64_t sound_sample_count(){
+	pthread_mutex_lock(&timebase_lock);
+	uint64_t n = timebase_samples;
+	pthread_mutex_unlock(&timebase_lock);
+	return n;
+}
+
+// the wall clock time, in seconds, when the capture sample was taken
+double sound_sample_time(uint64_t sample){
+	pthread_mutex_lock(&timebase_lock);
+	double t = timebase_anchor + (double)sample / TIMEBASE_RATE;
+	pthread_mutex_unlock(&timebase_lock);
+	return t;
+}
+
+// the capture sample that was (or will be) taken at wall clock time t
+int64_t sound_time_sample(double t){
+	pthread_mutex_lock(&timebase_lock);
+	int64_t sample = llround((t - timebase_anchor) * TIMEBASE_RATE);
+	pthread_mutex_unlock(&timebase_lock);
+	return sample;
+}
+
 int sound_loop(){
 	int32_t		*line_in, *line_out, *data_in, *data_out,
 						*input_i, *output_i, *input_q, *output_q;
@@ -760,6 +825,7 @@ int sound_loop(){
 		printf("Delta Time: %d, Available output sample storage: %d\n", delta_time, snd_pcm_avail(pcm_play_handle));
 #endif
 		samples_read += pcmreturn;
+		timebase_update(pcmreturn);
 
 		i = 0;
 		j = 0;
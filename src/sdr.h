@@ -60,6 +60,8 @@ have continuos waveform.
 
 */
 
+#include <stdint.h>
+
 struct Queue
 {
   int id;
@@ -114,6 +116,18 @@ void vfo_init_phase_table();
 void vfo_start(struct vfo *v, int frequency_hz, int start_phase);
 int vfo_read(struct vfo *v);
 
+// numerically controlled oscillator, 32 bit phase, a block at a time
+struct nco {
+	double freq_hz;
+	uint32_t phase;
+	uint32_t phase_increment;
+};
+
+void nco_init_table();
+void nco_start(struct nco *n, double frequency_hz, uint32_t start_phase);
+void nco_set_freq(struct nco *n, double frequency_hz);
+void nco_block(struct nco *n, float *i_out, float *q_out, int count);
+
 
 // the filter definitions
 struct filter {
@@ -128,6 +142,16 @@ struct filter *filter_new(int input_length, int impulse_length);
 int filter_tune(struct filter *f, float const low,float const high,float const kaiser_beta);
 int make_hann_window(float *window, int max_count);
 void filter_print(struct filter *f);
+
+// the decimating filter of the modems' receivers, a block at a time
+#define DECIMATOR_TAPS 96
+struct decimator {
+	float fir[DECIMATOR_TAPS];
+	float history[DECIMATOR_TAPS + MAX_BINS/2];
+};
+
+void decimator_init(struct decimator *d, double cutoff_hz);
+void decimator_run(struct decimator *d, int32_t *samples, int count, float *out, int factor);
 long set_bfo_offset(int offset,long freq);
 void resetup_oscillators();
 int get_bfo_offset();
@@ -141,7 +165,7 @@ static inline double const cnrm(const complex double x){
 
 #define power2dB(x) (10*log10f(x))
 
-#define MAX_MODES 11
+#define MAX_MODES 14
 
 #define MODE_USB 0
 #define MODE_LSB 1
@@ -156,6 +180,7 @@ static inline double const cnrm(const complex double x){
 #define MODE_2TONE 10
 #define MODE_CALIBRATE 11
 #define MODE_TUNE 12
+#define MODE_FT4 13
 
 struct rx {
 	long tuned_bin;					//tuned bin (this should translate to freq)
@@ -199,12 +224,16 @@ void sdr_modulation_update(int32_t *samples, int count, double scale_up);
 
 /* from modems.c */
 void modem_rx(int mode, int32_t *samples, int count);
+void modem_rx_bins(int mode, fftw_complex *bins, int n_bins);
+void modem_bins_average(float *avg, fftw_complex *bins, int lo, int hi);
+float modem_bins_noise(float *avg, int lo, int hi);
 void modem_set_pitch(int pitch, int mode);
+int fldigi_command(char *args);
 void modem_init();
 int get_tx_data_byte(char *c);
 int	get_tx_data_length();
 void modem_poll(int mode, int ticks);
-float modem_next_sample(int mode);
+void modem_next_block(int mode, float *samples, int count);
 void modem_abort();
 
 int is_in_tx();
@@ -220,6 +249,7 @@ void hamlib_tx(int tx_on);
 int get_default_passband_bw();
 int get_pitch();
 time_t time_sbitx();
+double time_sbitx_precise();
 
 //cw defines, these are bitfields, hence, powers of 2
 #define CW_IDLE (0)
@@ -90,14 +90,20 @@ int field_int(char *label);
 void write_console(sbitx_style style, const char *text);
 // write plain text, with semantically-tagged spans that imply styling
 void write_console_semantic(const char *text, const text_span_semantic *sem, int sem_count);
-int web_get_console(char *buff, int max);
+int web_get_console(unsigned int *cursor, char *buff, int max);
+unsigned int web_console_cursor();
+void web_console_clear();
 int is_in_tx();
 void abort_tx();
 void remote_execute(const char *command);
+void remote_run_command(char *command);
 int remote_update_field(int i, char *text);
+int remote_next_update(unsigned int *cursor, char *text);
+unsigned int remote_journal_version();
+void remote_status(char *text);
 void web_get_spectrum(char *buff);
+int web_get_spectrum_bins(uint8_t *bins, int *tx);
 void save_user_settings(int forced);
-int remote_audio_output(int16_t *samples);
 void enter_qso();
 void call_wipe();
 void update_log_ed();
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_tap.h"
+#include "sound.h"
+
+/* The shared memory tap
+
+	Each block of the dsp is put in a POSIX shared memory ring twice: the
+	samples as they came from the codec and the audio as it went to the
+	speaker, both at 96000 samples per second, both stamped with the
+	sample clock of the sound card (see sound_sample_count()) and the
+	wall clock time of their first sample, the dial frequency, the mode
+	and the tx state. Local
+	programs (skimmers, recorders, digital mode apps) map it read-only
+	and read it without the loopback device or a resampling step.
+
+	The dsp never waits on a reader, it doesn't even know of them. Each
+	slot has a sequence that is odd while the slot is being written, a
+	reader copies the block and checks that the sequence is the same as
+	before the copy, else the block was overwritten under it and it lost
+	it. A reader that is too slow loses blocks, the others don't notice.
+*/
+
+static struct shm_tap *tap = NULL;
+
+int shm_tap_open(){
+	int fd = shm_open(SHM_TAP_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd < 0){
+		perror("shm tap");
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(struct shm_tap)) < 0){
+		perror("shm tap");
+		close(fd);
+		return -1;
+	}
+	tap = mmap(NULL, sizeof(struct shm_tap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tap == MAP_FAILED){
+		perror("shm tap");
+		tap = NULL;
+		return -1;
+	}
+
+	// the readers from an earlier run see the magic go, and attach again
+	tap->magic = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(tap->blocks, 0, sizeof(tap->blocks));
+	tap->version = SHM_TAP_VERSION;
+	tap->sample_rate = SHM_TAP_RATE;
+	tap->block_samples = SHM_TAP_BLOCK;
+	tap->slots = SHM_TAP_SLOTS;
+	__atomic_store_n(&tap->head, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&tap->magic, SHM_TAP_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void shm_tap_put(uint32_t kind, uint64_t first, double time,
+	int32_t *samples, int count, int frequency, int if_hz, int mode, int tx){
+	uint64_t n = tap->head;
+	struct shm_tap_block *b = tap->blocks + n % SHM_TAP_SLOTS;
+
+	if (count > SHM_TAP_BLOCK)
+		count = SHM_TAP_BLOCK;
+
+	__atomic_store_n(&b->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	b->timestamp = first;
+	b->time = time;
+	b->kind = kind;
+	b->count = count;
+	b->frequency = frequency;
+	b->if_hz = if_hz;
+	b->mode = mode;
+	b->tx = tx;
+	memcpy(b->samples, samples, count * sizeof(int32_t));
+	__atomic_store_n(&b->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&tap->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// called by the dsp after each block
+void shm_tap_write(int32_t *rf, int32_t *audio, int count,
+	int frequency, int if_hz, int mode, int tx){
+	if (!tap)
+		return;
+
+	// the block was captured just now, it ends at the count
+	uint64_t first = sound_sample_count() - count;
+	double time = sound_sample_time(first);
+	shm_tap_put(SHM_TAP_RF, first, time, rf, count, frequency, if_hz, mode, tx);
+	shm_tap_put(SHM_TAP_AUDIO, first, time, audio, count, frequency, if_hz, mode, tx);
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+/* The layout of the shared memory tap (see shm_tap.c), the radio writes
+	it and any number of local programs read it, misc/sbitx_tap.c
+	has the reader side */
+
+#define SHM_TAP_NAME "/sbitx_tap"
+#define SHM_TAP_MAGIC 0x78546253		// "SbTx"
+#define SHM_TAP_VERSION 2
+#define SHM_TAP_RATE 96000
+#define SHM_TAP_BLOCK 1024				// samples in a block, as the dsp does them
+#define SHM_TAP_SLOTS 256				// about 1.3 seconds of both kinds
+
+#define SHM_TAP_RF 1		// the samples from the codec, the dial frequency at if_hz
+#define SHM_TAP_AUDIO 2		// the demodulated audio, as it goes to the speaker
+
+struct shm_tap_block {
+	uint64_t seq;			// 2n+2 once block n is in the slot, odd while it is written
+	uint64_t timestamp;		// of the first sample, samples at SHM_TAP_RATE since the start
+	double time;			// when the first sample was taken, seconds since the epoch
+	uint32_t kind;
+	uint32_t count;
+	int32_t frequency;		// the dial, in Hz
+	int32_t if_hz;			// where the dial frequency is in the rf samples
+	int32_t mode;			// MODE_USB etc. of sdr.h
+	int32_t tx;
+	int32_t samples[SHM_TAP_BLOCK];
+};
+
+struct shm_tap {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sample_rate;
+	uint32_t block_samples;
+	uint32_t slots;
+	uint32_t pad;
+	uint64_t head;			// blocks ever written, block n is in slot n % slots
+	struct shm_tap_block blocks[SHM_TAP_SLOTS];
+};
+
+int shm_tap_open();
+void shm_tap_write(int32_t *rf, int32_t *audio, int count,
+	int frequency, int if_hz, int mode, int tx);
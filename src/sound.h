@@ -27,6 +27,9 @@ void sound_volume(char *card_name, char *element, int volume);
 void sound_mixer(char *card_name, char *element, int make_on);
 void sound_input(int loop);
 unsigned long sbitx_millis();
+uint64_t sound_sample_count();
+double sound_sample_time(uint64_t sample);
+int64_t sound_time_sample(double t);
 
 //volume control normalizer
 extern int input_volume;
@@ -51,7 +54,6 @@ double scaleNoiseThreshold(int control);
 
 // Aduio Compression tool
 extern int compression_control_level;
-void apply_fixed_compression(float *input, int num_samples, int compression_control_value);
 
 // TX Monitor tool
 extern int txmon_control_level;
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include "para_eq.h"
+#include "speech.h"
+
+/* The speech processor for the voice modes
+
+	The mic block runs once through all the stages, in float, as it
+	comes in (at 96000 samples per second), before it is modulated:
+
+	dc block -> eq -> compressor -> clipper -> post-clip filter -> alc
+
+	The compressor follows a smoothed envelope of the speech, so it
+	rides the syllables instead of squaring off every peak. The clipper
+	takes off what is left of the peaks, the 4th order lowpass after it
+	removes the harmonics that the clipping generates, and the alc
+	catches the little overshoot that the filter puts back, so that the
+	output never goes over the clip level.
+
+	Each stage notes the peak of the block that it put out, these
+	are the meters that '\speech' prints. How far the compressor and
+	the alc pulled the block down is also shown with the tx meters.
+*/
+
+#define SPEECH_RATE 96000
+#define SPEECH_POSTCLIP 3000	// corner of the filter after the clipper
+
+#define SPEECH_DC_POLE 0.9995	// about 8 Hz
+#define SPEECH_THRESHOLD 0.05	// about -26 dBFS
+
+struct biquad {
+	float b0, b1, b2, a1, a2;
+	float z1, z2;
+};
+
+static float dc_x, dc_y;
+static float envelope;
+static float attack, release, alc_release;	// one pole smoothing, per sample
+static float alc_gain = 1;
+static struct biquad postclip[2];
+static int initialized = 0;
+
+// the peaks, and the lowest gains of the compressor and the alc
+static float meter[SPEECH_STAGES];
+static float comp_gain_min = 1, alc_gain_min = 1;
+
+static const char *stage_names[SPEECH_STAGES] =
+	{"in", "dc", "eq", "comp", "clip", "filter", "alc"};
+
+// a butterworth pair for a 4th order lowpass, q of each section from the poles
+static void speech_lowpass(struct biquad *f, double freq, double q){
+	double w = 2 * M_PI * freq / SPEECH_RATE;
+	double alpha = sin(w) / (2 * q);
+	double a0 = 1 + alpha;
+
+	f->b0 = (1 - cos(w)) / 2 / a0;
+	f->b1 = (1 - cos(w)) / a0;
+	f->b2 = f->b0;
+	f->a1 = -2 * cos(w) / a0;
+	f->a2 = (1 - alpha) / a0;
+	f->z1 = f->z2 = 0;
+}
+
+static inline float biquad_run(struct biquad *f, float x){
+	float y = f->b0 * x + f->z1;
+	f->z1 = f->b1 * x - f->a1 * y + f->z2;
+	f->z2 = f->b2 * x - f->a2 * y;
+	return y;
+}
+
+static void speech_init(){
+	speech_lowpass(postclip, SPEECH_POSTCLIP, 0.5412);
+	speech_lowpass(postclip + 1, SPEECH_POSTCLIP, 1.3066);
+	attack = 1 - exp(-1.0 / (0.002 * SPEECH_RATE));
+	release = 1 - exp(-1.0 / (0.150 * SPEECH_RATE));
+	alc_release = 1 - exp(-1.0 / (0.050 * SPEECH_RATE));
+	dc_x = dc_y = envelope = 0;
+	alc_gain = 1;
+	initialized = 1;
+}
+
+static float block_peak(float *samples, int count){
+	float peak = 0;
+	for (int i = 0; i < count; i++)
+		if (fabsf(samples[i]) > peak)
+			peak = fabsf(samples[i]);
+	return peak;
+}
+
+// the compression is 1 to 10 (0 is off), the clip level is 0 to not clip at all
+void speech_process(float *samples, int count, parametriceq *eq,
+	int compression, float clip_level){
+
+	if (!initialized)
+		speech_init();
+
+	meter[SPEECH_IN] = block_peak(samples, count);
+
+	for (int i = 0; i < count; i++){
+		dc_y = samples[i] - dc_x + SPEECH_DC_POLE * dc_y;
+		dc_x = samples[i];
+		samples[i] = dc_y;
+	}
+	meter[SPEECH_DC] = block_peak(samples, count);
+
+	if (eq)
+		apply_eq_float(eq, samples, count, SPEECH_RATE);
+	meter[SPEECH_EQ] = block_peak(samples, count);
+
+	comp_gain_min = 1;
+	if (compression >= 1 && compression <= 10){
+		float ratio = 1 + compression * 0.3;
+		float makeup = 1 + compression / 10.0;
+
+		for (int i = 0; i < count; i++){
+			float level = fabsf(samples[i]);
+			float gain = 1;
+
+			if (level > envelope)
+				envelope += (level - envelope) * attack;
+			else
+				envelope += (level - envelope) * release;
+
+			if (envelope > SPEECH_THRESHOLD)
+				gain = (SPEECH_THRESHOLD + (envelope - SPEECH_THRESHOLD) / ratio)
+					/ envelope;
+			if (gain < comp_gain_min)
+				comp_gain_min = gain;
+			samples[i] *= gain * makeup;
+		}
+	}
+	meter[SPEECH_COMP] = block_peak(samples, count);
+
+	alc_gain_min = 1;
+	if (clip_level <= 0){
+		meter[SPEECH_CLIP] = meter[SPEECH_FILTER] = meter[SPEECH_ALC]
+			= meter[SPEECH_COMP];
+		return;
+	}
+
+	for (int i = 0; i < count; i++){
+		if (samples[i] > clip_level)
+			samples[i] = clip_level;
+		else if (samples[i] < -clip_level)
+			samples[i] = -clip_level;
+	}
+	meter[SPEECH_CLIP] = block_peak(samples, count);
+
+	for (int i = 0; i < count; i++)
+		samples[i] = biquad_run(postclip + 1, biquad_run(postclip, samples[i]));
+	meter[SPEECH_FILTER] = block_peak(samples, count);
+
+	// the alc drops at once on an overshoot and comes back slowly
+	for (int i = 0; i < count; i++){
+		float level = fabsf(samples[i]) * alc_gain;
+		if (level > clip_level)
+			alc_gain = clip_level / fabsf(samples[i]);
+		else
+			alc_gain += (1 - alc_gain) * alc_release;
+		if (alc_gain < alc_gain_min)
+			alc_gain_min = alc_gain;
+		samples[i] *= alc_gain;
+	}
+	meter[SPEECH_ALC] = block_peak(samples, count);
+}
+
+static float to_db(float v){
+	if (v < 1e-6)
+		return -120;
+	return 20 * log10f(v);
+}
+
+// the peaks of the last block in dBFS, and the gain reduction
+void speech_meters(char *buff){
+	buff[0] = 0;
+	for (int i = 0; i < SPEECH_STAGES; i++)
+		sprintf(buff + strlen(buff), "%s %.1f ", stage_names[i], to_db(meter[i]));
+	sprintf(buff + strlen(buff), "(comp %.1f dB, alc %.1f dB)",
+		to_db(comp_gain_min), to_db(alc_gain_min));
+}
+
+// the gain reduction of the compressor and the alc in the last block, in dB
+void speech_reduction(float *comp_db, float *alc_db){
+	*comp_db = to_db(1 / comp_gain_min);
+	*alc_db = to_db(1 / alc_gain_min);
+}
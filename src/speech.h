@@ -0,0 +1,13 @@
+#define SPEECH_IN 0
+#define SPEECH_DC 1
+#define SPEECH_EQ 2
+#define SPEECH_COMP 3
+#define SPEECH_CLIP 4
+#define SPEECH_FILTER 5
+#define SPEECH_ALC 6
+#define SPEECH_STAGES 7
+
+void speech_process(float *samples, int count, parametriceq *eq,
+	int compression, float clip_level);
+void speech_meters(char *buff);
+void speech_reduction(float *comp_db, float *alc_db);
@@ -45,15 +45,111 @@ int vfo_read(struct vfo *v){
 }
 
 /*
-void main(int argc, char **argv){
+	The nco has a 32 bit phase, the steps are 22 micro Hz at 96000 
+	samples/sec (the 16 bit phase of the vfo steps 1.46 Hz). 
+	The sine is read from a table of a full cycle and interpolated
+	between its entries, the error is under -120 db.
+	A block of samples is generated at a time. Each sample's phase is
+	worked out from the start of the block, with no branches, so the
+	loop has no dependency from one sample to the next and the compiler
+	can vectorize it.
+	The i output is the cosine, q is the sine.
+*/
+
+#define NCO_TABLE_BITS 12
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define NCO_FRAC_BITS (32 - NCO_TABLE_BITS)
+
+static float nco_table[NCO_TABLE_SIZE];
+static float nco_slope[NCO_TABLE_SIZE]; // to the next entry
+
+void nco_init_table(){
+	for (int i = 0; i < NCO_TABLE_SIZE; i++){
+		nco_table[i] = sin((2 * M_PI * i) / NCO_TABLE_SIZE);
+		nco_slope[i] = sin((2 * M_PI * (i + 1)) / NCO_TABLE_SIZE) - nco_table[i];
+	}
+}
+
+void nco_set_freq(struct nco *n, double frequency_hz){
+	n->freq_hz = frequency_hz;
+	// negative frequencies wrap around, like the phase
+	n->phase_increment = (uint32_t)(int64_t)llround((frequency_hz * 4294967296.0) / sampling_freq);
+}
+
+void nco_start(struct nco *n, double frequency_hz, uint32_t start_phase){
+	nco_set_freq(n, frequency_hz);
+	n->phase = start_phase;
+}
+
+static inline float nco_lookup(uint32_t phase){
+	uint32_t index = phase >> NCO_FRAC_BITS;
+	float frac = (phase & ((1 << NCO_FRAC_BITS) - 1)) * (1.0f / (1 << NCO_FRAC_BITS));
+	return nco_table[index] + (nco_slope[index] * frac);
+}
+
+// q_out can be NULL if only the real (cosine) output is needed 
+void nco_block(struct nco *n, float *i_out, float *q_out, int count){
+	uint32_t phase = n->phase;
+	uint32_t increment = n->phase_increment;
+
+	for (int k = 0; k < count; k++)
+		i_out[k] = nco_lookup(phase + (k * increment) + 0x40000000u);
+	if (q_out)
+		for (int k = 0; k < count; k++)
+			q_out[k] = nco_lookup(phase + (k * increment));
+
+	n->phase = phase + (count * increment);
+}
+
+/*
+	Compares the vfo and the nco, the time for a second of samples:
+	gcc -O3 -march=native -I. -o vfo_bench src/vfo.c -lm
+
+int main(int argc, char **argv){
 	struct vfo v;
-	
-	vfo_init_phase_table();
+	struct nco n;
+	static float block[1024], q[1024];
+	double err = 0;
+	int64_t sum = 0;
+	float fsum = 0;
 
+	vfo_init_phase_table();
+	nco_init_table();
 	vfo_start(&v, 1000, 0);
+	nco_start(&n, 1000, 0);
 
-	for (int i = 0; i < 100; i++)
-		printf("%d ", vfo_read(&v));
+	clock_t start = clock();
+	for (int b = 0; b < 1000; b++)
+		for (int i = 0; i < 1024; i++)
+			sum += vfo_read(&v);
+	double t_vfo = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (int b = 0; b < 1000; b++){
+		nco_block(&n, block, NULL, 1024);
+		fsum += block[b];
+	}
+	double t_nco = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (int b = 0; b < 1000; b++){
+		nco_block(&n, block, q, 1024);
+		fsum += q[b];
+	}
+	double t_iq = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	nco_start(&n, 1000.001, 0);
+	nco_block(&n, block, q, 1024);
+	for (int i = 0; i < 1024; i++){
+		double e = fabs(q[i] - sin((2 * M_PI * 1000.001 * i) / sampling_freq));
+		if (e > err)
+			err = e;
+	}
 
+	printf("%d %g\n", (int)(sum & 1), fsum);
+	// 1000 blocks are 10.7 seconds of samples
+	printf("per second of samples, vfo_read %.3f msec, nco_block %.3f msec, with i/q %.3f msec\n",
+		t_vfo * 93.75, t_nco * 93.75, t_iq * 93.75);
+	printf("nco error %.1f db\n", 20 * log10(err));
 }
 */
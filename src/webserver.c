@@ -3,6 +3,7 @@
 #include "mongoose.h"
 #include "webserver.h"
 #include <pthread.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <complex.h>
 #include <fftw3.h>
@@ -11,20 +12,82 @@
 #include "sdr_ui.h"
 #include "logbook.h"
 #include "hist_disp.h"
+#include "remote_audio.h"
 
 static const char *s_listen_on = "ws://0.0.0.0:8080";
 static char s_web_root[1000];
-static char session_cookie[100];
 static struct mg_mgr mgr;  // Event manager
 
+/* The sessions
+
+	Each websocket takes a session from the table when it opens, hung on
+	the fn_data of its mongoose connection, upto WEB_MAX_SESSIONS of them.
+	Each logs in on its own and has its own cookie, so a login doesn't
+	throw the other browsers out. Each session has its own cursors into
+	the console, the remote audio and the field changes, so every browser
+	gets all of them, whoever polls first.
+
+	A browser that can't keep up (its mongoose send buffer is over the
+	watermark) loses spectrum and audio frames, the loop never waits on it.
+*/
+
+#define WEB_MAX_SESSIONS 8
+#define WEB_SEND_WATERMARK 65536
+
+struct web_session {
+	int in_use;
+	int logged_in;
+	char cookie[20];
+	unsigned int cursor;			// into the field changes
+	unsigned int console_cursor;
+	unsigned int audio_cursor;
+	int watermark;					// bytes waiting to go out, before frames are dropped
+	unsigned int frames_dropped;
+	int fps;				// spectrum frames per second, 0 if the browser polls
+	int audio;				// push the audio as well
+	int adpcm;				// the audio as IMA-ADPCM instead of pcm
+	uint32_t audio_seq;
+	int audio_depth, audio_target;	// msec, as the browser reports them
+	struct adpcm_state adpcm_state;
+	int delta;				// send the spectrum as 4-bit deltas between key frames
+	uint64_t next_frame, next_audio;
+	int frames_since_key;
+	int last_tx, last_n;
+	uint8_t last[MAX_BINS];	// the spectrum as the browser has it
+	uint32_t mic_seq;		// the next mic frame expected
+	unsigned int mic_lost;
+};
+
+static struct web_session sessions[WEB_MAX_SESSIONS];
+
+static struct web_session *session_open(){
+	for (int i = 0; i < WEB_MAX_SESSIONS; i++)
+		if (!sessions[i].in_use){
+			memset(sessions + i, 0, sizeof(struct web_session));
+			sessions[i].in_use = 1;
+			sessions[i].watermark = WEB_SEND_WATERMARK;
+			return sessions + i;
+		}
+	return NULL;
+}
+
 static void web_respond(struct mg_connection *c, char *message){
 	mg_ws_send(c, message, strlen(message), WEBSOCKET_OP_TEXT);
 }
 
+// a browser that is behind loses the frames rather than stall the rest
+static int web_is_behind(struct mg_connection *c, struct web_session *s){
+	if (c->send.len <= s->watermark)
+		return 0;
+	s->frames_dropped++;
+	return 1;
+}
+
 static void get_console(struct mg_connection *c){
+	struct web_session *s = (struct web_session *)c->fn_data;
 	char buff[2100];
 	
-	int n = web_get_console(buff, 2000);
+	int n = web_get_console(&s->console_cursor, buff, 2000);
 	if (!n)
 		return;
 	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
@@ -32,24 +95,36 @@ static void get_console(struct mg_connection *c){
 
 static void get_updates(struct mg_connection *c, int all){
 	//send the settings of all the fields to the client
+	struct web_session *s = (struct web_session *)c->fn_data;
 	char buff[2000];
 	int i = 0;
 
 	get_console(c);
 
-	while(1){
-		int update = remote_update_field(i, buff);
-		// return of -1 indicates the eof fields
-		if (update == -1)
-			return;
 	//send the status anyway
-		if (all || update )
+	remote_status(buff);
+	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT); 
+
+	if (!all){
+		int update;
+		while ((update = remote_next_update(&s->cursor, buff)) == 1)
+			mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT); 
+		//fell behind the journal, start over with all the fields
+		if (update == 0)
+			return;
+	}
+
+	s->cursor = remote_journal_version();
+	while(remote_update_field(i, buff) != -1){
+		// the status has gone already
+		if (strncmp(buff, "STATUS ", 7))
 			mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT); 
 		i++;
 	}
 }
 
 static void do_login(struct mg_connection *c, char *key){
+	struct web_session *s = (struct web_session *)c->fn_data;
 
 	char passkey[20];
 	get_field_value("#passkey", passkey);
@@ -63,33 +138,307 @@ static void do_login(struct mg_connection *c, char *key){
 	}
 	
 	hd_createGridList(); // oz7bx: Make the list up to date at the beginning of a session
-	sprintf(session_cookie, "%x", rand());
+	sprintf(s->cookie, "%x%02x", rand(), (int)(s - sessions));
+	s->logged_in = 1;
+	s->console_cursor = web_console_cursor();
+	s->audio_cursor = remote_audio_cursor();
 	char response[100];
-	sprintf(response, "login %s", session_cookie);
+	sprintf(response, "login %s", s->cookie);
 	web_respond(c, response);	
 	get_updates(c, 1);
 }
 
-static int16_t remote_samples[10000]; //the max samples are set by the queue lenght in modems.c
+/* The binary frames
+
+	The spectrum and the audio go to the browser as binary websocket
+	messages, the first byte tells them apart:
+	'S' a whole spectrum: tx flag, number of bins (16 bits, little endian),
+		then a byte per bin (0 to 95 dB above the floor)
+	'D' a spectrum as deltas from the last one: the same header, then
+		two bins per byte, 4-bit signed deltas, the lower nibble first
+	'A' the audio as 16-bit pcm, 'I' as IMA-ADPCM: a zero byte, the sample
+		rate (16 bits), the sequence number of the frame (32 bits), the
+		position of its first sample in the sample clock of the radio
+		(32 bits), then the samples, from the 12th byte. The adpcm starts
+		with the predictor (16 bits), the step index (a byte) and a byte
+		that is 1 if the last nibble is only padding, then two samples
+		to a byte, the lower nibble first
+
+	The sequence number tells the browser that frames were lost, the
+	timestamp where the samples go: it jumps when the radio skips the
+	audio of a session that fell behind. The browser plays the audio at a
+	latency it chooses and reports how deep its buffer is with
+	'audio_depth=<msec> <target msec>', once a second. If the buffer is
+	far over the target, the audio that the browser would drop anyway is
+	skipped here, before it is sent.
+
+	The deltas are clamped to -8..+7 and the session tracks what the
+	browser has rebuilt, so the error of a clamp is made up in the
+	frames that follow. A whole frame goes out every WEB_KEY_FRAMES.
+*/
+
+#define WEB_KEY_FRAMES 10
+
+//the max samples are set by the queue lenght in sbitx.c
+static int16_t remote_samples[10000];
+
+static void web_send_audio(struct mg_connection *c, struct web_session *s){
+	uint8_t frame[16 + sizeof(remote_samples)];
+	int rate = remote_audio_rate();
+	int length;
+
+	// the browser holds far too much, skip what it would drop
+	if (s->audio_depth > 2 * s->audio_target + 500){
+		unsigned int head = remote_audio_cursor();
+		unsigned int skip = (s->audio_depth - s->audio_target) * rate / 1000;
+		if (skip > head - s->audio_cursor)
+			skip = head - s->audio_cursor;
+		s->audio_cursor += skip;
+		s->audio_depth = 0;
+	}
+
+	int count = remote_audio_read(&s->audio_cursor, remote_samples,
+		sizeof(remote_samples) / sizeof(int16_t));
+
+	if (!count)
+		return;
+	// the read skips ahead for a session that fell behind
+	uint32_t timestamp = s->audio_cursor - count;
+
+	frame[0] = s->adpcm ? 'I' : 'A';
+	frame[1] = 0;
+	frame[2] = rate & 0xff;
+	frame[3] = rate >> 8;
+	for (int i = 0; i < 4; i++){
+		frame[4 + i] = (s->audio_seq >> (i * 8)) & 0xff;
+		frame[8 + i] = (timestamp >> (i * 8)) & 0xff;
+	}
+	s->audio_seq++;
+
+	if (s->adpcm){
+		frame[12] = s->adpcm_state.predictor & 0xff;
+		frame[13] = (s->adpcm_state.predictor >> 8) & 0xff;
+		frame[14] = s->adpcm_state.index;
+		frame[15] = count & 1;
+		length = 16 + adpcm_encode(&s->adpcm_state, remote_samples, count, frame + 16);
+	}
+	else {
+		memcpy(frame + 12, remote_samples, count * sizeof(int16_t));
+		length = 12 + count * sizeof(int16_t);
+	}
+	mg_ws_send(c, frame, length, WEBSOCKET_OP_BINARY);
+}
+
+static void web_send_spectrum(struct mg_connection *c, struct web_session *s){
+	uint8_t bins[MAX_BINS], frame[4 + MAX_BINS];
+	int tx;
+	int n = web_get_spectrum_bins(bins, &tx);
+	int key = !s->delta || n != s->last_n || tx != s->last_tx
+		|| s->frames_since_key >= WEB_KEY_FRAMES;
+	int length;
+
+	frame[1] = tx;
+	frame[2] = n & 0xff;
+	frame[3] = n >> 8;
+	if (key){
+		frame[0] = 'S';
+		memcpy(frame + 4, bins, n);
+		memcpy(s->last, bins, n);
+		length = 4 + n;
+		s->frames_since_key = 0;
+	}
+	else {
+		frame[0] = 'D';
+		memset(frame + 4, 0, (n + 1) / 2);
+		for (int i = 0; i < n; i++){
+			int d = bins[i] - s->last[i];
+			if (d < -8)
+				d = -8;
+			else if (d > 7)
+				d = 7;
+			s->last[i] += d;
+			frame[4 + i / 2] |= (d & 0x0f) << ((i & 1) * 4);
+		}
+		length = 4 + (n + 1) / 2;
+		s->frames_since_key++;
+	}
+	s->last_n = n;
+	s->last_tx = tx;
+	mg_ws_send(c, frame, length, WEBSOCKET_OP_BINARY);
+}
 
 static void get_spectrum(struct mg_connection *c){
+	struct web_session *s = (struct web_session *)c->fn_data;
 	char buff[3000];
-	web_get_spectrum(buff);
-	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	if (!web_is_behind(c, s)){
+		web_get_spectrum(buff);
+		mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	}
 	get_updates(c, 0);
 }
 
 static void get_audio(struct mg_connection *c){
-	char buff[3000];
-	web_get_spectrum(buff);
-	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
-	get_updates(c, 0);
+	struct web_session *s = (struct web_session *)c->fn_data;
+
+	get_spectrum(c);
 
-	int count = remote_audio_output(remote_samples);		
-	if (count > 0)
+	// the browsers that poll take the samples without the header
+	int count = remote_audio_read(&s->audio_cursor, remote_samples,
+		sizeof(remote_samples) / sizeof(int16_t));
+	if (count > 0 && !web_is_behind(c, s))
 		mg_ws_send(c, remote_samples, count * sizeof(int16_t), WEBSOCKET_OP_BINARY);
 }
 
+/* 'stream=<frames per second> [audio[=8000|12000|16000]] [adpcm] [delta]',
+	0 frames per second goes back to polling. The audio rate is the same
+	for all the sessions, the last one to ask sets it */
+static void set_stream(struct mg_connection *c, char *args){
+	struct web_session *s = (struct web_session *)c->fn_data;
+	char *p;
+
+	s->fps = 0;
+	s->audio = 0;
+	s->adpcm = 0;
+	s->delta = 0;
+	if (!args)
+		return;
+	s->fps = atoi(args);
+	if (s->fps < 0)
+		s->fps = 0;
+	if (s->fps > 50)
+		s->fps = 50;
+	if ((p = strstr(args, "audio")) != NULL){
+		s->audio = 1;
+		s->audio_cursor = remote_audio_cursor();
+		if (p[5] == '=')
+			remote_audio_set_rate(atoi(p + 6));
+	}
+	if (strstr(args, "adpcm")){
+		s->adpcm = 1;
+		memset(&s->adpcm_state, 0, sizeof(s->adpcm_state));
+	}
+	if (strstr(args, "delta"))
+		s->delta = 1;
+	s->last_n = 0;
+	s->next_frame = 0;
+}
+
+/* The mic uplink
+
+	A browser that transmits sends its mic as binary frames, laid out
+	like the audio that goes to it ('A' or 'I', above), the timestamps
+	in the browser's own sample clock.
+
+	One session has the mic at a time, the first one to send while the
+	mic is free. If its frames stop for WEB_MIC_TIMEOUT msec (the link is
+	gone, the browser tab is asleep) or it closes, the mic is let go and
+	the radio goes back to receive.
+*/
+
+#define WEB_MIC_TIMEOUT 500
+
+static struct web_session *mic_owner = NULL;
+static uint64_t mic_last_frame;
+
+static void web_mic_release(){
+	unsigned int underruns, late;
+	int depth;
+
+	if (!mic_owner)
+		return;
+	remote_mic_stats(&underruns, &late, &depth);
+	printf("web mic released, %u frames lost, %u late, %u underruns\n",
+		mic_owner->mic_lost, late, underruns);
+	mic_owner = NULL;
+	remote_mic_release();
+	if (is_in_tx())
+		remote_execute("r");
+}
+
+static void web_mic_frame(struct web_session *s, uint8_t *frame, int length){
+	int16_t samples[8192];
+	int count;
+
+	if (!s->logged_in || length < 12 || (mic_owner && mic_owner != s))
+		return;
+
+	int rate = frame[2] | (frame[3] << 8);
+	uint32_t seq = frame[4] | (frame[5] << 8) | (frame[6] << 16)
+		| ((uint32_t)frame[7] << 24);
+	uint32_t timestamp = frame[8] | (frame[9] << 8) | (frame[10] << 16)
+		| ((uint32_t)frame[11] << 24);
+
+	if (frame[0] == 'A'){
+		count = (length - 12) / 2;
+		if (count > 8192)
+			count = 8192;
+		memcpy(samples, frame + 12, count * sizeof(int16_t));
+	}
+	else if (frame[0] == 'I' && length > 16){
+		struct adpcm_state state;
+		state.predictor = (int16_t)(frame[12] | (frame[13] << 8));
+		state.index = frame[14] > 88 ? 88 : frame[14];
+		count = (length - 16) * 2 - (frame[15] & 1);
+		if (count > 8192)
+			count = 8192;
+		adpcm_decode(&state, frame + 16, count, samples);
+	}
+	else
+		return;
+
+	if (mic_owner != s)
+		s->mic_seq = seq;
+	else if (seq != s->mic_seq)
+		s->mic_lost += seq - s->mic_seq;
+	s->mic_seq = seq + 1;
+	mic_owner = s;
+	mic_last_frame = mg_millis();
+	remote_mic_write(timestamp, rate, samples, count);
+}
+
+/* the dsp wakes the mongoose loop through a socketpair after every block,
+	the sessions that stream get their frames when they are due */
+static int wakeup_fd = -1;
+
+void webserver_wakeup(){
+	if (wakeup_fd != -1)
+		send(wakeup_fd, "w", 1, MSG_DONTWAIT);
+}
+
+static void web_push(struct mg_connection *pipe, int ev, void *ev_data, void *fn_data){
+	struct mg_connection *c;
+	uint64_t now = mg_millis();
+
+	if (ev != MG_EV_READ)
+		return;
+	pipe->recv.len = 0;
+
+	if (mic_owner && now > mic_last_frame + WEB_MIC_TIMEOUT)
+		web_mic_release();
+
+	for (c = mgr.conns; c; c = c->next){
+		struct web_session *s = (struct web_session *)c->fn_data;
+		if (!c->is_websocket || !s || !s->logged_in || !s->fps || c->is_draining)
+			continue;
+		if (web_is_behind(c, s)){
+			// the audio it missed is not worth catching up on
+			s->audio_cursor = remote_audio_cursor();
+			continue;
+		}
+		// the audio goes out every 40 msec
+		if (s->audio && now >= s->next_audio){
+			web_send_audio(c, s);
+			s->next_audio = now + 40;
+		}
+		if (now >= s->next_frame){
+			s->next_frame = now + 1000 / s->fps;
+			web_send_spectrum(c, s);
+			get_updates(c, 0);
+		}
+	}
+	(void) ev_data, (void) fn_data;
+}
+
 static void get_logs(struct mg_connection *c, char *args){
 	char logbook_path[200];
 	char row_response[1000], row[1000];
@@ -127,6 +476,12 @@ char request[200];
 int request_index = 0;
 
 static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
+	struct web_session *s = (struct web_session *)c->fn_data;
+
+	if ((wm->flags & 15) == WEBSOCKET_OP_BINARY){
+		web_mic_frame(s, (uint8_t *)wm->data.ptr, wm->data.len);
+		return;
+	}
 	if (wm->data.len > 99)
 		return;
 
@@ -155,11 +510,13 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 		printf("trying login with passkey : [%s]\n", value);
 		do_login(c, value);
 	}
-	else if (cookie == NULL || strcmp(cookie, session_cookie)){
+	else if (cookie == NULL || !s->logged_in || strcmp(cookie, s->cookie)){
 		web_respond(c, "quit expired");
-		printf("Cookie not found, closing socket %s vs %s\n", cookie, session_cookie);
+		printf("Cookie not found, closing socket %s vs %s\n", cookie, s->cookie);
 		c->is_draining = 1;
 	}
+	else if (!strcmp(field, "stream"))
+		set_stream(c, value);
 	else if (!strcmp(field, "spectrum"))
 		get_spectrum(c);
 	else if (!strcmp(field, "audio"))
@@ -170,6 +527,15 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 		get_macros_list(c);
 	else if (!strcmp(field, "refresh"))
 		get_updates(c, 1);
+	else if (!strcmp(field, "audio_depth")){
+		if (value)
+			sscanf(value, "%d %d", &s->audio_depth, &s->audio_target);
+	}
+	else if (!strcmp(field, "mic")){
+		// 'mic=off' as the ptt is let go, without waiting for the timeout
+		if (mic_owner == s)
+			web_mic_release();
+	}
 	else{
 		char buff[1200];
 		if (value)
@@ -181,6 +547,171 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 	}
 }
 
+/* The static files
+
+	The build keeps a gzip (and a brotli, if it is installed) copy of
+	each page, script and style sheet next to it in web/. The browser
+	gets the smallest one that it accepts, as long as it is not older
+	than the file itself (someone edited the file and didn't rebuild).
+
+	The ETag is a hash of the contents and the encoding, a browser that
+	has the file already asks with If-None-Match and gets a 304 instead
+	of the file. The hashes are kept till the size or the time of the
+	file changes, so a file is read once to hash it.
+*/
+
+#define WEB_ETAGS 64
+
+struct web_etag {
+	char path[MG_PATH_MAX];
+	size_t size;
+	time_t mtime;
+	uint64_t hash;
+};
+
+static struct web_etag etags[WEB_ETAGS];
+static int etag_next = 0;
+
+static const char *web_mime_types[] = {
+	".html", "text/html; charset=utf-8",
+	".js", "text/javascript; charset=utf-8",
+	".css", "text/css; charset=utf-8",
+	".png", "image/png",
+	".jpg", "image/jpeg",
+	".svg", "image/svg+xml",
+	".ico", "image/x-icon",
+	".json", "application/json",
+	NULL, "text/plain; charset=utf-8"
+};
+
+static const char *web_mime(const char *path){
+	int len = strlen(path), i;
+	for (i = 0; web_mime_types[i]; i += 2){
+		int n = strlen(web_mime_types[i]);
+		if (len > n && !strcmp(path + len - n, web_mime_types[i]))
+			break;
+	}
+	return web_mime_types[i + 1];
+}
+
+static char *web_read_file(const char *path, size_t *size){
+	FILE *pf = fopen(path, "r");
+	if (!pf)
+		return NULL;
+	char *data = malloc(*size + 1);
+	if (data && fread(data, 1, *size, pf) != *size){
+		free(data);
+		data = NULL;
+	}
+	fclose(pf);
+	return data;
+}
+
+// fnv-1a of the contents, 0 if it can't be read
+static uint64_t web_etag_hash(const char *path, struct stat *st){
+	int i;
+	for (i = 0; i < WEB_ETAGS; i++)
+		if (!strcmp(etags[i].path, path) && etags[i].size == st->st_size
+			&& etags[i].mtime == st->st_mtime)
+			return etags[i].hash;
+
+	size_t size = st->st_size;
+	char *data = web_read_file(path, &size);
+	if (!data)
+		return 0;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t j = 0; j < size; j++)
+		hash = (hash ^ (uint8_t)data[j]) * 1099511628211ULL;
+	free(data);
+
+	struct web_etag *e = etags + etag_next;
+	etag_next = (etag_next + 1) % WEB_ETAGS;
+	strncpy(e->path, path, sizeof(e->path) - 1);
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->hash = hash;
+	return hash;
+}
+
+// is the encoding in the Accept-Encoding, and not with q=0?
+static int web_accepts(struct mg_http_message *hm, const char *encoding){
+	struct mg_str *h = mg_http_get_header(hm, "Accept-Encoding");
+	char list[200], *token, *save;
+
+	if (!h || h->len >= sizeof(list))
+		return 0;
+	memcpy(list, h->ptr, h->len);
+	list[h->len] = 0;
+	for (token = strtok_r(list, ",", &save); token; token = strtok_r(NULL, ",", &save)){
+		while (*token == ' ')
+			token++;
+		int n = strlen(encoding);
+		if (!strncmp(token, encoding, n) && (token[n] == 0 || token[n] == ';'
+			|| token[n] == ' ')){
+			// a weight of zero (q=0, q=0.0, q=0.000) refuses it
+			char *q = strstr(token + n, "q=");
+			return !q || atof(q + 2) > 0;
+		}
+	}
+	return 0;
+}
+
+static int web_serve_static(struct mg_connection *c, struct mg_http_message *hm){
+	static const char *encodings[] = {"br", ".br", "gzip", ".gz", NULL};
+	char uri[MG_PATH_MAX], path[MG_PATH_MAX], encoded[MG_PATH_MAX + 4], etag[64];
+	const char *encoding = NULL, *file;
+	struct stat st, st_encoded;
+	struct mg_str *inm;
+
+	if (mg_url_decode(hm->uri.ptr, hm->uri.len, uri, sizeof(uri), 0) <= 0
+		|| uri[0] != '/' || strstr(uri, ".."))
+		return 0;
+	snprintf(path, sizeof(path), "%s%s%s", s_web_root, uri,
+		uri[strlen(uri) - 1] == '/' ? "index.html" : "");
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	file = path;
+	for (int i = 0; encodings[i]; i += 2){
+		snprintf(encoded, sizeof(encoded), "%s%s", path, encodings[i + 1]);
+		if (web_accepts(hm, encodings[i]) && !stat(encoded, &st_encoded)
+			&& st_encoded.st_mtime >= st.st_mtime){
+			encoding = encodings[i];
+			file = encoded;
+			st = st_encoded;
+			break;
+		}
+	}
+
+	uint64_t hash = web_etag_hash(file, &st);
+	if (!hash)
+		return 0;
+	snprintf(etag, sizeof(etag), "\"%016llx%s%s\"", (unsigned long long)hash,
+		encoding ? "-" : "", encoding ? encoding : "");
+
+	inm = mg_http_get_header(hm, "If-None-Match");
+	if (inm && mg_strstr(*inm, mg_str(etag))){
+		mg_printf(c, "HTTP/1.1 304 Not Modified\r\nEtag: %s\r\n"
+			"Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n"
+			"Content-Length: 0\r\n\r\n", etag);
+		return 1;
+	}
+
+	size_t size = st.st_size;
+	char *data = web_read_file(file, &size);
+	if (!data)
+		return 0;
+	mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s%s%s"
+		"Etag: %s\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\n"
+		"Content-Length: %lu\r\n\r\n", web_mime(path),
+		encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+		encoding ? "\r\n" : "", etag, (unsigned long)size);
+	if (mg_vcasecmp(&hm->method, "HEAD"))
+		mg_send(c, data, size);
+	free(data);
+	return 1;
+}
+
 // This RESTful server implements the following endpoints:
 //   /websocket - upgrade to Websocket, and implement websocket echo server
 //   /rest - respond with JSON string {"result": 123}
@@ -188,6 +719,22 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
   if (ev == MG_EV_OPEN) {
     // c->is_hexdumping = 1;
+  } else if (ev == MG_EV_WS_OPEN) {
+    c->fn_data = session_open();
+    if (!c->fn_data){
+      web_respond(c, "quit too many sessions");
+      c->is_draining = 1;
+    }
+  } else if (ev == MG_EV_CLOSE && c->is_websocket) {
+    struct web_session *s = (struct web_session *)c->fn_data;
+    if (s){
+      if (s->frames_dropped)
+        printf("web session closed, %u frames were dropped\n", s->frames_dropped);
+      if (mic_owner == s)
+        web_mic_release();
+      s->in_use = 0;
+    }
+    c->fn_data = NULL;
 	} else if (ev == MG_EV_ERROR || ev == MG_EV_CLOSE){
 //		if (ev == MG_EV_ERROR)
 //			printf("closing with MG_EV_ERROR : ");
@@ -202,8 +749,8 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     } else if (mg_http_match_uri(hm, "/rest")) {
       // Serve REST response
       mg_http_reply(c, 200, "", "{\"result\": %d}\n", 123);
-    } else {
-      // Serve static files
+    } else if (!web_serve_static(c, hm)) {
+      // the directories, the 404s and anything else odd
       struct mg_http_serve_opts opts = {.root_dir = s_web_root};
       mg_http_serve_dir(c, ev_data, &opts);
     }
@@ -211,7 +758,8 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     // Got websocket frame. Received data is wm->data
     struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
 //		printf("ws request,  client to %x:%d\n", c->rem.ip, c->rem.port);
-    web_despatcher(c, wm);
+    if (c->fn_data)
+      web_despatcher(c, wm);
   }
   (void) fn_data;
 }
@@ -219,6 +767,7 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 void *webserver_thread_function(void *server){
   mg_mgr_init(&mgr);  // Initialise event manager
   mg_http_listen(&mgr, s_listen_on, fn, NULL);  // Create HTTP listener
+  wakeup_fd = mg_mkpipe(&mgr, web_push, NULL, false);
   for (;;) mg_mgr_poll(&mgr, 1000);             // Infinite event loop
 	printf("exiting webserver thread\n");
 }
@@ -1,4 +1,5 @@
 void webserver_start();
 void webserver_poll();
 void webserver_stop();
+void webserver_wakeup();
 void  web_update(char *message);
@@ -2,17 +2,180 @@ function PCMPlayer(option) {
     this.init(option);
 }
 
+/* The player pulls the samples from a ring as the sound card needs them,
+instead of scheduling each block as it arrives, so that the latency stays
+where it is set rather than growing with every hiccup of the network:
+
+- it starts playing only after targetLatency msec of the audio is in
+- it plays up to maxStretch faster while it holds more than the target,
+  and slower while it holds less, till the depth is back on the target.
+  The stretch is kept to half a percent, the pitch doesn't audibly move
+- if it is ever more than dropLatency msec behind, it drops to the target
+- if it runs dry, it fades out and waits for the target depth again
+
+The blocks come with the timestamp of their first sample (in the sample
+clock of the radio, at the player's rate). A block that overlaps what is
+already in is trimmed, a gap from lost blocks is filled with silence.
+
+The ring is pulled by an AudioWorklet, on the audio thread, and this same
+file is its module. The browsers give the worklets only to https pages,
+on a plain http page the ring is pulled by a ScriptProcessor instead. */
+
+//the script is loaded again as the worklet's module, remember where it is
+var pcmPlayerSrc = typeof document !== 'undefined' && document.currentScript ?
+    document.currentScript.src : 'pcm-player.js';
+
+function PCMRing(option) {
+    this.option = option;
+    this.ring = new Float32Array(option.sampleRate * 4);   //mono, four seconds
+    this.head = 0;          //samples ever written
+    this.position = 0;      //where the playout is, fractional
+    this.end = -1;          //the timestamp after the last block
+    this.playing = false;
+    this.fade = 0;
+    this.last = 0;
+    this.underruns = 0;
+    this.dropped = 0;       //msec of audio dropped to catch up
+}
+
+//the timestamp is optional, without it the blocks are played back to back
+PCMRing.prototype.feed = function(data, timestamp, lost) {
+    var size = this.ring.length;
+    var start = 0;
+
+    if (timestamp !== undefined && this.end >= 0) {
+        var gap = timestamp - this.end;
+        if (gap < 0)
+            start = Math.min(-gap, data.length);
+        else if (gap > 0 && lost && gap < size / 4) {
+            for (var i = 0; i < gap; i++)
+                this.ring[this.head++ % size] = 0;
+        }
+    }
+    for (var i = start; i < data.length; i++)
+        this.ring[this.head++ % size] = data[i];
+    if (timestamp !== undefined)
+        this.end = timestamp + data.length;
+
+    //the ring overflowed, the oldest samples are gone
+    if (this.head - this.position > size)
+        this.position = this.head - size / 2;
+};
+
+//msec of the audio waiting to be played
+PCMRing.prototype.depth = function() {
+    return (this.head - this.position) * 1000 / this.option.sampleRate;
+};
+
+//fills data with the audio, at the sound card's rate
+PCMRing.prototype.pull = function(data, rate) {
+    var size = this.ring.length;
+    var target = this.option.targetLatency;
+    var depth = this.depth();
+
+    if (!this.playing && depth >= target)
+        this.playing = true;
+
+    if (this.playing && depth > Math.max(this.option.dropLatency, target * 2)) {
+        var drop = Math.floor((depth - target) * this.option.sampleRate / 1000);
+        this.position += drop;
+        this.dropped += depth - target;
+        depth = target;
+    }
+
+    //steer the rate to bring the depth to the target
+    var steer = Math.max(-1, Math.min(1, (depth - target) / target));
+    var step = this.option.sampleRate / rate * (1 + this.option.maxStretch * steer);
+
+    for (var i = 0; i < data.length; i++) {
+        if (this.playing && this.position + 1 < this.head) {
+            var n = Math.floor(this.position);
+            var frac = this.position - n;
+            this.last = this.ring[n % size] * (1 - frac) + this.ring[(n + 1) % size] * frac;
+            this.position += step;
+            this.fade = 1;
+            data[i] = this.last;
+        }
+        else {
+            if (this.playing) {
+                this.playing = false;
+                this.underruns++;
+            }
+            //fade out from the last sample, no click
+            this.fade *= 0.995;
+            data[i] = this.last * this.fade;
+        }
+    }
+};
+
+//in the worklet's scope, the processor that pulls the ring
+if (typeof registerProcessor === 'function') {
+    class PCMPlayerProcessor extends AudioWorkletProcessor {
+        constructor(options) {
+            super();
+            this.ring = new PCMRing(options.processorOptions);
+            this.quanta = 0;
+            this.port.onmessage = (event) => {
+                var m = event.data;
+                if (m.samples)
+                    this.ring.feed(m.samples, m.timestamp, m.lost);
+                if (m.targetLatency !== undefined)
+                    this.ring.option.targetLatency = m.targetLatency;
+            };
+        }
+
+        process(inputs, outputs) {
+            var out = outputs[0];
+            this.ring.pull(out[0], sampleRate);
+            for (var channel = 1; channel < out.length; channel++)
+                out[channel].set(out[0]);
+
+            //tell the page how deep the ring is, about every 40 msec
+            if (++this.quanta % 16 == 0)
+                this.port.postMessage({depth: this.ring.depth(),
+                    underruns: this.ring.underruns, dropped: this.ring.dropped});
+            return true;
+        }
+    }
+    registerProcessor('pcm-player', PCMPlayerProcessor);
+}
+
 PCMPlayer.prototype.createContext = function() {
     this.audioCtx = new (window.AudioContext || window.webkitAudioContext)();
 
     // context needs to be resumed on iOS and Safari (or it will stay in "suspended" state)
     this.audioCtx.resume();
     this.audioCtx.onstatechange = () => console.log(this.audioCtx.state);   // if you want to see "Running" state in console and be happy about it
-    
-    this.gainNode = this.audioCtx.createGain();	 //we create a gain node 
+
+    this.gainNode = this.audioCtx.createGain();	 //we create a gain node
     this.gainNode.gain.value = 1;								 //that has a gain of 1
     this.gainNode.connect(this.audioCtx.destination);	//it is connected to the output of the audiocontext
-    this.startTime = this.audioCtx.currentTime;	 //suppose to start already
+
+    if (this.audioCtx.audioWorklet) {
+        //the blocks that arrive before the worklet is loaded wait here
+        this.pending = [];
+        this.audioCtx.audioWorklet.addModule(pcmPlayerSrc).then(() => {
+            if (!this.audioCtx)
+                return;
+            this.processor = new AudioWorkletNode(this.audioCtx, 'pcm-player', {
+                numberOfInputs: 0,
+                outputChannelCount: [this.option.channels],
+                processorOptions: this.option
+            });
+            this.processor.port.onmessage = (event) => {
+                this.stats = event.data;
+            };
+            this.processor.connect(this.gainNode);
+            this.pending.forEach((m) => this.processor.port.postMessage(m, [m.samples.buffer]));
+            this.pending = null;
+        });
+    }
+    else {
+        this.ring = new PCMRing(this.option);
+        this.processor = this.audioCtx.createScriptProcessor(1024, 0, this.option.channels);
+        this.processor.onaudioprocess = this.pull;
+        this.processor.connect(this.gainNode);
+    }
 };
 
 PCMPlayer.prototype.init = function(option) {
@@ -20,15 +183,18 @@ PCMPlayer.prototype.init = function(option) {
         encoding: '16bitInt',
         channels: 1,
         sampleRate: 8000,
-        flushingTime: 1000
+        targetLatency: 150,     //msec
+        dropLatency: 1000,
+        maxStretch: 0.005
     };
-		
+
     this.option = Object.assign({}, defaults, option); 	//we store the options
-    this.samples = new Float32Array();									//we add an empty array with zero elements
-    this.flush = this.flush.bind(this);									//flush will work with this instance
-    this.interval = setInterval(this.flush, this.option.flushingTime); //flush is called every second
-    this.maxValue = this.getMaxValue();									//max value for each sample 
+    this.maxValue = this.getMaxValue();									//max value for each sample
     this.typedArray = this.getTypedArray();							//?
+    this.ring = null;       //on this thread only without the worklet
+    this.processor = null;
+    this.stats = {depth: 0, underruns: 0, dropped: 0};	//as last told by the worklet
+    this.pull = this.pull.bind(this);
     this.createContext();																//calling createContext
 };
 
@@ -59,17 +225,24 @@ PCMPlayer.prototype.isTypedArray = function(data) {
     return (data.byteLength && data.buffer && data.buffer.constructor == ArrayBuffer);
 };
 
-PCMPlayer.prototype.feed = function(data) {
+//the timestamp is optional, without it the blocks are played back to back
+PCMPlayer.prototype.feed = function(data, timestamp, lost) {
     if (!this.isTypedArray(data)) return; //we need a typed array alone
     data = this.getFormatedValue(data);		//this keeps values within +/- 1 and float
-    var tmp = new Float32Array(this.samples.length + data.length); // we create a new array to include current and previous samples
-    tmp.set(this.samples, 0); //copy over the previous samples
-    tmp.set(data, this.samples.length); //then the current samples
-    this.samples = tmp; //swap the old samples array with the new one
+
+    if (this.ring) {
+        this.ring.feed(data, timestamp, lost);
+        return;
+    }
+    var m = {samples: data, timestamp: timestamp, lost: lost};
+    if (this.pending)
+        this.pending.push(m);
+    else if (this.processor)
+        this.processor.port.postMessage(m, [data.buffer]);
 };
 
 PCMPlayer.prototype.getFormatedValue = function(data) {
-    var data = new this.typedArray(data.buffer),
+    var data = new this.typedArray(data.buffer, data.byteOffset, data.length),
         float32 = new Float32Array(data.length),
         i;
 
@@ -83,55 +256,40 @@ PCMPlayer.prototype.volume = function(volume) {
     this.gainNode.gain.value = volume;
 };
 
+PCMPlayer.prototype.setLatency = function(msec) {
+    this.option.targetLatency = msec;
+    if (this.ring)
+        this.ring.option.targetLatency = msec;
+    else if (this.processor)
+        this.processor.port.postMessage({targetLatency: msec});
+};
+
+//msec of the audio waiting to be played
+PCMPlayer.prototype.depth = function() {
+    return this.ring ? this.ring.depth() : this.stats.depth;
+};
+
+//what we hear lags the radio by the depth and the sound card's own buffers
+PCMPlayer.prototype.latency = function() {
+    var card = (this.audioCtx.baseLatency || 0) + (this.audioCtx.outputLatency || 0);
+    return this.depth() + card * 1000;
+};
+
 PCMPlayer.prototype.destroy = function() {
-    if (this.interval) {
-        clearInterval(this.interval);
-    }
-    this.samples = null;
+    if (this.processor)
+        this.processor.disconnect();
+    this.ring = null;
+    this.pending = null;
     this.audioCtx.close();
     this.audioCtx = null;
 };
 
-//this is called once every second
-PCMPlayer.prototype.flush = function() {
-		//if there are no samples to play, return
-    if (!this.samples.length) return;
-		
-    var bufferSource = this.audioCtx.createBufferSource(),	// creata buffer
-        length = this.samples.length / this.option.channels,
-        audioBuffer = this.audioCtx.createBuffer(this.option.channels, length, this.option.sampleRate),
-        audioData,
-        channel,
-        offset,
-        i,
-        decrement;
-
-    for (channel = 0; channel < this.option.channels; channel++) {
-        audioData = audioBuffer.getChannelData(channel);
-        offset = channel;
-        decrement = 50;
-        for (i = 0; i < length; i++) {
-            audioData[i] = this.samples[offset];
-            /* fadein */
-            if (i < 50) {
-                audioData[i] =  (audioData[i] * i) / 50;
-            }
-            /* fadeout*/
-            if (i >= (length - 51)) {
-                audioData[i] =  (audioData[i] * decrement--) / 50;
-            }
-            offset += this.option.channels;
-        }
-    }
-    
-    if (this.startTime < this.audioCtx.currentTime) {
-        this.startTime = this.audioCtx.currentTime;
-    }
-    //console.log('start vs current '+this.startTime+' vs '+this.audioCtx.currentTime+' duration: '+audioBuffer.duration);
-//		console.log("latency: " + this.audioCtx.baseLatency + ", " + this.audioCtx.outputLatency);
-    bufferSource.buffer = audioBuffer;
-    bufferSource.connect(this.gainNode);
-    bufferSource.start(this.startTime);
-    this.startTime += audioBuffer.duration;
-    this.samples = new Float32Array();
+//called by the ScriptProcessor each time it needs a block
+PCMPlayer.prototype.pull = function(event) {
+    var out = event.outputBuffer;
+    var data = out.getChannelData(0);
+
+    this.ring.pull(data, out.sampleRate);
+    for (var channel = 1; channel < out.numberOfChannels; channel++)
+        out.getChannelData(channel).set(data);
 };